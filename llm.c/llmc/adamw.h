@@ -0,0 +1,152 @@
+/*
+ The AdamW step, as one streaming pass over the parameters, gradients and both moments.
+ The optimizer does a handful of flops per parameter against 16 bytes read and 12
+ written (param, grad, m, v), so it is bound by memory bandwidth. It only gets near
+ that with every core streaming and the loop body in SIMD:
+ - the bias corrections 1 / (1 - beta^t) are computed once per step, not per element
+ - the loop body is branch-free, so it vectorizes (sqrtf needs -fno-math-errno, which
+   -Ofast implies), and with -DOMP the threads stream disjoint ranges
+ - the gradients can be zeroed as they are read, which saves the separate memset pass
+   when the backward accumulates into them (the Enzyme shadow)
+ Both passes run in chunks on the workers of the ISA llmc/cpu_dispatch.h picks for adamw.
+ Optionally the gradients are clipped to a maximum global L2 norm, which costs one
+ extra read pass over them for the norm. The norm is summed in fixed chunks, added in
+ order, so it does not depend on the thread count.
+ Under ENABLE_BF16 (bf16 weights for the GEMMs) the parameters are fp32 master weights
+ with a bf16 copy (llmc/bf16.h) that the matmuls read; the same pass writes the copy,
+ stochastically rounded, so refreshing it costs 2 more bytes per parameter and no extra
+ read.
+ reference: https://pytorch.org/docs/stable/generated/torch.optim.AdamW.html
+*/
+#ifndef ADAMW_H
+#define ADAMW_H
+
+#include <stddef.h>
+#include <math.h>
+#include "utils.h"
+#include "cpu_dispatch.h"
+#include "bf16.h"
+
+#ifndef OMP_PRAGMA
+#ifdef OMP
+#define OMP_PRAGMA(x) _Pragma(#x)
+#else
+#define OMP_PRAGMA(x)
+#endif
+#endif
+
+// gradients per chunk of the norm, and the independent partial sums within a chunk,
+// so that the sum of squares vectorizes without reassociating floats
+#define ADAMW_NORM_CHUNK 65536
+#define ADAMW_NORM_LANES 16
+// parameters per task of the update
+#define ADAMW_UPDATE_CHUNK 16384
+
+static inline void adamw_sum_squares(double* sum, const float* __restrict grads, size_t n) {
+    // *sum = the sum of squares of grads (n), in ADAMW_NORM_LANES interleaved partial sums
+    float lanes[ADAMW_NORM_LANES] = {0.0f};
+    size_t i = 0;
+    for (; i + ADAMW_NORM_LANES <= n; i += ADAMW_NORM_LANES) {
+        for (int l = 0; l < ADAMW_NORM_LANES; l++) { lanes[l] += grads[i + l] * grads[i + l]; }
+    }
+    for (; i < n; i++) { lanes[0] += grads[i] * grads[i]; }
+    double s = 0.0;
+    for (int l = 0; l < ADAMW_NORM_LANES; l++) { s += lanes[l]; }
+    *sum = s;
+}
+
+CPU_VARIANTS(, adamw_sum_squares, , (double* sum, const float* __restrict grads, size_t n),
+             (sum, grads, n))
+
+static inline float adamw_grad_norm(const float* grads, size_t n) {
+    // global L2 norm of grads (n)
+    int isa = cpu_kernel_isa(CPU_OP_ADAMW);
+    size_t num_chunks = (n + ADAMW_NORM_CHUNK - 1) / ADAMW_NORM_CHUNK;
+    double* chunk_sums = (double*)mallocCheck(num_chunks * sizeof(double));
+    OMP_PRAGMA(omp parallel for)
+    for (size_t c = 0; c < num_chunks; c++) {
+        size_t i0 = c * ADAMW_NORM_CHUNK;
+        size_t len = n - i0 < ADAMW_NORM_CHUNK ? n - i0 : ADAMW_NORM_CHUNK;
+        CPU_DISPATCH(isa, adamw_sum_squares, , &chunk_sums[c], grads + i0, len);
+    }
+    double sum = 0.0;
+    for (size_t c = 0; c < num_chunks; c++) { sum += chunk_sums[c]; }
+    free(chunk_sums);
+    return (float)sqrt(sum);
+}
+
+// the per-step constants of the update, as the chunk workers take them
+typedef struct {
+    float learning_rate, beta1, beta2, eps, weight_decay;
+    float grad_scale; // the clipping factor, 1 without clipping
+    float m_correction, v_correction; // 1 / (1 - beta^t), the bias correction of each moment
+    int zero_grads;
+    uint32_t seed; // of the stochastic rounding of the bf16 copy, different every step
+} AdamWStep;
+
+static inline void adamw_update_chunk(const AdamWStep* step, float* __restrict params, float* __restrict grads,
+                                      float* __restrict m_memory, float* __restrict v_memory,
+                                      bf16* __restrict params_bf16, size_t i0, size_t n) {
+    // parameters i0 .. i0 + n - 1 of the step; the arrays point at parameter i0
+    float learning_rate = step->learning_rate, beta1 = step->beta1, beta2 = step->beta2;
+    float eps = step->eps, weight_decay = step->weight_decay, grad_scale = step->grad_scale;
+    float m_correction = step->m_correction, v_correction = step->v_correction;
+    int zero_grads = step->zero_grads;
+    uint32_t seed = step->seed;
+    for (size_t i = 0; i < n; i++) {
+        float param = params[i];
+        float grad = grads[i] * grad_scale;
+        if (zero_grads) { grads[i] = 0.0f; }
+        // update the first moment (momentum)
+        float m = beta1 * m_memory[i] + (1.0f - beta1) * grad;
+        // update the second moment (RMSprop)
+        float v = beta2 * v_memory[i] + (1.0f - beta2) * grad * grad;
+        float m_hat = m * m_correction;
+        float v_hat = v * v_correction;
+        m_memory[i] = m;
+        v_memory[i] = v;
+        param -= learning_rate * (m_hat / (sqrtf(v_hat) + eps) + weight_decay * param);
+        params[i] = param;
+        if (params_bf16 != NULL) { params_bf16[i] = bf16_round_stochastic(param, bf16_random_bits(seed, i0 + i)); }
+    }
+}
+
+CPU_VARIANTS(, adamw_update_chunk, ,
+             (const AdamWStep* step, float* __restrict params, float* __restrict grads,
+              float* __restrict m_memory, float* __restrict v_memory,
+              bf16* __restrict params_bf16, size_t i0, size_t n),
+             (step, params, grads, m_memory, v_memory, params_bf16, i0, n))
+
+static inline float adamw_update(float* __restrict params, float* __restrict grads,
+                                 float* __restrict m_memory, float* __restrict v_memory, size_t n,
+                                 float learning_rate, float beta1, float beta2, float eps,
+                                 float weight_decay, float grad_clip, int zero_grads, int t,
+                                 bf16* __restrict params_bf16) {
+    // one AdamW step t (from 1) over n parameters. With grad_clip > 0 the gradients are first
+    // scaled down to a global norm of at most grad_clip. With zero_grads they are zeroed.
+    // If params_bf16 is not NULL, the updated parameters are also written there in bf16,
+    // stochastically rounded with random bits that depend on t and the index only.
+    // returns the global gradient norm before clipping, or -1 if it was not computed
+    float grad_norm = -1.0f;
+    float grad_scale = 1.0f;
+    if (grad_clip > 0.0f) {
+        grad_norm = adamw_grad_norm(grads, n);
+        if (grad_norm > grad_clip) { grad_scale = grad_clip / grad_norm; }
+    }
+    // bias-correct both moments, as factors on m and v
+    AdamWStep step = { learning_rate, beta1, beta2, eps, weight_decay, grad_scale,
+                       1.0f / (1.0f - powf(beta1, t)), 1.0f / (1.0f - powf(beta2, t)), zero_grads,
+                       bf16_random_bits(0x2545F491u, (size_t)t) };
+    int isa = cpu_kernel_isa(CPU_OP_ADAMW);
+    size_t num_chunks = (n + ADAMW_UPDATE_CHUNK - 1) / ADAMW_UPDATE_CHUNK;
+    OMP_PRAGMA(omp parallel for schedule(static))
+    for (size_t c = 0; c < num_chunks; c++) {
+        size_t i0 = c * ADAMW_UPDATE_CHUNK;
+        size_t len = n - i0 < ADAMW_UPDATE_CHUNK ? n - i0 : ADAMW_UPDATE_CHUNK;
+        CPU_DISPATCH(isa, adamw_update_chunk, , &step, params + i0, grads + i0, m_memory + i0,
+                     v_memory + i0, params_bf16 != NULL ? params_bf16 + i0 : NULL, i0, len);
+    }
+    return grad_norm;
+}
+
+#endif // ADAMW_H
@@ -0,0 +1,109 @@
+/*
+ bfloat16 storage, for the bf16 weights of the GEMMs in train_gpt2.c (-DENABLE_BF16).
+ A bf16 is the upper half of a float: the same 8-bit exponent, so the same range, and 7
+ bits of mantissa. Widening is a shift, narrowing is a rounding of the low 16 bits, and
+ both are integer ops on the bits that vectorize. There are two roundings:
+ - to nearest even, for values that are stored once and read back (the initial weights,
+   the residual checkpoints of the blockwise step)
+ - stochastic, for the weights the optimizer rewrites every step: an update below half a
+   bf16 ulp would round away every time, while stochastic rounding applies it on average.
+   The random bits are a hash of (seed, index), so they do not depend on the thread count
+   or on how the loop is chunked, and the loop stays vectorizable
+ The matmuls find the bf16 copy of their weights through bf16_weights, which maps a
+ pointer into the fp32 weights registered with bf16_register_weights to the same element
+ of the copy. This keeps the kernels' signatures (and the float* primal/shadow pairs
+ Enzyme passes through them) unchanged.
+ reference: https://arxiv.org/abs/1905.12322 (A Study of BFLOAT16 for Deep Learning Training)
+*/
+#ifndef BF16_H
+#define BF16_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef OMP_PRAGMA
+#ifdef OMP
+#define OMP_PRAGMA(x) _Pragma(#x)
+#else
+#define OMP_PRAGMA(x)
+#endif
+#endif
+
+typedef uint16_t bf16;
+
+static inline float bf16_to_float(bf16 h) {
+    uint32_t bits = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline uint32_t bf16_float_bits(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+// f rounded to the nearest bf16, ties to even. NaNs stay (quiet) NaNs
+static inline bf16 bf16_round(float f) {
+    uint32_t bits = bf16_float_bits(f);
+    uint32_t rounded = (bits + 0x7FFFu + ((bits >> 16) & 1u)) >> 16;
+    return (bf16)((bits & 0x7FFFFFFFu) > 0x7F800000u ? (bits >> 16) | 0x40u : rounded);
+}
+
+// 32 random bits for element i of a stream seeded by seed (the murmur3 finalizer of the
+// low 32 bits of i, offset by the seed)
+static inline uint32_t bf16_random_bits(uint32_t seed, size_t i) {
+    uint32_t h = (uint32_t)i * 0x9E3779B1u + seed;
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// f rounded up or down to a neighbouring bf16, up with probability equal to its distance
+// from the lower one in bf16 ulps, using the low 16 bits of random
+static inline bf16 bf16_round_stochastic(float f, uint32_t random) {
+    uint32_t bits = bf16_float_bits(f);
+    uint32_t rounded = (bits + (random & 0xFFFFu)) >> 16;
+    return (bf16)((bits & 0x7FFFFFFFu) > 0x7F800000u ? (bits >> 16) | 0x40u : rounded);
+}
+
+// out[i] = in[i] rounded to nearest even, for i < n
+static inline void bf16_round_array(bf16* __restrict out, const float* __restrict in, size_t n) {
+    OMP_PRAGMA(omp parallel for schedule(static))
+    for (size_t i = 0; i < n; i++) { out[i] = bf16_round(in[i]); }
+}
+
+// out[i] = in[i] widened to fp32, for i < n
+static inline void bf16_to_float_array(float* __restrict out, const bf16* __restrict in, size_t n) {
+    OMP_PRAGMA(omp parallel for schedule(static))
+    for (size_t i = 0; i < n; i++) { out[i] = bf16_to_float(in[i]); }
+}
+
+// the fp32 weights with a bf16 copy, see bf16_register_weights
+static const float* bf16_master = NULL;
+static const bf16* bf16_copy = NULL;
+static size_t bf16_count = 0;
+
+// record that copy (n elements) is the bf16 copy of the fp32 weights master. One set of
+// weights is registered at a time; master == NULL unregisters it
+static inline void bf16_register_weights(const float* master, const bf16* copy, size_t n) {
+    bf16_master = master;
+    bf16_copy = copy;
+    bf16_count = master != NULL ? n : 0;
+}
+
+// the bf16 copy of the weight w points into, or NULL if w is not in the registered weights
+static inline const bf16* bf16_weights(const float* w) {
+    uintptr_t offset = (uintptr_t)w - (uintptr_t)bf16_master;
+    if (bf16_count == 0 || (uintptr_t)w < (uintptr_t)bf16_master || offset / sizeof(float) >= bf16_count) {
+        return NULL;
+    }
+    return bf16_copy + offset / sizeof(float);
+}
+
+#endif // BF16_H
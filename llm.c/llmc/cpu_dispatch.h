@@ -0,0 +1,132 @@
+/*
+ Runtime CPU feature dispatch of the kernels, so that one binary, built for the baseline
+ x86-64 (SSE2), still runs AVX2 or AVX-512 code on the hosts that have it.
+ The kernels compile their hot loops into per-row, per-tile or per-chunk workers, and
+ CPU_VARIANTS stamps out copies of a worker compiled with target("avx2,fma") and with
+ target("avx512f,..."). flatten inlines everything the worker calls (vmath, the templated
+ shapes) into each copy, so the whole inner loop is vectorized for that ISA.
+ The copies are picked per op from a registry filled once at startup:
+ - the best ISA this CPU supports, from cpuid (via __builtin_cpu_supports, which also
+   checks that the OS saves the wide registers)
+ - overridden for every op by the environment variable GPT2_ISA, and for a single op by
+   GPT2_ISA_<OP>, e.g. GPT2_ISA=avx2 GPT2_ISA_MATMUL=generic, for A/B benchmarking.
+   The values are generic, avx2 and avx512, and forcing one the CPU (or, under
+   CPU_DISPATCH_GENERIC, the build) lacks is an error
+ A kernel reads its op's ISA once per call, outside the OpenMP region, and CPU_DISPATCH
+ calls the copy with a switch per row or tile. The worker has to be the code inside the
+ OpenMP loop, not the function holding it: the parallel region is outlined before any
+ inlining, so a target attribute on the caller would not reach the loop body.
+ Define CPU_DISPATCH_GENERIC to only build the generic workers (e.g. so that Enzyme
+ differentiates a single copy of each); it is the default off x86.
+*/
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if !defined(__x86_64__) && !defined(__i386__) && !defined(CPU_DISPATCH_GENERIC)
+#define CPU_DISPATCH_GENERIC
+#endif
+
+enum { CPU_ISA_GENERIC, CPU_ISA_AVX2, CPU_ISA_AVX512, CPU_NUM_ISAS };
+static const char* const cpu_isa_names[CPU_NUM_ISAS] = { "generic", "avx2", "avx512" };
+
+// the ops with per-ISA workers, each dispatched on its own
+enum { CPU_OP_MATMUL, CPU_OP_ATTENTION, CPU_OP_LAYERNORM, CPU_OP_GELU, CPU_OP_SOFTMAX, CPU_OP_ADAMW,
+       CPU_NUM_OPS };
+static const char* const cpu_op_names[CPU_NUM_OPS] = {
+    "matmul", "attention", "layernorm", "gelu", "softmax", "adamw"
+};
+
+#ifndef CPU_DISPATCH_GENERIC
+#define CPU_TARGET_AVX2 __attribute__((target("avx2,fma"), flatten))
+#define CPU_TARGET_AVX512 __attribute__((target("avx512f,avx512vl,avx512dq,avx512bw,avx2,fma"), flatten))
+
+// the AVX2 and AVX-512 copies fn_avx2 and fn_avx512 of the worker fn (a template if tmpl is
+// template <...>, called as fn targs). params is the parenthesized parameter list, args the
+// call's argument list
+#define CPU_VARIANTS(tmpl, fn, targs, params, args) \
+    tmpl CPU_TARGET_AVX2 static void fn##_avx2 params { fn targs args; } \
+    tmpl CPU_TARGET_AVX512 static void fn##_avx512 params { fn targs args; }
+
+// call the copy of fn for isa
+#define CPU_DISPATCH(isa, fn, targs, ...) \
+    switch (isa) { \
+        case CPU_ISA_AVX512: fn##_avx512 targs(__VA_ARGS__); break; \
+        case CPU_ISA_AVX2: fn##_avx2 targs(__VA_ARGS__); break; \
+        default: fn targs(__VA_ARGS__); break; \
+    }
+#else
+#define CPU_VARIANTS(tmpl, fn, targs, params, args)
+#define CPU_DISPATCH(isa, fn, targs, ...) do { (void)(isa); fn targs(__VA_ARGS__); } while (0)
+#endif
+
+static int cpu_dispatch_table[CPU_NUM_OPS];
+static int cpu_dispatch_detected = -1; // the best ISA of the CPU, -1 before cpu_dispatch_init
+
+static inline int cpu_isa_detect(void) {
+#ifndef CPU_DISPATCH_GENERIC
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+        __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512bw")) {
+        return CPU_ISA_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return CPU_ISA_AVX2;
+    }
+#endif
+    return CPU_ISA_GENERIC;
+}
+
+// the ISA named by the environment variable var, or fallback if it is not set
+static inline int cpu_isa_from_env(const char* var, int fallback) {
+    const char* name = getenv(var);
+    if (name == NULL || name[0] == '\0') { return fallback; }
+    for (int isa = 0; isa < CPU_NUM_ISAS; isa++) {
+        if (strcmp(name, cpu_isa_names[isa]) != 0) { continue; }
+        if (isa > cpu_dispatch_detected) {
+            fprintf(stderr, "Error: %s=%s, but only up to %s is available on this CPU and build\n",
+                    var, name, cpu_isa_names[cpu_dispatch_detected]);
+            exit(EXIT_FAILURE);
+        }
+        return isa;
+    }
+    fprintf(stderr, "Error: %s=%s is not one of generic, avx2, avx512\n", var, name);
+    exit(EXIT_FAILURE);
+}
+
+// detect the CPU and fill the registry. Runs on the first cpu_kernel_isa, or can be
+// called up front; either way not from inside a parallel region
+static inline void cpu_dispatch_init(void) {
+    if (cpu_dispatch_detected >= 0) { return; }
+    cpu_dispatch_detected = cpu_isa_detect();
+    int all = cpu_isa_from_env("GPT2_ISA", cpu_dispatch_detected);
+    for (int op = 0; op < CPU_NUM_OPS; op++) {
+        char var[64] = "GPT2_ISA_";
+        size_t len = strlen(var);
+        for (const char* c = cpu_op_names[op]; *c != '\0'; c++) { var[len++] = (char)toupper(*c); }
+        var[len] = '\0';
+        cpu_dispatch_table[op] = cpu_isa_from_env(var, all);
+    }
+}
+
+// the ISA whose workers op runs
+static inline int cpu_kernel_isa(int op) {
+    cpu_dispatch_init();
+    return cpu_dispatch_table[op];
+}
+
+static inline void cpu_dispatch_print(void) {
+    cpu_dispatch_init();
+    // e.g. "cpu: avx512 | matmul avx512, attention avx2, ..."
+    printf("cpu: %s |", cpu_isa_names[cpu_dispatch_detected]);
+    for (int op = 0; op < CPU_NUM_OPS; op++) {
+        printf(" %s %s%s", cpu_op_names[op], cpu_isa_names[cpu_dispatch_table[op]],
+               op + 1 < CPU_NUM_OPS ? "," : "\n");
+    }
+}
+
+#endif // CPU_DISPATCH_H
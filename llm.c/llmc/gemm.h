@@ -0,0 +1,660 @@
+/*
+ Cache-blocked, panel-packed single precision GEMM, used by the matmul layers.
+ The structure is the usual Goto/BLIS one:
+ - the N dimension is cut into NC-wide blocks and K into KC-deep blocks, and the
+   KC x NC block of B is packed once into NR-wide column panels
+ - the M dimension is cut into MC-high blocks, and each MC x KC block of A is packed
+   into MR-high row panels by the thread that consumes it
+ - a MR x NR micro-kernel multiplies one A panel by one B panel, keeping the
+   MR x NR tile of C in registers for the whole KC loop (the compiler turns the
+   inner update into FMAs with -Ofast/-march=native)
+ Packing pads partial panels with zeros, so any M, N, K are handled: the
+ micro-kernel always runs full tiles, and only the writeback of edge tiles is masked.
+ The tasks run as workers for the ISA llmc/cpu_dispatch.h picks for the matmul op: the
+ micro-kernel is written for a vector of VL floats, VL being 16 for AVX-512, 8 for AVX2,
+ and for the generic worker whatever the baseline -march gives (GEMM_VL).
+ With -DOMP the (MC block, N chunk) tasks of every KC step run in parallel, so both
+ tall (training, M = B*T) and short and wide (decode, the LM head) shapes use all cores.
+ Every task owns its tile of C and the KC steps run in order, so accumulating into C
+ (the matmul backward) has no write races and does not depend on the thread count.
+ gemm_sgemm_ex can store C in blocks instead of row-major (see GemmLayout), which
+ lets the qkv matmul write its output straight into the head-major layout attention reads,
+ and read A the same way, so its backward takes the gradient in that layout as it is,
+ can finish every tile of C with an epilogue (see GemmEpilogue) while it is in L1,
+ which fuses the GELU and the residual add that follow the MLP matmuls, and can
+ LayerNorm the rows of A as it packs them (see GemmPrologue), so the matmuls that
+ consume a layernorm can read the raw residual stream instead of a normalized copy.
+ B can also be stored in bf16 (llmc/bf16.h), e.g. the weights under ENABLE_BF16:
+ it is widened to fp32 as it is packed or streamed, so the products and sums stay fp32 and
+ only the reads of B shrink.
+*/
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <stddef.h>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include "utils.h"
+#include "vmath.h"
+#include "cpu_dispatch.h"
+#include "bf16.h"
+
+#ifndef OMP_PRAGMA
+#ifdef OMP
+#define OMP_PRAGMA(x) _Pragma(#x)
+#else
+#define OMP_PRAGMA(x)
+#endif
+#endif
+
+// register tile: MR rows of C, each held as two vectors of VL floats, so NR = 2 * VL
+// and 2 * MR accumulators (12 of the 16 ymm on AVX2, 12 of the 32 zmm on AVX-512).
+// GEMM_VL is the VL of the generic worker, from the baseline -march
+#if defined(__AVX512F__)
+#define GEMM_VL 16
+#elif defined(__AVX__)
+#define GEMM_VL 8
+#else
+#define GEMM_VL 4
+#endif
+#define GEMM_MR 6
+// cache blocking: an A block (MC x KC) stays in L2, a B panel (KC x NR) in L1,
+// and the packed B block (KC x NC) in L3
+#define GEMM_MC 72
+#define GEMM_KC 256
+#define GEMM_NC 4096
+// columns of the packed B block handled by one parallel task
+#define GEMM_NB 256
+// below this many rows gemm_small_m streams B instead of packing it
+#ifndef GEMM_SMALL_M
+#define GEMM_SMALL_M 16
+#endif
+
+// a blocked storage of C (or A) for gemm_sgemm_ex: the matrix is cut into blocks of rows x cols
+// elements, each stored row-major with row stride cols, and block (ib, jb) starts at
+// ib * row_block_stride + jb * col_block_stride. E.g. the qkv activations, (B,T,3C)
+// as a matrix, are stored (B, 3, NH, T, hs) with rows = T and cols = hs.
+typedef struct {
+    int rows;
+    int cols;
+    size_t row_block_stride;
+    size_t col_block_stride;
+} GemmLayout;
+
+// offset of row i and of column j of a matrix in a GemmLayout; element (i, j) is at their sum
+static inline size_t gemm_layout_row(const GemmLayout* layout, int i) {
+    return (size_t)(i / layout->rows) * layout->row_block_stride + (size_t)(i % layout->rows) * layout->cols;
+}
+
+static inline size_t gemm_layout_col(const GemmLayout* layout, int j) {
+    return (size_t)(j / layout->cols) * layout->col_block_stride + j % layout->cols;
+}
+
+// a LayerNorm of the rows of op(A), applied by gemm_sgemm_ex as it packs A: element
+// (i, k) is read as (A(i, k) - mean[i]) * rstd[i] * weight[k] + bias[k], the same
+// arithmetic as layernorm_forward, with mean and rstd (length M) from its statistics
+typedef struct {
+    const float* mean;
+    const float* rstd;
+    const float* weight;
+    const float* bias;
+} GemmPrologue;
+
+static inline float gemm_layernorm(const GemmPrologue* prologue, float x, int i, int k) {
+    float n = prologue->rstd[i] * (x - prologue->mean[i]);
+    return n * prologue->weight[k] + prologue->bias[k];
+}
+
+// what gemm_sgemm_ex does to every element of C once its sum over K is complete.
+// aux is a second (M x N) matrix with row stride ldaux:
+// - GEMM_EPILOGUE_GELU: C keeps bias + op(A) op(B), and aux = gelu(C)
+// - GEMM_EPILOGUE_RESIDUAL: C = aux + bias + op(A) op(B), aux being the residual stream
+enum { GEMM_EPILOGUE_GELU = 1, GEMM_EPILOGUE_RESIDUAL = 2 };
+typedef struct {
+    int kind;
+    float* aux;
+    int ldaux;
+} GemmEpilogue;
+
+// the tanh approximation of GeLU, written as gelu_forward computes it
+static inline float gemm_gelu(float x) {
+    float cube = 0.044715f * x * x * x;
+    return 0.5f * x * (1.0f + vmath_tanhf(sqrtf(2.0f / M_PI) * (x + cube)));
+}
+
+// apply the epilogue to the finished m x n tile of C at (i0, j0); c points at the tile
+static inline void gemm_epilogue_tile(const GemmEpilogue* epilogue, float* c, int ldc,
+                                      int i0, int j0, int m, int n) {
+    for (int i = 0; i < m; i++) {
+        float* c_i = c + (size_t)i * ldc;
+        float* aux_i = epilogue->aux + (size_t)(i0 + i) * epilogue->ldaux + j0;
+        if (epilogue->kind == GEMM_EPILOGUE_GELU) {
+            for (int j = 0; j < n; j++) { aux_i[j] = gemm_gelu(c_i[j]); }
+        } else {
+            for (int j = 0; j < n; j++) { c_i[j] += aux_i[j]; }
+        }
+    }
+}
+
+// an element of B as fp32, whether B is stored in fp32 or bf16
+static inline float gemm_load(float x) { return x; }
+static inline float gemm_load(bf16 x) { return bf16_to_float(x); }
+
+// offset of element (i, k) of op(A) in an A stored as a_layout describes
+static inline size_t gemm_a_offset(const GemmLayout* a_layout, int transa, int i, int k) {
+    int r = transa ? k : i, c = transa ? i : k; // the row and the column of A itself
+    return gemm_layout_row(a_layout, r) + gemm_layout_col(a_layout, c);
+}
+
+// element (i, k) of op(A), for a row-major A and in general, and (k, j) of op(B)
+#define GEMM_A_ROWS(i, k) (transa ? A[(size_t)(k) * lda + (i)] : A[(size_t)(i) * lda + (k)])
+#define GEMM_A(i, k) (a_layout != NULL ? A[gemm_a_offset(a_layout, transa, i, k)] : GEMM_A_ROWS(i, k))
+#define GEMM_B(k, j) gemm_load(transb ? B[(size_t)(j) * ldb + (k)] : B[(size_t)(k) * ldb + (j)])
+
+static inline void gemm_pack_a(float* __restrict apack, const float* A, int lda, int transa,
+                               const GemmLayout* a_layout, int ic, int mc, int pc, int kc,
+                               const GemmPrologue* prologue) {
+    // MR-high row panels, each stored k-major: apack[panel][p][i]
+    // with a_layout, element (ic + i, pc + p) of op(A) is at a_row[i] + a_col[p]
+    size_t a_row[GEMM_MC], a_col[GEMM_KC];
+    for (int i = 0; a_layout != NULL && i < mc; i++) { a_row[i] = gemm_a_offset(a_layout, transa, ic + i, 0); }
+    for (int p = 0; a_layout != NULL && p < kc; p++) { a_col[p] = gemm_a_offset(a_layout, transa, 0, pc + p); }
+    for (int ir = 0; ir < mc; ir += GEMM_MR) {
+        int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+        float* panel = apack + (size_t)ir * kc;
+        for (int p = 0; p < kc; p++) {
+            if (prologue != NULL) {
+                for (int i = 0; i < mr; i++) {
+                    float a = a_layout != NULL ? A[a_row[ir + i] + a_col[p]] : GEMM_A_ROWS(ic + ir + i, pc + p);
+                    panel[p * GEMM_MR + i] = gemm_layernorm(prologue, a, ic + ir + i, pc + p);
+                }
+            } else {
+                for (int i = 0; i < mr; i++) {
+                    panel[p * GEMM_MR + i] = a_layout != NULL ? A[a_row[ir + i] + a_col[p]] : GEMM_A_ROWS(ic + ir + i, pc + p);
+                }
+            }
+            for (int i = mr; i < GEMM_MR; i++) { panel[p * GEMM_MR + i] = 0.0f; }
+        }
+    }
+}
+
+template <typename TB>
+static inline void gemm_pack_b(float* __restrict bpack, const TB* B, int ldb, int transb,
+                               int jc, int nc, int pc, int kc, int nr_panel) {
+    // nr_panel-wide column panels (the NR of the micro-kernel), each stored k-major: bpack[panel][p][j]
+    int num_panels = (nc + nr_panel - 1) / nr_panel;
+    OMP_PRAGMA(omp parallel for)
+    for (int jp = 0; jp < num_panels; jp++) {
+        int jr = jp * nr_panel;
+        int nr = nc - jr < nr_panel ? nc - jr : nr_panel;
+        float* panel = bpack + (size_t)jr * kc;
+        for (int p = 0; p < kc; p++) {
+            for (int j = 0; j < nr; j++) { panel[p * nr_panel + j] = GEMM_B(pc + p, jc + jr + j); }
+            for (int j = nr; j < nr_panel; j++) { panel[p * nr_panel + j] = 0.0f; }
+        }
+    }
+}
+
+// half a row of the register tile of the generic worker. This uses the GCC/Clang vector
+// extension rather than intrinsics, so the same code becomes xmm, ymm or zmm FMAs
+// depending on the target it is compiled for
+typedef float gemm_vec __attribute__((vector_size(GEMM_VL * sizeof(float))));
+
+template <int VL>
+static inline void gemm_micro_kernel(int kc, const float* __restrict a, const float* __restrict b,
+                                     float* __restrict c, int ldc, int mr, int nr,
+                                     const float* bias, int load_c,
+                                     const size_t* row_off, const size_t* col_off) {
+    // c[0:mr, 0:nr] = (load_c ? c : bias or 0) + a panel * b panel, for NR = 2 * VL
+    // where element (i, j) of the tile is c[i * ldc + j], or c[row_off[i] + col_off[j]]
+    // if the tile straddles blocks of a GemmLayout
+    typedef float vec __attribute__((vector_size(VL * sizeof(float))));
+    const int NR = 2 * VL;
+    vec acc[GEMM_MR][2];
+    for (int i = 0; i < GEMM_MR; i++) { acc[i][0] = (vec){0}; acc[i][1] = (vec){0}; }
+    for (int p = 0; p < kc; p++) {
+        vec b0 = *(const vec*)(b + p * NR);
+        vec b1 = *(const vec*)(b + p * NR + VL);
+        for (int i = 0; i < GEMM_MR; i++) {
+            float ai = a[p * GEMM_MR + i];
+            acc[i][0] += ai * b0;
+            acc[i][1] += ai * b1;
+        }
+    }
+    for (int i = 0; i < mr; i++) {
+        const float* acc_i = (const float*)acc[i];
+        if (row_off != NULL) {
+            for (int j = 0; j < nr; j++) {
+                float* c_ij = c + row_off[i] + col_off[j];
+                *c_ij = (load_c ? *c_ij : bias != NULL ? bias[j] : 0.0f) + acc_i[j];
+            }
+            continue;
+        }
+        float* c_i = c + (size_t)i * ldc;
+        if (load_c) {
+            for (int j = 0; j < nr; j++) { c_i[j] += acc_i[j]; }
+        } else if (bias != NULL) {
+            for (int j = 0; j < nr; j++) { c_i[j] = bias[j] + acc_i[j]; }
+        } else {
+            for (int j = 0; j < nr; j++) { c_i[j] = acc_i[j]; }
+        }
+    }
+}
+
+// the GEMV-like case of only a few rows (e.g. decoding one token): packing B
+// would cost as much as the multiply, so stream it once instead, parallel over
+// column chunks of C, with the few rows of A staying in cache. A is row-major here
+// (gemm_small_m copies a transposed A first).
+// With B^T every output is a dot product along k, which a plain float loop would
+// run as one scalar chain. gemm_dot_rows runs it on two vectors of VL floats per row
+// of A instead (VL as in the micro-kernel, so the copy for each ISA gets its own
+// register width), for up to GEMM_DOT_ROWS rows per load of B
+#define GEMM_DOT_ROWS 4
+
+// *v = the VL elements at p as floats
+template <int VL, typename vec>
+static inline void gemm_dot_load(vec* v, const float* p) {
+    memcpy(v, p, sizeof(*v));
+}
+
+template <int VL, typename vec>
+static inline void gemm_dot_load(vec* v, const bf16* p) {
+    // widen VL bf16 to floats: each goes into the top half of 32 bits (a fixed-length
+    // loop, which becomes a zero-extend and a shift)
+    uint32_t bits[VL];
+    for (int l = 0; l < VL; l++) { bits[l] = (uint32_t)p[l] << 16; }
+    memcpy(v, bits, sizeof(*v));
+}
+
+template <int VL, int R, typename TB>
+static inline void gemm_dot_rows(const float* A, int lda, const TB* b_j, int K, float* c, int ldc) {
+    // c[r * ldc] += dot(row r of A, b_j) for r < R, along K
+    typedef float vec __attribute__((vector_size(VL * sizeof(float))));
+    vec acc[R][2];
+    float tail[R];
+    for (int r = 0; r < R; r++) { acc[r][0] = (vec){0}; acc[r][1] = (vec){0}; tail[r] = 0.0f; }
+    int k = 0;
+    for (; k + 2 * VL <= K; k += 2 * VL) {
+        vec b0, b1;
+        gemm_dot_load<VL>(&b0, b_j + k);
+        gemm_dot_load<VL>(&b1, b_j + k + VL);
+        for (int r = 0; r < R; r++) {
+            vec a0, a1;
+            gemm_dot_load<VL>(&a0, A + (size_t)r * lda + k);
+            gemm_dot_load<VL>(&a1, A + (size_t)r * lda + k + VL);
+            acc[r][0] += a0 * b0;
+            acc[r][1] += a1 * b1;
+        }
+    }
+    for (; k < K; k++) {
+        float b = gemm_load(b_j[k]);
+        for (int r = 0; r < R; r++) { tail[r] += A[(size_t)r * lda + k] * b; }
+    }
+    for (int r = 0; r < R; r++) {
+        vec sum = acc[r][0] + acc[r][1];
+        float lanes[VL];
+        memcpy(lanes, &sum, sizeof(lanes));
+        float val = 0.0f;
+        for (int l = 0; l < VL; l++) { val += lanes[l]; }
+        c[(size_t)r * ldc] += val + tail[r];
+    }
+}
+
+template <int VL, int R, typename TB>
+static inline void gemm_axpy_rows(const float* A, int lda, const TB* b, int ldb, int K, float* c, int ldc) {
+    // c[r * ldc + j] += sum over k of A[r * lda + k] * b[k * ldb + j], for r < R and j < 2 * VL:
+    // the R x 2VL tile of C stays in registers for the whole K loop
+    typedef float vec __attribute__((vector_size(VL * sizeof(float))));
+    vec acc[R][2];
+    for (int r = 0; r < R; r++) { acc[r][0] = (vec){0}; acc[r][1] = (vec){0}; }
+    for (int k = 0; k < K; k++) {
+        vec b0, b1;
+        gemm_dot_load<VL>(&b0, b + (size_t)k * ldb);
+        gemm_dot_load<VL>(&b1, b + (size_t)k * ldb + VL);
+        for (int r = 0; r < R; r++) {
+            float a = A[(size_t)r * lda + k];
+            acc[r][0] += a * b0;
+            acc[r][1] += a * b1;
+        }
+    }
+    for (int r = 0; r < R; r++) {
+        vec c0, c1;
+        memcpy(&c0, c + (size_t)r * ldc, sizeof(c0));
+        memcpy(&c1, c + (size_t)r * ldc + VL, sizeof(c1));
+        c0 += acc[r][0];
+        c1 += acc[r][1];
+        memcpy(c + (size_t)r * ldc, &c0, sizeof(c0));
+        memcpy(c + (size_t)r * ldc + VL, &c1, sizeof(c1));
+    }
+}
+
+// gemm_small_m_chunk computes the n columns of C from j0, one task of gemm_small_m
+template <int VL, typename TB>
+static inline void gemm_small_m_chunk(int transb, int M, int K, int j0, int n,
+                                      const float* A, int lda, const TB* B, int ldb,
+                                      const float* bias, float* C, int ldc, int accumulate) {
+    for (int i = 0; i < M; i++) {
+        for (int j = j0; j < j0 + n; j++) {
+            if (!accumulate) { C[(size_t)i * ldc + j] = bias != NULL ? bias[j] : 0.0f; }
+        }
+    }
+    if (transb) {
+        // rows of B are contiguous in k: every row of B is read once from memory,
+        // and from L1 for the rows of A after the first GEMM_DOT_ROWS
+        for (int j = j0; j < j0 + n; j++) {
+            const TB* b_j = B + (size_t)j * ldb;
+            for (int i0 = 0; i0 < M; i0 += GEMM_DOT_ROWS) {
+                const float* a = A + (size_t)i0 * lda;
+                float* c = C + (size_t)i0 * ldc + j;
+                switch (M - i0 < GEMM_DOT_ROWS ? M - i0 : GEMM_DOT_ROWS) {
+                    case 1: gemm_dot_rows<VL, 1>(a, lda, b_j, K, c, ldc); break;
+                    case 2: gemm_dot_rows<VL, 2>(a, lda, b_j, K, c, ldc); break;
+                    case 3: gemm_dot_rows<VL, 3>(a, lda, b_j, K, c, ldc); break;
+                    default: gemm_dot_rows<VL, GEMM_DOT_ROWS>(a, lda, b_j, K, c, ldc); break;
+                }
+            }
+        }
+    } else {
+        // rows of B are contiguous in j: 2VL-wide column strips of B are streamed down K
+        // into GEMM_DOT_ROWS x 2VL tiles of C, and the last columns are one axpy per k
+        int j_end = j0 + n - n % (2 * VL);
+        for (int j = j0; j < j_end; j += 2 * VL) {
+            for (int i0 = 0; i0 < M; i0 += GEMM_DOT_ROWS) {
+                const float* a = A + (size_t)i0 * lda;
+                float* c = C + (size_t)i0 * ldc + j;
+                switch (M - i0 < GEMM_DOT_ROWS ? M - i0 : GEMM_DOT_ROWS) {
+                    case 1: gemm_axpy_rows<VL, 1>(a, lda, B + j, ldb, K, c, ldc); break;
+                    case 2: gemm_axpy_rows<VL, 2>(a, lda, B + j, ldb, K, c, ldc); break;
+                    case 3: gemm_axpy_rows<VL, 3>(a, lda, B + j, ldb, K, c, ldc); break;
+                    default: gemm_axpy_rows<VL, GEMM_DOT_ROWS>(a, lda, B + j, ldb, K, c, ldc); break;
+                }
+            }
+        }
+        for (int k = 0; j_end < j0 + n && k < K; k++) {
+            const TB* b_k = B + (size_t)k * ldb;
+            for (int i = 0; i < M; i++) {
+                float a = A[(size_t)i * lda + k];
+                float* c_i = C + (size_t)i * ldc;
+                for (int j = j_end; j < j0 + n; j++) { c_i[j] += a * gemm_load(b_k[j]); }
+            }
+        }
+    }
+}
+
+// the task for each ISA, with the VL of its registers, as for gemm_block_task below
+#define GEMM_SMALL_M_PARAMS (int transb, int M, int K, int j0, int n, const float* A, int lda, \
+                             const TB* B, int ldb, const float* bias, float* C, int ldc, int accumulate)
+#define GEMM_SMALL_M_ARGS (transb, M, K, j0, n, A, lda, B, ldb, bias, C, ldc, accumulate)
+template <typename TB>
+static inline void gemm_small_m_task GEMM_SMALL_M_PARAMS { gemm_small_m_chunk<GEMM_VL> GEMM_SMALL_M_ARGS; }
+#ifndef CPU_DISPATCH_GENERIC
+template <typename TB>
+CPU_TARGET_AVX2 static void gemm_small_m_task_avx2 GEMM_SMALL_M_PARAMS { gemm_small_m_chunk<8> GEMM_SMALL_M_ARGS; }
+template <typename TB>
+CPU_TARGET_AVX512 static void gemm_small_m_task_avx512 GEMM_SMALL_M_PARAMS { gemm_small_m_chunk<16> GEMM_SMALL_M_ARGS; }
+#endif
+#undef GEMM_SMALL_M_PARAMS
+#undef GEMM_SMALL_M_ARGS
+
+template <typename TB>
+static inline void gemm_small_m(int transa, int transb, int M, int N, int K,
+                                const float* A, int lda, const GemmLayout* a_layout, const TB* B, int ldb,
+                                const float* bias, float* C, int ldc, int accumulate) {
+    float* a_rows = NULL;
+    if (transa || a_layout != NULL) {
+        // the few rows of op(A), row-major, so the workers read them contiguously
+        a_rows = (float*)mallocCheck((size_t)M * K * sizeof(float));
+        for (int i = 0; i < M; i++) {
+            for (int k = 0; k < K; k++) { a_rows[(size_t)i * K + k] = GEMM_A(i, k); }
+        }
+        A = a_rows;
+        lda = K;
+    }
+    int isa = cpu_kernel_isa(CPU_OP_MATMUL);
+    int num_n_chunks = (N + GEMM_NB - 1) / GEMM_NB;
+    OMP_PRAGMA(omp parallel for)
+    for (int nb = 0; nb < num_n_chunks; nb++) {
+        int j0 = nb * GEMM_NB;
+        int n = N - j0 < GEMM_NB ? N - j0 : GEMM_NB;
+        CPU_DISPATCH(isa, gemm_small_m_task, <TB>, transb, M, K, j0, n, A, lda, B, ldb,
+                     bias, C, ldc, accumulate);
+    }
+    free(a_rows);
+}
+
+// one KC step of the blocked gemm_sgemm_ex: the packed B block, and what all its
+// (MC block, N chunk) tasks share
+typedef struct {
+    int transa;
+    const float* A;
+    int lda;
+    const GemmLayout* a_layout;
+    const float* apack; // with a prologue, the MC blocks of op(A) already packed, GEMM_MC * kc apart
+    const float* bpack;
+    const float* bias;
+    float* C;
+    int ldc;
+    const GemmLayout* layout;
+    const GemmEpilogue* epilogue;
+    int M, jc, nc, pc, kc;
+    int load_c; // accumulate into C, after the first KC step or with accumulate
+    int last_k; // the last KC step, after which the epilogue applies
+} GemmStep;
+
+template <int VL>
+static inline void gemm_block(const GemmStep* step, int mb, int nb) {
+    // task (mb, nb) of a KC step: pack the MC x KC block mb of A (or take it from step->apack),
+    // then multiply it by the panels of the packed B block in the N chunk nb, with NR = 2 * VL
+    // wide panels
+    const int NR = 2 * VL;
+    const float* A = step->A;
+    int lda = step->lda, transa = step->transa;
+    const GemmLayout* layout = step->layout;
+    int ic = mb * GEMM_MC;
+    int mc = step->M - ic < GEMM_MC ? step->M - ic : GEMM_MC;
+    int jc = step->jc, nc = step->nc, kc = step->kc;
+    float apack_local[GEMM_MC * GEMM_KC] __attribute__((aligned(64)));
+    const float* apack = apack_local;
+    if (step->apack != NULL) {
+        apack = step->apack + (size_t)mb * GEMM_MC * kc;
+    } else {
+        gemm_pack_a(apack_local, A, lda, transa, step->a_layout, ic, mc, step->pc, kc, NULL);
+    }
+    int j_end = (nb + 1) * GEMM_NB < nc ? (nb + 1) * GEMM_NB : nc;
+    for (int jr = nb * GEMM_NB; jr < j_end; jr += NR) {
+        int nr = j_end - jr < NR ? j_end - jr : NR;
+        const float* bias_j = step->bias != NULL ? step->bias + jc + jr : NULL;
+        for (int ir = 0; ir < mc; ir += GEMM_MR) {
+            int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+            const float* a_panel = apack + (size_t)ir * kc;
+            const float* b_panel = step->bpack + (size_t)jr * kc;
+            int i0 = ic + ir, j0 = jc + jr;
+            if (layout == NULL) {
+                float* c_tile = step->C + (size_t)i0 * step->ldc + j0;
+                gemm_micro_kernel<VL>(kc, a_panel, b_panel, c_tile, step->ldc,
+                                      mr, nr, bias_j, step->load_c, NULL, NULL);
+                if (step->epilogue != NULL && step->last_k) {
+                    gemm_epilogue_tile(step->epilogue, c_tile, step->ldc, i0, j0, mr, nr);
+                }
+            } else if (i0 % layout->rows + mr <= layout->rows &&
+                       j0 % layout->cols + nr <= layout->cols) {
+                // the tile lies inside one block, which is row-major with stride cols
+                float* c_tile = step->C + gemm_layout_row(layout, i0) + gemm_layout_col(layout, j0);
+                gemm_micro_kernel<VL>(kc, a_panel, b_panel, c_tile, layout->cols,
+                                      mr, nr, bias_j, step->load_c, NULL, NULL);
+            } else {
+                size_t row_off[GEMM_MR], col_off[NR];
+                for (int i = 0; i < mr; i++) { row_off[i] = gemm_layout_row(layout, i0 + i); }
+                for (int j = 0; j < nr; j++) { col_off[j] = gemm_layout_col(layout, j0 + j); }
+                gemm_micro_kernel<VL>(kc, a_panel, b_panel, step->C, 0,
+                                      mr, nr, bias_j, step->load_c, row_off, col_off);
+            }
+        }
+    }
+}
+
+// the task for each ISA, and the panel width NR its packed B needs
+static inline void gemm_block_task(const GemmStep* step, int mb, int nb) { gemm_block<GEMM_VL>(step, mb, nb); }
+#ifndef CPU_DISPATCH_GENERIC
+CPU_TARGET_AVX2 static void gemm_block_task_avx2(const GemmStep* step, int mb, int nb) { gemm_block<8>(step, mb, nb); }
+CPU_TARGET_AVX512 static void gemm_block_task_avx512(const GemmStep* step, int mb, int nb) { gemm_block<16>(step, mb, nb); }
+#endif
+
+static inline int gemm_panel_width(int isa) {
+    return isa == CPU_ISA_AVX512 ? 2 * 16 : isa == CPU_ISA_AVX2 ? 2 * 8 : 2 * GEMM_VL;
+}
+
+// C (M x N, row stride ldc) = op(A) (M x K) * op(B) (K x N) + bias, where bias
+// (length N, may be NULL) is broadcast over the rows. With accumulate != 0 the
+// product is added to C instead, and bias must be NULL.
+// op(A) is A (row stride lda), or A^T if transa, i.e. A stored K x M.
+// op(B) is B (row stride ldb), or B^T if transb, i.e. B stored N x K; B is fp32 or bf16.
+// If layout is not NULL, C is stored as it describes and ldc is unused. Likewise A, and
+// lda, with a_layout; it describes A as stored, i.e. K x M if transa.
+// If prologue is not NULL, op(A) is LayerNormed row by row as described there.
+// If epilogue is not NULL, it is applied to C as described there; it needs a row-major C
+// and accumulate == 0.
+template <typename TB>
+static inline void gemm_sgemm_ex(int transa, int transb, int M, int N, int K,
+                                 const float* A, int lda, const TB* B, int ldb,
+                                 const float* bias, float* C, int ldc, int accumulate,
+                                 const GemmLayout* layout, const GemmLayout* a_layout,
+                                 const GemmPrologue* prologue, const GemmEpilogue* epilogue) {
+    if (M <= 0 || N <= 0) { return; }
+    if (prologue != NULL && K > 0 && M < GEMM_SMALL_M) {
+        // the few-row paths do not pack A: normalize its few rows into a scratch A instead
+        float* a_rows = (float*)mallocCheck((size_t)M * K * sizeof(float));
+        for (int i = 0; i < M; i++) {
+            for (int k = 0; k < K; k++) { a_rows[(size_t)i * K + k] = gemm_layernorm(prologue, GEMM_A(i, k), i, k); }
+        }
+        gemm_sgemm_ex(0, transb, M, N, K, a_rows, K, B, ldb, bias, C, ldc, accumulate, layout, NULL, NULL, epilogue);
+        free(a_rows);
+        return;
+    }
+    if (epilogue != NULL && (K <= 0 || M < GEMM_SMALL_M)) {
+        // the few-row paths finish all of C first, and the epilogue runs over it after
+        gemm_sgemm_ex(transa, transb, M, N, K, A, lda, B, ldb, bias, C, ldc, 0, NULL, a_layout, NULL, NULL);
+        gemm_epilogue_tile(epilogue, C, ldc, 0, 0, M, N);
+        return;
+    }
+    if (layout != NULL && (K <= 0 || M < GEMM_SMALL_M)) {
+        // the few-row paths run row-major into a scratch C, which is then scattered
+        float* c_rows = (float*)mallocCheck((size_t)M * N * sizeof(float));
+        for (int i = 0; accumulate && i < M; i++) {
+            for (int j = 0; j < N; j++) { c_rows[(size_t)i * N + j] = C[gemm_layout_row(layout, i) + gemm_layout_col(layout, j)]; }
+        }
+        gemm_sgemm_ex(transa, transb, M, N, K, A, lda, B, ldb, bias, c_rows, N, accumulate, NULL, a_layout, NULL, NULL);
+        for (int i = 0; i < M; i++) {
+            for (int j = 0; j < N; j++) { C[gemm_layout_row(layout, i) + gemm_layout_col(layout, j)] = c_rows[(size_t)i * N + j]; }
+        }
+        free(c_rows);
+        return;
+    }
+    if (K <= 0) {
+        for (int i = 0; !accumulate && i < M; i++) {
+            for (int j = 0; j < N; j++) { C[(size_t)i * ldc + j] = bias != NULL ? bias[j] : 0.0f; }
+        }
+        return;
+    }
+    if (M < GEMM_SMALL_M) {
+        gemm_small_m(transa, transb, M, N, K, A, lda, a_layout, B, ldb, bias, C, ldc, accumulate);
+        return;
+    }
+    int isa = cpu_kernel_isa(CPU_OP_MATMUL);
+    int nr_panel = gemm_panel_width(isa);
+    int nc_max = N < GEMM_NC ? N : GEMM_NC;
+    int kc_max = K < GEMM_KC ? K : GEMM_KC;
+    size_t nc_padded = (size_t)(nc_max + nr_panel - 1) / nr_panel * nr_panel;
+    // the packed panels are read as whole vector rows, so keep them aligned
+    float* bpack = (float*)aligned_alloc(64, nc_padded * kc_max * sizeof(float));
+    if (bpack == NULL) {
+        fprintf(stderr, "Error: gemm_sgemm failed to allocate %zu bytes\n", nc_padded * kc_max * sizeof(float));
+        exit(EXIT_FAILURE);
+    }
+
+    // a plain copy of an MC block of A is cheap enough to redo in each of its N chunks, in
+    // the cache of the thread that uses it. A LayerNorm is not: with a prologue, the blocks
+    // of a KC step are normalized and packed once, into apack, and shared by the chunks
+    int num_m_blocks = (M + GEMM_MC - 1) / GEMM_MC;
+    float* apack = NULL;
+    if (prologue != NULL) {
+        size_t apack_bytes = ((size_t)num_m_blocks * GEMM_MC * kc_max * sizeof(float) + 63) / 64 * 64;
+        apack = (float*)aligned_alloc(64, apack_bytes);
+        if (apack == NULL) {
+            fprintf(stderr, "Error: gemm_sgemm failed to allocate %zu bytes\n", apack_bytes);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int jc = 0; jc < N; jc += GEMM_NC) {
+        int nc = N - jc < GEMM_NC ? N - jc : GEMM_NC;
+        for (int pc = 0; pc < K; pc += GEMM_KC) {
+            int kc = K - pc < GEMM_KC ? K - pc : GEMM_KC;
+            gemm_pack_b(bpack, B, ldb, transb, jc, nc, pc, kc, nr_panel);
+            if (apack != NULL && (jc == 0 || K > GEMM_KC)) {
+                // (with a single KC step, the blocks packed for jc == 0 serve every jc)
+                OMP_PRAGMA(omp parallel for)
+                for (int mb = 0; mb < num_m_blocks; mb++) {
+                    int mc = M - mb * GEMM_MC < GEMM_MC ? M - mb * GEMM_MC : GEMM_MC;
+                    gemm_pack_a(apack + (size_t)mb * GEMM_MC * kc, A, lda, transa, a_layout, mb * GEMM_MC, mc, pc, kc, prologue);
+                }
+            }
+            GemmStep step = { transa, A, lda, a_layout, apack, bpack, bias, C, ldc, layout, epilogue,
+                              M, jc, nc, pc, kc, accumulate || pc > 0, pc + kc == K };
+
+            int num_n_chunks = (nc + GEMM_NB - 1) / GEMM_NB;
+            OMP_PRAGMA(omp parallel for collapse(2) schedule(static))
+            for (int mb = 0; mb < num_m_blocks; mb++) {
+                for (int nb = 0; nb < num_n_chunks; nb++) {
+                    CPU_DISPATCH(isa, gemm_block_task, , &step, mb, nb);
+                }
+            }
+        }
+    }
+    free(apack);
+    free(bpack);
+}
+
+// gemm_sgemm_ex for a row-major C, without a prologue or an epilogue
+template <typename TB>
+static inline void gemm_sgemm(int transa, int transb, int M, int N, int K,
+                              const float* A, int lda, const TB* B, int ldb,
+                              const float* bias, float* C, int ldc, int accumulate) {
+    gemm_sgemm_ex(transa, transb, M, N, K, A, lda, B, ldb, bias, C, ldc, accumulate, NULL, NULL, NULL, NULL);
+}
+
+// columns of C handled by one thread in gemm_colsum
+#define GEMM_COLSUM_BLOCK 64
+
+// y[j] += sum_i A(i, j) for j < N, i < M: the bias gradient of a matmul. A is row-major
+// with row stride lda, or stored as layout describes if it is not NULL.
+// Parallel over column blocks, so every y[j] is owned by one thread and summed
+// over the rows in order; the inner loop runs along the contiguous columns.
+static inline void gemm_colsum(float* y, const float* A, int M, int N, int lda, const GemmLayout* layout) {
+    int num_blocks = (N + GEMM_COLSUM_BLOCK - 1) / GEMM_COLSUM_BLOCK;
+    OMP_PRAGMA(omp parallel for)
+    for (int jb = 0; jb < num_blocks; jb++) {
+        int j0 = jb * GEMM_COLSUM_BLOCK;
+        int n = N - j0 < GEMM_COLSUM_BLOCK ? N - j0 : GEMM_COLSUM_BLOCK;
+        float acc[GEMM_COLSUM_BLOCK] = {0.0f};
+        // the columns of the block are contiguous in every row, unless it straddles blocks of the layout
+        int contiguous = layout == NULL || j0 % layout->cols + n <= layout->cols;
+        for (int i = 0; i < M; i++) {
+            size_t row = layout != NULL ? gemm_layout_row(layout, i) : (size_t)i * lda;
+            if (contiguous) {
+                const float* a_i = A + row + (layout != NULL ? gemm_layout_col(layout, j0) : (size_t)j0);
+                for (int j = 0; j < n; j++) { acc[j] += a_i[j]; }
+            } else {
+                for (int j = 0; j < n; j++) { acc[j] += A[row + gemm_layout_col(layout, j0 + j)]; }
+            }
+        }
+        for (int j = 0; j < n; j++) { y[j0 + j] += acc[j]; }
+    }
+}
+
+#undef GEMM_A_ROWS
+#undef GEMM_A
+#undef GEMM_B
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ Vectorizable single precision exp, log, tanh and cosh, for the kernels whose inner
+ loops call them per element (softmax, attention, GeLU, the loss head).
+ A call to libm's expf/tanhf/... in a loop keeps the loop scalar. These are written
+ branch-free on plain floats instead: range reduction with integer bit manipulation
+ on the float, a short polynomial, and bitwise selects where libm would branch.
+ Inlined into a loop, the compiler vectorizes them with the loop at -O3 (8 lanes with
+ AVX2, 16 with AVX-512, per -march), and where it does not they are the scalar
+ fallback, computing the same thing. The polynomials are the single precision ones
+ of Cephes.
+
+ Max error against the correctly rounded result, over the floats in the range, with
+ and without FMA contraction:
+ - vmath_expf:  1.1 ulp on [-87.3, 88.3]. Below -87.33 (where expf would be
+                subnormal) it returns 0, above 88.37 it saturates at exp(88.37)
+ - vmath_logf:  1 ulp for normal x > 0. x below FLT_MIN, including 0, gives log(FLT_MIN)
+ - vmath_tanhf: 1.5 ulp, and exactly +-1 where tanhf rounds to it
+ - vmath_coshf: 1.5 ulp on [-88.3, 88.3], saturating beyond like vmath_expf
+ NaN and infinite inputs are not handled: the kernels never produce them.
+
+ Define VMATH_LIBM to get the libm functions instead (e.g. so that Enzyme
+ differentiates the kernels through functions it knows).
+*/
+#ifndef VMATH_H
+#define VMATH_H
+
+#include <math.h>
+#include <string.h>
+#include <float.h>
+#include <stdint.h>
+
+#ifdef VMATH_LIBM
+
+static inline float vmath_expf(float x) { return expf(x); }
+static inline float vmath_logf(float x) { return logf(x); }
+static inline float vmath_tanhf(float x) { return tanhf(x); }
+static inline float vmath_coshf(float x) { return coshf(x); }
+
+#else
+
+// exp saturates above VMATH_EXP_HI and is 0 below VMATH_EXP_LO, about log(FLT_MIN)
+#define VMATH_EXP_HI 88.37f
+#define VMATH_EXP_LO -87.33654f
+// ln(2) split in two, so that n * ln2 is exact in the range reduction
+#define VMATH_LN2_HI 0.693359375f
+#define VMATH_LN2_LO -2.12194440e-4f
+
+static inline float vmath_from_bits(int32_t bits) {
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static inline int32_t vmath_to_bits(float x) {
+    int32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+// c ? a : b on the bits, so that no branch is left for the vectorizer to trip over
+static inline float vmath_select(int32_t c, float a, float b) {
+    int32_t mask = -c;
+    return vmath_from_bits((vmath_to_bits(a) & mask) | (vmath_to_bits(b) & ~mask));
+}
+
+static inline float vmath_expf(float x) {
+    // exp(x) = 2^n exp(r), with n = round(x / ln2) and r = x - n ln2 in [-ln2/2, ln2/2]
+    float xc = vmath_select(x < VMATH_EXP_HI, x, VMATH_EXP_HI);
+    xc = vmath_select(xc > VMATH_EXP_LO, xc, VMATH_EXP_LO);
+    float fn = xc * 1.44269504088896341f;
+    int32_t n = (int32_t)(fn + vmath_select(fn >= 0.0f, 0.5f, -0.5f));
+    float r = xc - (float)n * VMATH_LN2_HI;
+    r = r - (float)n * VMATH_LN2_LO;
+    // exp(r) = 1 + r + r^2 p(r)
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+    // 2^n, built in the exponent field
+    float scale = vmath_from_bits((n + 127) << 23);
+    return vmath_select(x >= VMATH_EXP_LO, p * scale, 0.0f);
+}
+
+static inline float vmath_logf(float x) {
+    // x = m 2^e with m in [sqrt(1/2), sqrt(2)), log(x) = e ln2 + log(m),
+    // and log(m) = f - f^2/2 + f^3 p(f) for f = m - 1
+    x = vmath_select(x > FLT_MIN, x, FLT_MIN);
+    int32_t bits = vmath_to_bits(x);
+    int32_t e = (bits >> 23) - 126;
+    float m = vmath_from_bits((bits & 0x007fffff) | 0x3f000000); // in [0.5, 1)
+    int32_t below = m < 0.707106781186547524f;
+    e -= below;
+    float f = (m - 1.0f) + vmath_select(below, m, 0.0f);
+    float z = f * f;
+    float p = 7.0376836292e-2f;
+    p = p * f - 1.1514610310e-1f;
+    p = p * f + 1.1676998740e-1f;
+    p = p * f - 1.2420140846e-1f;
+    p = p * f + 1.4249322787e-1f;
+    p = p * f - 1.6668057665e-1f;
+    p = p * f + 2.0000714765e-1f;
+    p = p * f - 2.4999993993e-1f;
+    p = p * f + 3.3333331174e-1f;
+    float fe = (float)e;
+    float y = p * f * z;
+    y += fe * VMATH_LN2_LO;
+    y += -0.5f * z;
+    return f + y + fe * VMATH_LN2_HI;
+}
+
+static inline float vmath_tanhf(float x) {
+    // small |x|: the odd polynomial x + x^3 p(x^2), which keeps the relative accuracy
+    // that 1 - 2 / (exp(2|x|) + 1) loses to cancellation there
+    float a = fabsf(x);
+    float z = x * x;
+    float p = -5.70498872745e-3f;
+    p = p * z + 2.06390887954e-2f;
+    p = p * z - 5.37397155531e-2f;
+    p = p * z + 1.33314422036e-1f;
+    p = p * z - 3.33332819422e-1f;
+    float small = x + x * z * p;
+    float big = 1.0f - 2.0f / (vmath_expf(2.0f * a) + 1.0f);
+    big = vmath_select(x < 0.0f, -big, big);
+    return vmath_select(a < 0.625f, small, big);
+}
+
+static inline float vmath_coshf(float x) {
+    float e = vmath_expf(fabsf(x));
+    return 0.5f * e + 0.5f / e;
+}
+
+#endif // VMATH_LIBM
+
+#endif // VMATH_H
@@ -14,12 +14,42 @@ There will be other versions of this code that specialize it and make it fast.
 #include <stdint.h>
 #include <assert.h>
 #include <math.h>
+#include <float.h>
 #include <time.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #ifdef OMP
 #include <omp.h>
 #endif
+// The kernels below only run multi-threaded with -DOMP when Enzyme uses the
+// hand-written backward kernels as custom derivatives (see further below): Enzyme
+// then never differentiates through an OpenMP region, and every backward kernel
+// partitions its writes so that no two threads touch the same gradient element.
+// The reductions happen in a fixed order, so the gradients do not depend on the
+// thread count. Under ENZYME_FULL_AD Enzyme differentiates the kernel bodies
+// itself, so they stay serial.
+#if defined(OMP) && !defined(ENZYME_FULL_AD)
+#define OMP_PRAGMA(x) _Pragma(#x)
+#else
+#define OMP_PRAGMA(x)
+#endif
+// the kernels call the vectorizable exp/log/tanh/cosh of llmc/vmath.h instead of libm's,
+// and run per-ISA copies of their inner loops (llmc/cpu_dispatch.h), except under
+// ENZYME_FULL_AD, where Enzyme differentiates through a single copy calling libm
+#ifdef ENZYME_FULL_AD
+#define VMATH_LIBM
+#define CPU_DISPATCH_GENERIC
+#endif
+// -DENABLE_BF16 gives the GEMMs bf16 weights: the matmuls read a bf16 copy of the weights
+// and accumulate in fp32, the optimizer keeps fp32 master weights and moments (see
+// gpt2_build_from_checkpoint), and the blockwise step checkpoints the residual stream in
+// bf16 (see GPT2Blockwise). All other activations stay fp32
+#if defined(ENABLE_BF16) && defined(ENZYME_FULL_AD)
+#error "ENABLE_BF16 needs the hand-written kernels, which ENZYME_FULL_AD replaces"
+#endif
 // our own utilities
 // defines: fopenCheck, freadCheck, fcloseCheck, fseekCheck, mallocCheck
 #include "llmc/rand.h"
@@ -28,6 +58,16 @@ There will be other versions of this code that specialize it and make it fast.
 #include "llmc/tokenizer.h"
 // defines: dataloader_init, dataloader_reset, dataloader_next_batch, dataloader_free
 #include "llmc/dataloader.h"
+// defines: vmath_expf, vmath_logf, vmath_tanhf, vmath_coshf
+#include "llmc/vmath.h"
+// defines: cpu_kernel_isa, CPU_VARIANTS, CPU_DISPATCH
+#include "llmc/cpu_dispatch.h"
+// defines: bf16, bf16_round_array, bf16_to_float_array, bf16_weights
+#include "llmc/bf16.h"
+// defines: gemm_sgemm
+#include "llmc/gemm.h"
+// defines: adamw_update
+#include "llmc/adamw.h"
 
 //#ifdef TESTING
 #include <benchmark/benchmark.h>
@@ -37,11 +77,55 @@ int enzyme_dup;
 int enzyme_dupnoneed;
 int enzyme_const;
 int enzyme_width;
+int enzyme_allocated;
+int enzyme_tape;
 void __enzyme_autodiff(void *, ...);
+// split mode, used by gpt2_tape_report
+size_t __enzyme_augmentsize(void *, ...);
+void __enzyme_augmentfwd(void *, ...);
+void __enzyme_reverse(void *, ...);
 // ----------------------------------------------------------------------------
 // all the individual layers' forward and backward passes
 // B = batch_size, T = sequence_length, C = channels, V = vocab_size
 
+// Shape specialization. The inner loops of layernorm run over the C channels of a row, and
+// those of attention over the hs = C / NH elements of a head. As runtime ints, the compiler
+// has to keep these loops generic. So these kernels are templates on that size, instantiated
+// for the GPT-2 presets (124M, 350M, 774M and 1.5B: C = 768, 1024, 1280 and 1600, all with
+// hs = 64), where the constant trip count lets the loops be fully unrolled into SIMD, and
+// with 0 for the generic instantiation that reads the runtime size, for any other model.
+// The kernels the model calls pick the instantiation with one switch on their runtime size,
+// outside all loops. Under ENZYME_FULL_AD only the generic one is used, so that Enzyme
+// differentiates a single copy of each kernel.
+#ifndef ENZYME_FULL_AD
+#define DISPATCH_CHANNELS(C, fn, ...) \
+    switch (C) { \
+        case 768: fn<768>(__VA_ARGS__); break; \
+        case 1024: fn<1024>(__VA_ARGS__); break; \
+        case 1280: fn<1280>(__VA_ARGS__); break; \
+        case 1600: fn<1600>(__VA_ARGS__); break; \
+        default: fn<0>(__VA_ARGS__); break; \
+    }
+#define DISPATCH_HEAD_SIZE(hs, fn, ...) \
+    switch (hs) { \
+        case 64: fn<64>(__VA_ARGS__); break; \
+        default: fn<0>(__VA_ARGS__); break; \
+    }
+#else
+#define DISPATCH_CHANNELS(C, fn, ...) fn<0>(__VA_ARGS__)
+#define DISPATCH_HEAD_SIZE(hs, fn, ...) fn<0>(__VA_ARGS__)
+#endif
+
+// whether the kernels have instantiations for the channels and head size of a model
+static inline int kernels_specialized(int C, int NH) {
+#ifndef ENZYME_FULL_AD
+    return (C == 768 || C == 1024 || C == 1280 || C == 1600) && C / NH == 64;
+#else
+    return 0;
+#endif
+}
+
+__attribute__((noinline))
 void encoder_forward(float* __restrict out,
                    int* inp, float* __restrict wte, float* __restrict wpe,
                    int B, int T, int C) {
@@ -49,6 +133,7 @@ void encoder_forward(float* __restrict out,
     // inp is (B,T) of integers, holding the token ids at each (b,t) position
     // wte is (V,C) of token embeddings, short for "weight token embeddings"
     // wpe is (maxT,C) of position embeddings, short for "weight positional embedding"
+    OMP_PRAGMA(omp parallel for collapse(2))
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
             // seek to the output position in out[b,t,:]
@@ -67,6 +152,93 @@ void encoder_forward(float* __restrict out,
     }
 }
 
+// channels per work item in the backward reductions over (B,T) below
+#define CHANNEL_BLOCK 64
+
+void encoder_backward(float* dwte, float* dwpe,
+                      float* dout, int* inp,
+                      int B, int T, int C) {
+    // the same token can appear at many (b,t), so parallelizing over positions would
+    // race on dwte. instead every thread owns a block of channels and walks all
+    // positions in order, which also makes the sum deterministic
+    OMP_PRAGMA(omp parallel for)
+    for (int c0 = 0; c0 < C; c0 += CHANNEL_BLOCK) {
+        int c1 = c0 + CHANNEL_BLOCK < C ? c0 + CHANNEL_BLOCK : C;
+        for (int b = 0; b < B; b++) {
+            for (int t = 0; t < T; t++) {
+                float* dout_bt = dout + b * T * C + t * C;
+                int ix = inp[b * T + t];
+                float* dwte_ix = dwte + ix * C;
+                float* dwpe_t = dwpe + t * C;
+                for (int i = c0; i < c1; i++) {
+                    float d = dout_bt[i];
+                    dwte_ix[i] += d;
+                    dwpe_t[i] += d;
+                }
+            }
+        }
+    }
+}
+
+// one (b,t) row of layernorm_forward: out_bt (may be NULL), *mean_bt and *rstd_bt from the row x
+template <int CS>
+static inline void layernorm_forward_row(float* __restrict out_bt, float* __restrict mean_bt, float* __restrict rstd_bt,
+                                         const float* __restrict x, const float* __restrict weight,
+                                         const float* __restrict bias, int C_any) {
+    const int C = CS > 0 ? CS : C_any; // a constant in the preset instantiations
+    float eps = 1e-5f;
+    // calculate the mean
+    float m = 0.0f;
+    for (int i = 0; i < C; i++) {
+        m += x[i];
+    }
+    m = m/C;
+    // calculate the variance (without any bias correction)
+    float v = 0.0f;
+    for (int i = 0; i < C; i++) {
+        float xshift = x[i] - m;
+        v += xshift * xshift;
+    }
+    v = v/C;
+    // calculate the rstd (reciprocal standard deviation)
+    float s = 1.0f / sqrtf(v + eps);
+    if (out_bt != NULL) {
+        for (int i = 0; i < C; i++) {
+            float n = (s * (x[i] - m)); // normalize
+            float o = n * weight[i] + bias[i]; // scale and shift
+            out_bt[i] = o; // write
+        }
+    }
+    // cache the mean and rstd for the backward pass later
+    *mean_bt = m;
+    *rstd_bt = s;
+}
+
+CPU_VARIANTS(template <int CS>, layernorm_forward_row, <CS>,
+             (float* __restrict out_bt, float* __restrict mean_bt, float* __restrict rstd_bt,
+              const float* __restrict x, const float* __restrict weight, const float* __restrict bias,
+              int C_any),
+             (out_bt, mean_bt, rstd_bt, x, weight, bias, C_any))
+
+template <int CS>
+static void layernorm_forward_impl(float* __restrict out, float* __restrict mean, float* __restrict rstd,
+                                   float* __restrict inp, float* __restrict weight, float* __restrict bias,
+                                   int B, int T, int C_any) {
+    const int C = CS > 0 ? CS : C_any; // a constant in the preset instantiations
+    int isa = cpu_kernel_isa(CPU_OP_LAYERNORM);
+    OMP_PRAGMA(omp parallel for collapse(2))
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            // seek to the input position inp[b,t,:] and the output position out[b,t,:]
+            float* x = inp + b * T * C + t * C;
+            float* out_bt = out != NULL ? out + b * T * C + t * C : NULL;
+            CPU_DISPATCH(isa, layernorm_forward_row, <CS>, out_bt, mean + b * T + t, rstd + b * T + t,
+                         x, weight, bias, C);
+        }
+    }
+}
+
+__attribute__((noinline))
 void layernorm_forward(float* __restrict out, float* __restrict mean, float* __restrict rstd,
                        float* __restrict inp, float* __restrict weight, float* __restrict bias,
                        int B, int T, int C) {
@@ -74,49 +246,120 @@ void layernorm_forward(float* __restrict out, float* __restrict mean, float* __r
     // both inp and out are (B,T,C) of the activations
     // mean and rstd are (B,T) buffers, to be used later in backward pass
     // at each position (b,t) of the input, the C-dimensional vector
-    // of activations gets normalized, then scaled and shifted
-    float eps = 1e-5f;
+    // of activations gets normalized, then scaled and shifted.
+    // out may be NULL, to compute only mean and rstd for a GemmPrologue
+    DISPATCH_CHANNELS(C, layernorm_forward_impl, out, mean, rstd, inp, weight, bias, B, T, C);
+}
+
+// the weight/bias part of layernorm_backward, shared with residual_layernorm_backward.
+// layernorm_backward_params_block sums the channels [c0, c1) over all (b,t)
+static inline void layernorm_backward_params_block(float* dweight, float* dbias,
+                                                   const float* dout, const float* inp,
+                                                   const float* mean, const float* rstd,
+                                                   int BT, int C, int c0, int c1) {
+    for (int bt = 0; bt < BT; bt++) {
+        const float* dout_bt = dout + (size_t)bt * C;
+        const float* inp_bt = inp + (size_t)bt * C;
+        float mean_bt = mean[bt];
+        float rstd_bt = rstd[bt];
+        for (int i = c0; i < c1; i++) {
+            float norm_bti = (inp_bt[i] - mean_bt) * rstd_bt;
+            // gradient contribution to bias
+            dbias[i] += dout_bt[i];
+            // gradient contribution to weight
+            dweight[i] += norm_bti * dout_bt[i];
+        }
+    }
+}
+
+CPU_VARIANTS(, layernorm_backward_params_block, ,
+             (float* dweight, float* dbias, const float* dout,
+              const float* inp, const float* mean, const float* rstd,
+              int BT, int C, int c0, int c1),
+             (dweight, dbias, dout, inp, mean, rstd, BT, C, c0, c1))
+
+void layernorm_backward_params(float* dweight, float* dbias,
+                               float* dout, float* inp, float* mean, float* rstd,
+                               int B, int T, int C) {
+    // backward into weight/bias, which sum over all (b,t): parallelize over
+    // blocks of channels so that each thread reduces its own slice in order
+    int isa = cpu_kernel_isa(CPU_OP_LAYERNORM);
+    OMP_PRAGMA(omp parallel for)
+    for (int c0 = 0; c0 < C; c0 += CHANNEL_BLOCK) {
+        int c1 = c0 + CHANNEL_BLOCK < C ? c0 + CHANNEL_BLOCK : C;
+        CPU_DISPATCH(isa, layernorm_backward_params_block, , dweight, dbias, dout, inp, mean, rstd,
+                     B * T, C, c0, c1);
+    }
+}
+
+// one (b,t) row of the backward into inp of layernorm_backward
+template <int CS>
+static inline void layernorm_backward_row(float* dinp_bt, const float* dout_bt,
+                                          const float* inp_bt, const float* weight,
+                                          float mean_bt, float rstd_bt, int C_any) {
+    const int C = CS > 0 ? CS : C_any; // a constant in the preset instantiations
+    // first: two reduce operations
+    float dnorm_mean = 0.0f;
+    float dnorm_norm_mean = 0.0f;
+    for (int i = 0; i < C; i++) {
+        float norm_bti = (inp_bt[i] - mean_bt) * rstd_bt;
+        float dnorm_i = weight[i] * dout_bt[i];
+        dnorm_mean += dnorm_i;
+        dnorm_norm_mean += dnorm_i * norm_bti;
+    }
+    dnorm_mean = dnorm_mean / C;
+    dnorm_norm_mean = dnorm_norm_mean / C;
+
+    // now iterate again and accumulate the gradient to the input
+    for (int i = 0; i < C; i++) {
+        float norm_bti = (inp_bt[i] - mean_bt) * rstd_bt;
+        float dnorm_i = weight[i] * dout_bt[i];
+        float dval = 0.0f;
+        dval += dnorm_i; // term 1
+        dval -= dnorm_mean; // term 2
+        dval -= norm_bti * dnorm_norm_mean; // term 3
+        dval *= rstd_bt; // final scale
+        dinp_bt[i] += dval;
+    }
+}
+
+CPU_VARIANTS(template <int CS>, layernorm_backward_row, <CS>,
+             (float* dinp_bt, const float* dout_bt, const float* inp_bt,
+              const float* weight, float mean_bt, float rstd_bt, int C_any),
+             (dinp_bt, dout_bt, inp_bt, weight, mean_bt, rstd_bt, C_any))
+
+template <int CS>
+static void layernorm_backward_impl(float* dinp, float* dweight, float* dbias,
+                                    float* dout, float* inp, float* weight, float* mean, float* rstd,
+                                    int B, int T, int C_any) {
+    const int C = CS > 0 ? CS : C_any; // a constant in the preset instantiations
+    int isa = cpu_kernel_isa(CPU_OP_LAYERNORM);
+    // backward into inp first, every (b,t) row is independent
+    OMP_PRAGMA(omp parallel for collapse(2))
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
-            // seek to the input position inp[b,t,:]
-            float* x = inp + b * T * C + t * C;
-            // calculate the mean
-            float m = 0.0f;
-            for (int i = 0; i < C; i++) {
-                m += x[i];
-            }
-            m = m/C;
-            // calculate the variance (without any bias correction)
-            float v = 0.0f;
-            for (int i = 0; i < C; i++) {
-                float xshift = x[i] - m;
-                v += xshift * xshift;
-            }
-            v = v/C;
-            // calculate the rstd (reciprocal standard deviation)
-            float s = 1.0f / sqrtf(v + eps);
-            // seek to the output position in out[b,t,:]
-            float* out_bt = out + b * T * C + t * C;
-            for (int i = 0; i < C; i++) {
-                float n = (s * (x[i] - m)); // normalize
-                float o = n * weight[i] + bias[i]; // scale and shift
-                out_bt[i] = o; // write
-            }
-            // cache the mean and rstd for the backward pass later
-            mean[b * T + t] = m;
-            rstd[b * T + t] = s;
+            size_t off = (size_t)b * T * C + (size_t)t * C;
+            CPU_DISPATCH(isa, layernorm_backward_row, <CS>, dinp + off, dout + off, inp + off, weight,
+                         mean[b * T + t], rstd[b * T + t], C);
         }
     }
+    layernorm_backward_params(dweight, dbias, dout, inp, mean, rstd, B, T, C);
+}
+
+void layernorm_backward(float* dinp, float* dweight, float* dbias,
+                        float* dout, float* inp, float* weight, float* mean, float* rstd,
+                        int B, int T, int C) {
+    DISPATCH_CHANNELS(C, layernorm_backward_impl, dinp, dweight, dbias, dout, inp, weight, mean, rstd,
+                      B, T, C);
 }
 
 void matmul_forward_naive(float* __restrict out,
                          const float* __restrict inp, const float* __restrict weight, const float* __restrict bias,
                          int B, int T, int C, int OC) {
     // the most naive implementation of matrix multiplication
-    // this serves as an algorithmic reference, and as a fallback for
-    // unfriendly input shapes inside matmul_forward(), below.
+    // this serves as an algorithmic reference for matmul_forward(), below.
     
-    // #pragma omp parallel for collapse(2)
+    OMP_PRAGMA(omp parallel for collapse(2))
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
             int bt = b * T + t;
@@ -131,201 +374,1445 @@ void matmul_forward_naive(float* __restrict out,
     }
 }
 
+// the register tile of matmul_forward(): rows [obt, obt + nbt) of the collapsed (B*T)
+// dimension, for every output channel. nbt is MATMUL_LOOP_UNROLL for all full tiles and
+// smaller only for the last one, so B*T does not have to be a multiple of the tile.
+// always_inline lets the compiler specialize the full tiles on the constant nbt.
+// out is row-major (B*T,OC), or stored as layout describes if that is not NULL.
+// Only used under ENZYME_FULL_AD, see matmul_forward().
+#define MATMUL_LOOP_UNROLL 8
+static inline __attribute__((always_inline))
+void matmul_forward_tile(float* __restrict out,
+                         const float* __restrict inp, const float* __restrict weight, const float* __restrict bias,
+                         int obt, int nbt, int C, int OC, const GemmLayout* layout) {
+    for (int o = 0; o < OC; o++) {
+        // we'll keep MATMUL_LOOP_UNROLL many results in registers
+        float result[MATMUL_LOOP_UNROLL];
+        // initialize the bias, if it exists
+        for (int ibt = 0; ibt < nbt; ibt++) {
+            result[ibt] = (bias != NULL) ? bias[o] : 0.0f;
+        }
+        // inner loops. Because we do nbt steps of inner bt, we can cache
+        // the value of weight[i + o * C] and reuse it.
+        // we compile with -Ofast, so the compiler will turn the inner loop into FMAs
+        for (int i = 0; i < C; i++) {
+            float w = weight[i + o * C];
+            for (int ibt = 0; ibt < nbt; ibt++) {
+                int bt = obt + ibt;
+                result[ibt] += inp[bt * C + i] * w;
+            }
+        }
+        // write back results to main memory
+        for (int ibt = 0; ibt < nbt; ibt++) {
+            int bt = obt + ibt;
+            if (layout == NULL) {
+                out[bt * OC + o] = result[ibt];
+            } else {
+                out[gemm_layout_row(layout, bt) + gemm_layout_col(layout, o)] = result[ibt];
+            }
+        }
+    }
+}
+
+// the GEMMs of the matmul layers whose B operand is a weight. Under ENABLE_BF16 they read
+// the bf16 copy of the weight instead, if it has one (see gpt2_build_from_checkpoint)
+static inline void matmul_sgemm(int transa, int transb, int M, int N, int K,
+                                const float* A, int lda, const float* weight, int ldw,
+                                const float* bias, float* C, int ldc, int accumulate,
+                                const GemmLayout* layout, const GemmLayout* a_layout,
+                                const GemmPrologue* prologue, const GemmEpilogue* epilogue) {
+#ifdef ENABLE_BF16
+    const bf16* weight_bf16 = bf16_weights(weight);
+    if (weight_bf16 != NULL) {
+        gemm_sgemm_ex(transa, transb, M, N, K, A, lda, weight_bf16, ldw, bias, C, ldc, accumulate,
+                      layout, a_layout, prologue, epilogue);
+        return;
+    }
+#endif
+    gemm_sgemm_ex(transa, transb, M, N, K, A, lda, weight, ldw, bias, C, ldc, accumulate,
+                  layout, a_layout, prologue, epilogue);
+}
+
+__attribute__((noinline))
 void matmul_forward(float* __restrict out,
                     const float* __restrict inp, const float* __restrict weight, const float* __restrict bias,
                     int B, int T, int C, int OC) {
     // most of the running time is spent here and in matmul_backward
-    // therefore, the implementation below is very mildly optimized
-    // this function is otherwise identical to that of matmul_forward_naive()
     // OC is short for "output channels"
     // inp is (B,T,C), weight is (OC, C), bias is (OC)
     // out will be (B,T,OC)
+#ifndef ENZYME_FULL_AD
+    // out = inp @ weight^T + bias, on the blocked and packed GEMM of llmc/gemm.h
+    matmul_sgemm(0, 1, B * T, OC, C, inp, C, weight, C, bias, out, OC, 0, NULL, NULL, NULL, NULL);
+#else
+    // Enzyme differentiates this function itself here, so keep the simple register tile,
+    // which is otherwise identical to matmul_forward_naive()
 
-    // make sure the tiled loop will be correct or fallback to naive version
-    const int LOOP_UNROLL = 8;
-    if (B*T % LOOP_UNROLL != 0) {
-        matmul_forward_naive(out, inp, weight, bias, B, T, C, OC);
-        return;
+    // collapse the B and T loops into one and turn it into a strided loop.
+    // then we can tile the inner loop, and reuse the loaded weight MATMUL_LOOP_UNROLL many times.
+    // the rows left over after the full tiles form one shorter tile
+    int BT = B * T;
+    int BT_full = BT - BT % MATMUL_LOOP_UNROLL;
+    OMP_PRAGMA(omp parallel for)
+    for (int obt = 0; obt < BT_full; obt += MATMUL_LOOP_UNROLL) {
+        matmul_forward_tile(out, inp, weight, bias, obt, MATMUL_LOOP_UNROLL, C, OC, NULL);
     }
+    if (BT_full < BT) {
+        matmul_forward_tile(out, inp, weight, bias, BT_full, BT - BT_full, C, OC, NULL);
+    }
+#endif
+}
 
-    // collapse the B and T loops into one and turn it into a strided loop.
-    // then we can tile the inner loop, and reuse the loaded weight LOOP_UNROLL many times
-    
-    // #pragma omp parallel for
-    for (int obt = 0; obt < B * T; obt += LOOP_UNROLL) {
-        for (int o = 0; o < OC; o++) {
-            // we'll keep LOOP_UNROLL many results in registers
-            float result[LOOP_UNROLL];
-            // initialize the bias, if it exists
-            for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
-                result[ibt] = (bias != NULL) ? bias[o] : 0.0f;
+void matmul_backward(float* dinp, float* dweight, float* dbias,
+                     const float* dout, const float* inp, const float* weight,
+                     int B, int T, int C, int OC) {
+    // most of the running time is spent here and in matmul_forward
+    // both weight products are GEMMs on the blocked engine of llmc/gemm.h:
+    // dinp (B*T,C) += dout (B*T,OC) @ weight (OC,C)
+    matmul_sgemm(0, 0, B * T, C, OC, dout, OC, weight, C, NULL, dinp, C, 1, NULL, NULL, NULL, NULL);
+    // dweight (OC,C) += dout^T (OC,B*T) @ inp (B*T,C)
+    gemm_sgemm(1, 0, OC, C, B * T, dout, OC, inp, C, NULL, dweight, C, 1);
+    // dbias (OC) += column sums of dout
+    if (dbias != NULL) { gemm_colsum(dbias, dout, B * T, OC, OC, NULL); }
+}
+
+__attribute__((noinline))
+void matmul_forward_qkv(float* __restrict out,
+                        const float* __restrict inp, const float* __restrict weight, const float* __restrict bias,
+                        int B, int T, int C, int NH) {
+    // the qkv matmul: matmul_forward with OC = 3*C, except that out is stored head-major,
+    // (B, 3, NH, T, hs), so that attention streams every head as contiguous hs-wide rows.
+    // The GEMM stores its tiles of C straight into that layout, there is no transpose pass
+    int OC = 3 * C;
+    int hs = C / NH; // head size
+    GemmLayout layout = { T, hs, (size_t)OC * T, (size_t)T * hs };
+#ifndef ENZYME_FULL_AD
+    matmul_sgemm(0, 1, B * T, OC, C, inp, C, weight, C, bias, out, OC, 0, &layout, NULL, NULL, NULL);
+#else
+    int BT = B * T;
+    int BT_full = BT - BT % MATMUL_LOOP_UNROLL;
+    OMP_PRAGMA(omp parallel for)
+    for (int obt = 0; obt < BT_full; obt += MATMUL_LOOP_UNROLL) {
+        matmul_forward_tile(out, inp, weight, bias, obt, MATMUL_LOOP_UNROLL, C, OC, &layout);
+    }
+    if (BT_full < BT) {
+        matmul_forward_tile(out, inp, weight, bias, BT_full, BT - BT_full, C, OC, &layout);
+    }
+#endif
+}
+
+void matmul_backward_qkv(float* dinp, float* dweight, float* dbias,
+                         const float* dout, const float* inp, const float* weight,
+                         int B, int T, int C, int NH) {
+    // backward of matmul_forward_qkv, where dout is head-major like the output.
+    // These are the products of matmul_backward, with dout read through the same
+    // GemmLayout the forward wrote it with, so it is never gathered into a row-major copy
+    int OC = 3 * C;
+    int hs = C / NH; // head size
+    GemmLayout layout = { T, hs, (size_t)OC * T, (size_t)T * hs };
+    // dinp (B*T,C) += dout (B*T,OC) @ weight (OC,C)
+    matmul_sgemm(0, 0, B * T, C, OC, dout, 0, weight, C, NULL, dinp, C, 1, NULL, &layout, NULL, NULL);
+    // dweight (OC,C) += dout^T (OC,B*T) @ inp (B*T,C)
+    gemm_sgemm_ex(1, 0, OC, C, B * T, dout, 0, inp, C, NULL, dweight, C, 1, NULL, &layout, NULL, NULL);
+    // dbias (OC) += column sums of dout
+    if (dbias != NULL) { gemm_colsum(dbias, dout, B * T, OC, 0, &layout); }
+}
+
+// query rows and key columns per tile of the fused attention, and the largest head size
+#define ATTN_BLOCK 32
+#define ATTN_MAX_HS 128
+// (b,h) heads per thread below which attention_backward splits work inside a head
+#define ATTN_HEADS_PER_THREAD 4
+
+// offset of the (T, hs) rows of head h of the query (w = 0), key (w = 1) or value (w = 2)
+// of batch element b in the qkv activations. These are stored head-major, (B, 3, NH, T, hs),
+// as written by matmul_forward_qkv, so every head streams contiguous hs-wide rows
+static inline size_t attention_qkv_offset(int b, int w, int h, int T, int C, int NH) {
+    int hs = C / NH; // head size
+    return ((size_t)(b * 3 + w) * NH + h) * T * hs;
+}
+
+// Causal attention work is triangular: query tile qb reads qb + 1 key tiles, and key
+// tile kb is read by num_blocks - kb query tiles. Splitting (b, t, h) evenly would
+// leave the threads that own the last rows with twice the average work. Instead one
+// parallel work item is a pair of tiles, tile p and tile num_blocks - 1 - p, whose
+// combined cost is the same for every p, so a static schedule is balanced.
+static inline int attention_num_pairs(int num_blocks) {
+    return (num_blocks + 1) / 2;
+}
+
+static inline int attention_pair_tile(int pair, int side, int num_blocks) {
+    // tile of one side of a pair, or -1 for the missing partner of the middle tile
+    int tile = side == 0 ? pair : num_blocks - 1 - pair;
+    return (side == 1 && tile == pair) ? -1 : tile;
+}
+
+template <int HS>
+static inline void attention_forward_tile(float* __restrict out, float* __restrict lse,
+                                          const float* __restrict inp,
+                                          int b, int h, int t0, int nq,
+                                          int T, int C, int NH) {
+    // one tile of nq queries starting at t0, for batch b and head h
+    int hs = HS > 0 ? HS : C / NH; // head size, a constant in the preset instantiations
+    const float* query = inp + attention_qkv_offset(b, 0, h, T, C, NH);
+    const float* key = inp + attention_qkv_offset(b, 1, h, T, C, NH);
+    const float* value = inp + attention_qkv_offset(b, 2, h, T, C, NH);
+    float scale = 1.0 / sqrtf(hs);
+    float acc[ATTN_BLOCK][ATTN_MAX_HS];
+    float score[ATTN_BLOCK][ATTN_BLOCK];
+    float m[ATTN_BLOCK], l[ATTN_BLOCK];
+    for (int iq = 0; iq < nq; iq++) {
+        m[iq] = -FLT_MAX;
+        l[iq] = 0.0f;
+        for (int i = 0; i < hs; i++) { acc[iq][i] = 0.0f; }
+    }
+
+    // key tiles up to and including the diagonal one
+    for (int k0 = 0; k0 < t0 + nq; k0 += ATTN_BLOCK) {
+        int nk = t0 + nq - k0 < ATTN_BLOCK ? t0 + nq - k0 : ATTN_BLOCK;
+        for (int iq = 0; iq < nq; iq++) {
+            int t = t0 + iq;
+            // keys k0 .. t are visible to query t
+            int nvalid = t - k0 + 1 < nk ? t - k0 + 1 : nk;
+            if (nvalid <= 0) { continue; }
+            const float* query_t = query + t * hs;
+
+            // (query_t) dot (key_t2), and the max of this tile
+            float maxval = m[iq];
+            for (int jk = 0; jk < nvalid; jk++) {
+                const float* key_t2 = key + (k0 + jk) * hs;
+                float val = 0.0f;
+                for (int i = 0; i < hs; i++) {
+                    val += query_t[i] * key_t2[i];
+                }
+                val *= scale;
+                score[iq][jk] = val;
+                if (val > maxval) { maxval = val; }
             }
-            // inner loops. Because we do LOOP_UNROLL steps of inner bt, we can cache
-            // the value of weight[i + o * C] and reuse it.
-            // we compile with -Ofast, so the compiler will turn the inner loop into FMAs
-            for (int i = 0; i < C; i++) {
-                float w = weight[i + o * C];
-                for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
-                    int bt = obt + ibt;
-                    result[ibt] += inp[bt * C + i] * w;
+
+            // rescale what was accumulated under the old max, then add this tile
+            float correction = vmath_expf(m[iq] - maxval);
+            l[iq] *= correction;
+            for (int i = 0; i < hs; i++) { acc[iq][i] *= correction; }
+            // the exponentials of the tile in a pass of their own, which vectorizes
+            for (int jk = 0; jk < nvalid; jk++) { score[iq][jk] = vmath_expf(score[iq][jk] - maxval); }
+            for (int jk = 0; jk < nvalid; jk++) {
+                const float* value_t2 = value + (k0 + jk) * hs;
+                float expv = score[iq][jk];
+                l[iq] += expv;
+                for (int i = 0; i < hs; i++) {
+                    acc[iq][i] += expv * value_t2[i];
                 }
             }
-            // write back results to main memory
-            for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
-                int bt = obt + ibt;
-                out[bt * OC + o] = result[ibt];
+            m[iq] = maxval;
+        }
+    }
+
+    // normalize, and keep the logsumexp so backward can rebuild the softmax
+    for (int iq = 0; iq < nq; iq++) {
+        int t = t0 + iq;
+        float* out_bth = out + b * T * C + t * C + h * hs;
+        float l_inv = 1.0f / l[iq];
+        for (int i = 0; i < hs; i++) { out_bth[i] = acc[iq][i] * l_inv; }
+        lse[b*NH*T + h*T + t] = m[iq] + vmath_logf(l[iq]);
+    }
+}
+
+CPU_VARIANTS(template <int HS>, attention_forward_tile, <HS>,
+             (float* __restrict out, float* __restrict lse, const float* __restrict inp,
+              int b, int h, int t0, int nq, int T, int C, int NH),
+             (out, lse, inp, b, h, t0, nq, T, C, NH))
+
+template <int HS>
+static void attention_forward_impl(float* __restrict out, float* __restrict lse,
+                                   float* __restrict inp,
+                                   int B, int T, int C, int NH) {
+    int num_blocks = (T + ATTN_BLOCK - 1) / ATTN_BLOCK;
+    int num_pairs = attention_num_pairs(num_blocks);
+    int isa = cpu_kernel_isa(CPU_OP_ATTENTION);
+
+    OMP_PRAGMA(omp parallel for collapse(3) schedule(static))
+    for (int b = 0; b < B; b++) {
+        for (int h = 0; h < NH; h++) {
+            for (int pair = 0; pair < num_pairs; pair++) {
+                for (int side = 0; side < 2; side++) {
+                    int qb = attention_pair_tile(pair, side, num_blocks);
+                    if (qb < 0) { continue; }
+                    int t0 = qb * ATTN_BLOCK;
+                    int nq = T - t0 < ATTN_BLOCK ? T - t0 : ATTN_BLOCK;
+                    CPU_DISPATCH(isa, attention_forward_tile, <HS>, out, lse, inp, b, h, t0, nq, T, C, NH);
+                }
             }
         }
     }
 }
 
-void attention_forward(float* __restrict out, float* __restrict preatt, float* __restrict att,
+__attribute__((noinline))
+void attention_forward(float* __restrict out, float* __restrict lse,
                        float* __restrict inp,
                        int B, int T, int C, int NH) {
-    // input is (B, T, 3C) holding the query, key, value (Q, K, V) vectors
-    // preatt, att are (B, NH, T, T). NH = number of heads, T = sequence length
-    // that holds the pre-attention and post-attention scores (used in backward)
+    // input is (B, 3, NH, T, hs) holding the query, key, value (Q, K, V) vectors, head-major
+    // lse is (B, NH, T), the logsumexp of every row of scaled scores (used in backward)
     // output is (B, T, C)
     // attention is the only layer that mixes information across time
     // every other operation is applied at every (b,t) position independently
     // (and of course, no layer mixes information across batch)
-    int C3 = C*3;
-    int hs = C / NH; // head size
-    float scale = 1.0 / sqrtf(hs);
+    // the (T, T) pre-attention scores and softmax are never materialized: a tile of
+    // ATTN_BLOCK queries streams the key/value tiles at or below the causal diagonal,
+    // keeping a running max m and running sum l of exp(score - m) per query, and
+    // rescales its output accumulator whenever the max grows (online softmax)
+    assert(C / NH <= ATTN_MAX_HS);
+    DISPATCH_HEAD_SIZE(C / NH, attention_forward_impl, out, lse, inp, B, T, C, NH);
+}
 
-    // #pragma omp parallel for collapse(3)
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            for (int h = 0; h < NH; h++) {
-                float* query_t = inp + b * T * C3 + t * C3 + h * hs;
-                float* preatt_bth = preatt + b*NH*T*T + h*T*T + t*T;
-                float* att_bth = att + b*NH*T*T + h*T*T + t*T;
-
-                // pass 1: calculate query dot key and maxval
-                float maxval = -10000.0f; // TODO something better
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
-
-                    // (query_t) dot (key_t2)
-                    float val = 0.0f;
-                    for (int i = 0; i < hs; i++) {
-                        val += query_t[i] * key_t2[i];
-                    }
-                    val *= scale;
-                    if (val > maxval) {
-                        maxval = val;
-                    }
-
-                    preatt_bth[t2] = val;
+// the per-(t, t2) update of attention_backward_head, split out so that the compiler
+// sees the gradient rows as non-aliasing and vectorizes over the head size
+static inline void attention_backward_accumulate(float* __restrict dquery_t, float* __restrict dkey_t2,
+                                                 float* __restrict dvalue_t2, const float* __restrict query_t,
+                                                 const float* __restrict key_t2, const float* __restrict dout_bth,
+                                                 float att, float dpreatt, int hs) {
+    for (int i = 0; i < hs; i++) {
+        dvalue_t2[i] += att * dout_bth[i];
+        dquery_t[i] += key_t2[i] * dpreatt;
+        dkey_t2[i] += query_t[i] * dpreatt;
+    }
+}
+
+template <int HS>
+static inline void attention_backward_head(float* dinp, const float* dout,
+                                           const float* inp, const float* out, const float* lse,
+                                           int b, int h, int T, int C, int NH) {
+    // all of one (b,h): position t writes dkey/dvalue at every t2 <= t, but only
+    // within its own head, so one pass in t computes att once per (t, t2)
+    int hs = HS > 0 ? HS : C / NH; // head size, a constant in the preset instantiations
+    const float* query = inp + attention_qkv_offset(b, 0, h, T, C, NH);
+    const float* key = inp + attention_qkv_offset(b, 1, h, T, C, NH);
+    const float* value = inp + attention_qkv_offset(b, 2, h, T, C, NH);
+    float* dquery = dinp + attention_qkv_offset(b, 0, h, T, C, NH);
+    float* dkey = dinp + attention_qkv_offset(b, 1, h, T, C, NH);
+    float* dvalue = dinp + attention_qkv_offset(b, 2, h, T, C, NH);
+    float scale = 1.f / sqrtf(hs);
+    for (int t = 0; t < T; t++) {
+        const float* query_t = query + t * hs;
+        float* dquery_t = dquery + t * hs;
+        const float* out_bth = out + b * T * C + t * C + h * hs;
+        const float* dout_bth = dout + b * T * C + t * C + h * hs;
+        float lse_bth = lse[b*NH*T + h*T + t];
+        float D = 0.0f;
+        for (int i = 0; i < hs; i++) {
+            D += dout_bth[i] * out_bth[i];
+        }
+
+        // keys in tiles of ATTN_BLOCK, so that the exponentials of a tile take one vectorized pass
+        for (int k0 = 0; k0 <= t; k0 += ATTN_BLOCK) {
+            int nk = t + 1 - k0 < ATTN_BLOCK ? t + 1 - k0 : ATTN_BLOCK;
+            float att[ATTN_BLOCK], datt[ATTN_BLOCK];
+            for (int jk = 0; jk < nk; jk++) {
+                const float* key_t2 = key + (k0 + jk) * hs;
+                const float* value_t2 = value + (k0 + jk) * hs;
+                // recompute att[t2], and get datt[t2] through the value accumulation
+                float preatt = 0.0f;
+                float datt_t2 = 0.0f;
+                for (int i = 0; i < hs; i++) {
+                    preatt += query_t[i] * key_t2[i];
+                    datt_t2 += dout_bth[i] * value_t2[i];
                 }
+                att[jk] = preatt * scale - lse_bth;
+                datt[jk] = datt_t2;
+            }
+            for (int jk = 0; jk < nk; jk++) { att[jk] = vmath_expf(att[jk]); }
+            for (int jk = 0; jk < nk; jk++) {
+                const float* key_t2 = key + (k0 + jk) * hs;
+                float* dkey_t2 = dkey + (k0 + jk) * hs;
+                float* dvalue_t2 = dvalue + (k0 + jk) * hs;
+                // through the softmax, then the query @ key matmul
+                float dpreatt = att[jk] * (datt[jk] - D) * scale;
+                attention_backward_accumulate(dquery_t, dkey_t2, dvalue_t2, query_t, key_t2, dout_bth,
+                                              att[jk], dpreatt, hs);
+            }
+        }
+    }
+}
 
-                // pass 2: calculate the exp and keep track of sum
-                // maxval is being calculated and subtracted only for numerical stability
-                float expsum = 0.0f;
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float expv = expf(preatt_bth[t2] - maxval);
-                    expsum += expv;
-                    att_bth[t2] = expv;
+CPU_VARIANTS(template <int HS>, attention_backward_head, <HS>,
+             (float* dinp, const float* dout, const float* inp, const float* out, const float* lse,
+              int b, int h, int T, int C, int NH),
+             (dinp, dout, inp, out, lse, b, h, T, C, NH))
+
+template <int HS>
+static inline void attention_backward_query_tile(float* __restrict dinp, const float* __restrict dout,
+                                                 const float* __restrict inp, const float* __restrict out,
+                                                 const float* __restrict lse,
+                                                 int b, int h, int t0, int nq,
+                                                 int T, int C, int NH) {
+    // dquery of nq queries starting at t0: each one reads the keys t2 <= t
+    int hs = HS > 0 ? HS : C / NH; // head size, a constant in the preset instantiations
+    const float* query = inp + attention_qkv_offset(b, 0, h, T, C, NH);
+    const float* key = inp + attention_qkv_offset(b, 1, h, T, C, NH);
+    const float* value = inp + attention_qkv_offset(b, 2, h, T, C, NH);
+    float* dquery = dinp + attention_qkv_offset(b, 0, h, T, C, NH);
+    float scale = 1.f / sqrtf(hs);
+    for (int t = t0; t < t0 + nq; t++) {
+        const float* query_t = query + t * hs;
+        const float* out_bth = out + b * T * C + t * C + h * hs;
+        const float* dout_bth = dout + b * T * C + t * C + h * hs;
+        float lse_bth = lse[b*NH*T + h*T + t];
+        float D = 0.0f;
+        for (int i = 0; i < hs; i++) {
+            D += dout_bth[i] * out_bth[i];
+        }
+        float dquery_acc[ATTN_MAX_HS];
+        for (int i = 0; i < hs; i++) { dquery_acc[i] = 0.0f; }
+        for (int k0 = 0; k0 <= t; k0 += ATTN_BLOCK) {
+            int nk = t + 1 - k0 < ATTN_BLOCK ? t + 1 - k0 : ATTN_BLOCK;
+            float att[ATTN_BLOCK], datt[ATTN_BLOCK];
+            for (int jk = 0; jk < nk; jk++) {
+                const float* key_t2 = key + (k0 + jk) * hs;
+                const float* value_t2 = value + (k0 + jk) * hs;
+                // recompute att[t2], and get datt[t2] through the value accumulation
+                float preatt = 0.0f;
+                float datt_t2 = 0.0f;
+                for (int i = 0; i < hs; i++) {
+                    preatt += query_t[i] * key_t2[i];
+                    datt_t2 += dout_bth[i] * value_t2[i];
                 }
-                float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
-
-                // pass 3: normalize to get the softmax
-                for (int t2 = 0; t2 < T; t2++) {
-                    if (t2 <= t) {
-                        att_bth[t2] *= expsum_inv;
-                    } else {
-                        // causal attention mask. not strictly necessary to set to zero here
-                        // only doing this explicitly for debugging and checking to PyTorch
-                        att_bth[t2] = 0.0f;
-                    }
+                att[jk] = preatt * scale - lse_bth;
+                datt[jk] = datt_t2;
+            }
+            for (int jk = 0; jk < nk; jk++) { att[jk] = vmath_expf(att[jk]); }
+            for (int jk = 0; jk < nk; jk++) {
+                const float* key_t2 = key + (k0 + jk) * hs;
+                // through the softmax, then the query @ key matmul
+                float dpreatt = att[jk] * (datt[jk] - D) * scale;
+                for (int i = 0; i < hs; i++) {
+                    dquery_acc[i] += key_t2[i] * dpreatt;
                 }
+            }
+        }
+        float* dquery_t = dquery + t * hs;
+        for (int i = 0; i < hs; i++) { dquery_t[i] += dquery_acc[i]; }
+    }
+}
+
+CPU_VARIANTS(template <int HS>, attention_backward_query_tile, <HS>,
+             (float* __restrict dinp, const float* __restrict dout, const float* __restrict inp,
+              const float* __restrict out, const float* __restrict lse,
+              int b, int h, int t0, int nq, int T, int C, int NH),
+             (dinp, dout, inp, out, lse, b, h, t0, nq, T, C, NH))
+
+template <int HS>
+static inline void attention_backward_key_tile(float* __restrict dinp, const float* __restrict dout,
+                                               const float* __restrict inp, const float* __restrict out,
+                                               const float* __restrict lse,
+                                               int b, int h, int k0, int nk,
+                                               int T, int C, int NH) {
+    // dkey and dvalue of nk keys starting at k0: each one is read by the queries t >= t2
+    int hs = HS > 0 ? HS : C / NH; // head size, a constant in the preset instantiations
+    const float* query = inp + attention_qkv_offset(b, 0, h, T, C, NH);
+    const float* key = inp + attention_qkv_offset(b, 1, h, T, C, NH);
+    const float* value = inp + attention_qkv_offset(b, 2, h, T, C, NH);
+    float* dkey = dinp + attention_qkv_offset(b, 1, h, T, C, NH);
+    float* dvalue = dinp + attention_qkv_offset(b, 2, h, T, C, NH);
+    float scale = 1.f / sqrtf(hs);
+    float dkey_acc[ATTN_BLOCK][ATTN_MAX_HS];
+    float dvalue_acc[ATTN_BLOCK][ATTN_MAX_HS];
+    for (int jk = 0; jk < nk; jk++) {
+        for (int i = 0; i < hs; i++) { dkey_acc[jk][i] = 0.0f; dvalue_acc[jk][i] = 0.0f; }
+    }
+    for (int t = k0; t < T; t++) {
+        const float* query_t = query + t * hs;
+        const float* out_bth = out + b * T * C + t * C + h * hs;
+        const float* dout_bth = dout + b * T * C + t * C + h * hs;
+        float lse_bth = lse[b*NH*T + h*T + t];
+        float D = 0.0f;
+        for (int i = 0; i < hs; i++) {
+            D += dout_bth[i] * out_bth[i];
+        }
+        // keys k0 .. t of this tile are visible to query t
+        int nvalid = t - k0 + 1 < nk ? t - k0 + 1 : nk;
+        float att[ATTN_BLOCK], datt[ATTN_BLOCK];
+        for (int jk = 0; jk < nvalid; jk++) {
+            const float* key_t2 = key + (k0 + jk) * hs;
+            const float* value_t2 = value + (k0 + jk) * hs;
+            float preatt = 0.0f;
+            float datt_t2 = 0.0f;
+            for (int i = 0; i < hs; i++) {
+                preatt += query_t[i] * key_t2[i];
+                datt_t2 += dout_bth[i] * value_t2[i];
+            }
+            att[jk] = preatt * scale - lse_bth;
+            datt[jk] = datt_t2;
+        }
+        for (int jk = 0; jk < nvalid; jk++) { att[jk] = vmath_expf(att[jk]); }
+        for (int jk = 0; jk < nvalid; jk++) {
+            float dpreatt = att[jk] * (datt[jk] - D) * scale;
+            for (int i = 0; i < hs; i++) {
+                dvalue_acc[jk][i] += att[jk] * dout_bth[i];
+                dkey_acc[jk][i] += query_t[i] * dpreatt;
+            }
+        }
+    }
+    for (int jk = 0; jk < nk; jk++) {
+        float* dkey_t2 = dkey + (k0 + jk) * hs;
+        float* dvalue_t2 = dvalue + (k0 + jk) * hs;
+        for (int i = 0; i < hs; i++) {
+            dkey_t2[i] += dkey_acc[jk][i];
+            dvalue_t2[i] += dvalue_acc[jk][i];
+        }
+    }
+}
+
+CPU_VARIANTS(template <int HS>, attention_backward_key_tile, <HS>,
+             (float* __restrict dinp, const float* __restrict dout, const float* __restrict inp,
+              const float* __restrict out, const float* __restrict lse,
+              int b, int h, int k0, int nk, int T, int C, int NH),
+             (dinp, dout, inp, out, lse, b, h, k0, nk, T, C, NH))
+
+template <int HS>
+static void attention_backward_impl(float* dinp, float* dout, float* inp, float* out, float* lse,
+                                    int B, int T, int C, int NH) {
+    int nthreads = 1;
+    #if defined(OMP) && !defined(ENZYME_FULL_AD)
+    nthreads = omp_get_max_threads();
+#endif
+    int isa = cpu_kernel_isa(CPU_OP_ATTENTION);
+
+    // with enough (b,h) heads per thread, whole heads are the cheapest unit of work
+    if (nthreads == 1 || B * NH >= ATTN_HEADS_PER_THREAD * nthreads) {
+        OMP_PRAGMA(omp parallel for collapse(2) schedule(static))
+        for (int b = 0; b < B; b++) {
+            for (int h = 0; h < NH; h++) {
+                CPU_DISPATCH(isa, attention_backward_head, <HS>, dinp, dout, inp, out, lse, b, h, T, C, NH);
+            }
+        }
+        return;
+    }
 
-                // pass 4: accumulate weighted values into the output of attention
-                float* out_bth = out + b * T * C + t * C + h * hs;
-                for (int i = 0; i < hs; i++) { out_bth[i] = 0.0f; }
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
-                    float att_btht2 = att_bth[t2];
-                    for (int i = 0; i < hs; i++) {
-                        out_bth[i] += att_btht2 * value_t2[i];
-                    }
+    // otherwise split below the head: dquery is owned by the query rows and dkey/dvalue
+    // by the key rows, so one pass over query tiles and one over key tiles both write
+    // without races, for the price of recomputing att twice
+    int num_blocks = (T + ATTN_BLOCK - 1) / ATTN_BLOCK;
+    int num_pairs = attention_num_pairs(num_blocks);
+
+    OMP_PRAGMA(omp parallel for collapse(3) schedule(static))
+    for (int b = 0; b < B; b++) {
+        for (int h = 0; h < NH; h++) {
+            for (int pair = 0; pair < num_pairs; pair++) {
+                for (int side = 0; side < 2; side++) {
+                    int qb = attention_pair_tile(pair, side, num_blocks);
+                    if (qb < 0) { continue; }
+                    int t0 = qb * ATTN_BLOCK;
+                    int nq = T - t0 < ATTN_BLOCK ? T - t0 : ATTN_BLOCK;
+                    CPU_DISPATCH(isa, attention_backward_query_tile, <HS>, dinp, dout, inp, out, lse,
+                                 b, h, t0, nq, T, C, NH);
+                }
+            }
+        }
+    }
+
+    OMP_PRAGMA(omp parallel for collapse(3) schedule(static))
+    for (int b = 0; b < B; b++) {
+        for (int h = 0; h < NH; h++) {
+            for (int pair = 0; pair < num_pairs; pair++) {
+                for (int side = 0; side < 2; side++) {
+                    int kb = attention_pair_tile(pair, side, num_blocks);
+                    if (kb < 0) { continue; }
+                    int k0 = kb * ATTN_BLOCK;
+                    int nk = T - k0 < ATTN_BLOCK ? T - k0 : ATTN_BLOCK;
+                    CPU_DISPATCH(isa, attention_backward_key_tile, <HS>, dinp, dout, inp, out, lse,
+                                 b, h, k0, nk, T, C, NH);
                 }
             }
         }
     }
 }
 
+void attention_backward(float* dinp, float* dout, float* inp, float* out, float* lse,
+                        int B, int T, int C, int NH) {
+    // inp/dinp are (B, 3, NH, T, hs) Q,K,V, head-major
+    // out/dout are (B, T, C), lse is (B, NH, T): only what attention_forward kept
+    // the softmax is recomputed from the queries, keys and lse instead of being read
+    // back from (B, NH, T, T) buffers: with att = exp(query_t . key_t2 * scale - lse_t)
+    // and datt = dout_t . value_t2, the softmax backward is att * (datt - D_t), where
+    // D_t = sum_t2 att * datt = dout_t . out_t needs no pass over t2 of its own
+    assert(C / NH <= ATTN_MAX_HS);
+    DISPATCH_HEAD_SIZE(C / NH, attention_backward_impl, dinp, dout, inp, out, lse, B, T, C, NH);
+}
 
 #define GELU_SCALING_FACTOR sqrtf(2.0f / M_PI)
+// elements per task of the elementwise GeLU kernels
+#define GELU_CHUNK 8192
+
+static inline void gelu_forward_chunk(float* __restrict out, const float* __restrict inp, int n) {
+    for (int i = 0; i < n; i++) {
+        float x = inp[i];
+        float cube = 0.044715f * x * x * x;
+        out[i] = 0.5f * x * (1.0f + vmath_tanhf(GELU_SCALING_FACTOR * (x + cube)));
+    }
+}
+
+CPU_VARIANTS(, gelu_forward_chunk, , (float* __restrict out, const float* __restrict inp, int n),
+             (out, inp, n))
+
+__attribute__((noinline))
 void gelu_forward(float* __restrict out, float* __restrict inp, int N) {
     // (approximate) GeLU elementwise non-linearity in the MLP block of Transformer
-    for (int i = 0; i < N; i++) {
+    int isa = cpu_kernel_isa(CPU_OP_GELU);
+    OMP_PRAGMA(omp parallel for)
+    for (int i0 = 0; i0 < N; i0 += GELU_CHUNK) {
+        int n = N - i0 < GELU_CHUNK ? N - i0 : GELU_CHUNK;
+        CPU_DISPATCH(isa, gelu_forward_chunk, , out + i0, inp + i0, n);
+    }
+}
+
+// we want to use -Ofast optimization, but sadly GeLU breaks, so disable this flag just for it (#168).
+// The per-ISA copies of its workers are spelled out below, to carry the same attribute
+#pragma float_control(precise, on, push)
+#if defined(__GNUC__) && !defined(__clang__)
+#define GELU_BACKWARD_MATH __attribute__((optimize("no-finite-math-only")))
+#else
+#define GELU_BACKWARD_MATH
+#endif
+GELU_BACKWARD_MATH
+static inline void gelu_backward_chunk(float* dinp, const float* inp, const float* dout, int n) {
+    for (int i = 0; i < n; i++) {
         float x = inp[i];
         float cube = 0.044715f * x * x * x;
-        out[i] = 0.5f * x * (1.0f + tanhf(GELU_SCALING_FACTOR * (x + cube)));
+        float tanh_arg = GELU_SCALING_FACTOR * (x + cube);
+        float tanh_out = vmath_tanhf(tanh_arg);
+        float coshf_out = vmath_coshf(tanh_arg);
+        float sech_out = 1.0f / (coshf_out * coshf_out);
+        float local_grad = 0.5f * (1.0f + tanh_out) + x * 0.5f * sech_out * GELU_SCALING_FACTOR * (1.0f + 3.0f * 0.044715f * x * x);
+        dinp[i] += local_grad * dout[i];
     }
 }
 
+// columns [j0, j0 + n) of gelu_backward_colsum, over all BT rows
+GELU_BACKWARD_MATH
+static inline void gelu_backward_colsum_block(float* dpre, float* dbias, const float* pre, const float* dout,
+                                              int BT, int OC, int j0, int n) {
+    float acc[GEMM_COLSUM_BLOCK] = {0.0f};
+    for (int i = 0; i < BT; i++) {
+        const float* pre_i = pre + (size_t)i * OC + j0;
+        const float* dout_i = dout + (size_t)i * OC + j0;
+        float* dpre_i = dpre + (size_t)i * OC + j0;
+        for (int j = 0; j < n; j++) {
+            float x = pre_i[j];
+            float cube = 0.044715f * x * x * x;
+            float tanh_arg = GELU_SCALING_FACTOR * (x + cube);
+            float tanh_out = vmath_tanhf(tanh_arg);
+            float coshf_out = vmath_coshf(tanh_arg);
+            float sech_out = 1.0f / (coshf_out * coshf_out);
+            float local_grad = 0.5f * (1.0f + tanh_out) + x * 0.5f * sech_out * GELU_SCALING_FACTOR * (1.0f + 3.0f * 0.044715f * x * x);
+            dpre_i[j] += local_grad * dout_i[j];
+            acc[j] += dpre_i[j];
+        }
+    }
+    for (int j = 0; dbias != NULL && j < n; j++) { dbias[j0 + j] += acc[j]; }
+}
+
+#ifndef CPU_DISPATCH_GENERIC
+GELU_BACKWARD_MATH CPU_TARGET_AVX2
+static void gelu_backward_chunk_avx2(float* dinp, const float* inp, const float* dout, int n) {
+    gelu_backward_chunk(dinp, inp, dout, n);
+}
+GELU_BACKWARD_MATH CPU_TARGET_AVX512
+static void gelu_backward_chunk_avx512(float* dinp, const float* inp, const float* dout, int n) {
+    gelu_backward_chunk(dinp, inp, dout, n);
+}
+GELU_BACKWARD_MATH CPU_TARGET_AVX2
+static void gelu_backward_colsum_block_avx2(float* dpre, float* dbias, const float* pre, const float* dout,
+                                            int BT, int OC, int j0, int n) {
+    gelu_backward_colsum_block(dpre, dbias, pre, dout, BT, OC, j0, n);
+}
+GELU_BACKWARD_MATH CPU_TARGET_AVX512
+static void gelu_backward_colsum_block_avx512(float* dpre, float* dbias, const float* pre, const float* dout,
+                                              int BT, int OC, int j0, int n) {
+    gelu_backward_colsum_block(dpre, dbias, pre, dout, BT, OC, j0, n);
+}
+#endif
+
+void gelu_backward(float* dinp, float* inp, float* dout, int N) {
+    int isa = cpu_kernel_isa(CPU_OP_GELU);
+    OMP_PRAGMA(omp parallel for)
+    for (int i0 = 0; i0 < N; i0 += GELU_CHUNK) {
+        int n = N - i0 < GELU_CHUNK ? N - i0 : GELU_CHUNK;
+        CPU_DISPATCH(isa, gelu_backward_chunk, , dinp + i0, inp + i0, dout + i0, n);
+    }
+}
+
+// the input stage of matmul_gelu_backward: gelu_backward into dpre, and the column sums
+// of dpre into dbias (may be NULL), in one pass. Parallel over column blocks as in
+// gemm_colsum, so every dbias[j] is owned by one thread and summed over the rows in order
+void gelu_backward_colsum(float* dpre, float* dbias, float* pre, float* dout, int BT, int OC) {
+    int isa = cpu_kernel_isa(CPU_OP_GELU);
+    int num_blocks = (OC + GEMM_COLSUM_BLOCK - 1) / GEMM_COLSUM_BLOCK;
+    OMP_PRAGMA(omp parallel for)
+    for (int jb = 0; jb < num_blocks; jb++) {
+        int j0 = jb * GEMM_COLSUM_BLOCK;
+        int n = OC - j0 < GEMM_COLSUM_BLOCK ? OC - j0 : GEMM_COLSUM_BLOCK;
+        CPU_DISPATCH(isa, gelu_backward_colsum_block, , dpre, dbias, pre, dout, BT, OC, j0, n);
+    }
+}
+#pragma float_control(pop)
+
+__attribute__((noinline))
 void residual_forward(float* __restrict out, float* __restrict inp1, float* __restrict inp2, int N) {
+    OMP_PRAGMA(omp parallel for)
     for (int i = 0; i < N; i++) {
         out[i] = inp1[i] + inp2[i];
     }
 }
 
-void softmax_forward(float* __restrict probs, float* __restrict logits, int B, int T, int V, int Vp) {
+void residual_backward(float* dinp1, float* dinp2, float* dout, int N) {
+    OMP_PRAGMA(omp parallel for)
+    for (int i = 0; i < N; i++) {
+        dinp1[i] += dout[i];
+        dinp2[i] += dout[i];
+    }
+}
+
+// lanes of the vectorized Welford pass of residual_layernorm_forward
+#define LN_WELFORD_LANES 16
+
+// one (b,t) row of residual_layernorm_forward: x = x1 + x2, out_bt (may be NULL) = layernorm(x)
+template <int CS>
+static inline void residual_layernorm_forward_row(float* __restrict x, float* __restrict out_bt,
+                                                  float* __restrict mean_bt, float* __restrict rstd_bt,
+                                                  const float* __restrict x1, const float* __restrict x2,
+                                                  const float* __restrict weight, const float* __restrict bias,
+                                                  int C_any) {
+    const int C = CS > 0 ? CS : C_any; // a constant in the preset instantiations
+    float eps = 1e-5f;
+    float lane_mean[LN_WELFORD_LANES] = {0.0f};
+    float lane_m2[LN_WELFORD_LANES] = {0.0f};
+    int steps = C / LN_WELFORD_LANES;
+    for (int k = 0; k < steps; k++) {
+        float inv_n = 1.0f / (k + 1);
+        for (int j = 0; j < LN_WELFORD_LANES; j++) {
+            int i = k * LN_WELFORD_LANES + j;
+            float xi = x1[i] + x2[i];
+            x[i] = xi;
+            float delta = xi - lane_mean[j];
+            lane_mean[j] += delta * inv_n;
+            lane_m2[j] += delta * (xi - lane_mean[j]);
+        }
+    }
+    // merge the lanes, each holding `steps` channels, then add the leftover channels
+    float n = 0.0f;
+    float m = 0.0f;
+    float m2 = 0.0f;
+    for (int j = 0; j < LN_WELFORD_LANES && steps > 0; j++) {
+        float n_new = n + steps;
+        float delta = lane_mean[j] - m;
+        m += delta * steps / n_new;
+        m2 += lane_m2[j] + delta * delta * n * steps / n_new;
+        n = n_new;
+    }
+    for (int i = steps * LN_WELFORD_LANES; i < C; i++) {
+        float xi = x1[i] + x2[i];
+        x[i] = xi;
+        n += 1.0f;
+        float delta = xi - m;
+        m += delta / n;
+        m2 += delta * (xi - m);
+    }
+    // the variance (without any bias correction), and the rstd
+    float s = 1.0f / sqrtf(m2 / C + eps);
+    // normalize, then scale and shift, while the row is still in L1
+    if (out_bt != NULL) {
+        for (int i = 0; i < C; i++) {
+            float n_i = s * (x[i] - m);
+            out_bt[i] = n_i * weight[i] + bias[i];
+        }
+    }
+    *mean_bt = m;
+    *rstd_bt = s;
+}
+
+CPU_VARIANTS(template <int CS>, residual_layernorm_forward_row, <CS>,
+             (float* __restrict x, float* __restrict out_bt, float* __restrict mean_bt,
+              float* __restrict rstd_bt, const float* __restrict x1, const float* __restrict x2,
+              const float* __restrict weight, const float* __restrict bias, int C_any),
+             (x, out_bt, mean_bt, rstd_bt, x1, x2, weight, bias, C_any))
+
+template <int CS>
+static void residual_layernorm_forward_impl(float* __restrict residual, float* __restrict out,
+                                            float* __restrict mean, float* __restrict rstd,
+                                            float* __restrict inp1, float* __restrict inp2,
+                                            float* __restrict weight, float* __restrict bias,
+                                            int B, int T, int C_any) {
+    const int C = CS > 0 ? CS : C_any; // a constant in the preset instantiations
+    int isa = cpu_kernel_isa(CPU_OP_LAYERNORM);
+    OMP_PRAGMA(omp parallel for collapse(2))
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            size_t off = (size_t)b * T * C + (size_t)t * C;
+            float* out_bt = out != NULL ? out + off : NULL;
+            CPU_DISPATCH(isa, residual_layernorm_forward_row, <CS>, residual + off, out_bt,
+                         mean + b * T + t, rstd + b * T + t, inp1 + off, inp2 + off, weight, bias, C);
+        }
+    }
+}
+
+__attribute__((noinline))
+void residual_layernorm_forward(float* __restrict residual, float* __restrict out,
+                                float* __restrict mean, float* __restrict rstd,
+                                float* __restrict inp1, float* __restrict inp2,
+                                float* __restrict weight, float* __restrict bias,
+                                int B, int T, int C) {
+    // residual_forward followed by layernorm_forward of its output, in one pass:
+    // residual = inp1 + inp2 and out = layernorm(residual) are both (B,T,C),
+    // mean and rstd are (B,T) as in layernorm_forward.
+    // The mean and variance come from a single Welford pass over the sum as it is
+    // written, instead of separate passes for the add, the mean and the variance.
+    // Each of LN_WELFORD_LANES lanes runs the Welford recurrence over every
+    // LN_WELFORD_LANES-th channel, so the loop vectorizes, and the lanes are merged
+    // with the pairwise (Chan et al.) update at the end of the row.
+    // As in layernorm_forward, out may be NULL
+    DISPATCH_CHANNELS(C, residual_layernorm_forward_impl, residual, out, mean, rstd, inp1, inp2,
+                      weight, bias, B, T, C);
+}
+
+// one (b,t) row of residual_layernorm_backward, into both inputs
+template <int CS>
+static inline void residual_layernorm_backward_row(float* dinp1_bt, float* dinp2_bt,
+                                                   const float* dresidual_bt,
+                                                   const float* dout_bt, const float* x,
+                                                   const float* weight, float mean_bt, float rstd_bt,
+                                                   int C_any) {
+    const int C = CS > 0 ? CS : C_any; // a constant in the preset instantiations
+    // the two reductions of layernorm_backward
+    float dnorm_mean = 0.0f;
+    float dnorm_norm_mean = 0.0f;
+    for (int i = 0; i < C; i++) {
+        float norm_bti = (x[i] - mean_bt) * rstd_bt;
+        float dnorm_i = weight[i] * dout_bt[i];
+        dnorm_mean += dnorm_i;
+        dnorm_norm_mean += dnorm_i * norm_bti;
+    }
+    dnorm_mean = dnorm_mean / C;
+    dnorm_norm_mean = dnorm_norm_mean / C;
+
+    for (int i = 0; i < C; i++) {
+        float norm_bti = (x[i] - mean_bt) * rstd_bt;
+        float dnorm_i = weight[i] * dout_bt[i];
+        float dval = (dnorm_i - dnorm_mean - norm_bti * dnorm_norm_mean) * rstd_bt;
+        float dx = dresidual_bt[i] + dval;
+        dinp1_bt[i] += dx;
+        dinp2_bt[i] += dx;
+    }
+}
+
+CPU_VARIANTS(template <int CS>, residual_layernorm_backward_row, <CS>,
+             (float* dinp1_bt, float* dinp2_bt, const float* dresidual_bt,
+              const float* dout_bt, const float* x, const float* weight,
+              float mean_bt, float rstd_bt, int C_any),
+             (dinp1_bt, dinp2_bt, dresidual_bt, dout_bt, x, weight, mean_bt, rstd_bt, C_any))
+
+template <int CS>
+static void residual_layernorm_backward_impl(float* dinp1, float* dinp2, float* dweight, float* dbias,
+                                             float* dresidual, float* dout, float* residual, float* weight,
+                                             float* mean, float* rstd, int B, int T, int C_any) {
+    const int C = CS > 0 ? CS : C_any; // a constant in the preset instantiations
+    int isa = cpu_kernel_isa(CPU_OP_LAYERNORM);
+    OMP_PRAGMA(omp parallel for collapse(2))
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            size_t off = (size_t)b * T * C + (size_t)t * C;
+            CPU_DISPATCH(isa, residual_layernorm_backward_row, <CS>, dinp1 + off, dinp2 + off,
+                         dresidual + off, dout + off, residual + off, weight,
+                         mean[b * T + t], rstd[b * T + t], C);
+        }
+    }
+    layernorm_backward_params(dweight, dbias, dout, residual, mean, rstd, B, T, C);
+}
+
+void residual_layernorm_backward(float* dinp1, float* dinp2, float* dweight, float* dbias,
+                                 float* dresidual, float* dout, float* residual, float* weight,
+                                 float* mean, float* rstd, int B, int T, int C) {
+    // backward of residual_layernorm_forward. The gradient of the residual sum is
+    // dresidual, from its other readers, plus the layernorm backward of dout, and it
+    // flows unchanged into both inputs, so residual_backward is folded into the row pass
+    DISPATCH_CHANNELS(C, residual_layernorm_backward_impl, dinp1, dinp2, dweight, dbias, dresidual,
+                      dout, residual, weight, mean, rstd, B, T, C);
+}
+
+__attribute__((noinline))
+void matmul_gelu_forward(float* __restrict pre, float* __restrict out,
+                         const float* __restrict inp, const float* __restrict weight, const float* __restrict bias,
+                         int B, int T, int C, int OC) {
+    // matmul_forward followed by gelu_forward: pre = inp @ weight^T + bias (B,T,OC) is
+    // kept for the backward, and out = gelu(pre). The GELU runs in the GEMM epilogue on
+    // every finished tile of pre while it is in L1, instead of as a second pass
+#ifndef ENZYME_FULL_AD
+    GemmEpilogue epilogue = { GEMM_EPILOGUE_GELU, out, OC };
+    matmul_sgemm(0, 1, B * T, OC, C, inp, C, weight, C, bias, pre, OC, 0, NULL, NULL, NULL, &epilogue);
+#else
+    matmul_forward(pre, inp, weight, bias, B, T, C, OC);
+    gelu_forward(out, pre, B * T * OC);
+#endif
+}
+
+__attribute__((noinline))
+void matmul_residual_forward(float* __restrict out,
+                             const float* __restrict inp, const float* __restrict weight, const float* __restrict bias,
+                             float* __restrict residual, int B, int T, int C, int OC) {
+    // matmul_forward followed by residual_forward: out = residual + inp @ weight^T + bias,
+    // all (B,T,OC). The GEMM epilogue adds the residual, so the matmul output is never
+    // stored on its own and out is the residual stream directly
+#ifndef ENZYME_FULL_AD
+    GemmEpilogue epilogue = { GEMM_EPILOGUE_RESIDUAL, residual, OC };
+    matmul_sgemm(0, 1, B * T, OC, C, inp, C, weight, C, bias, out, OC, 0, NULL, NULL, NULL, &epilogue);
+#else
+    matmul_forward(out, inp, weight, bias, B, T, C, OC);
+    for (int i = 0; i < B * T * OC; i++) {
+        out[i] += residual[i];
+    }
+#endif
+}
+
+void matmul_gelu_backward(float* dinp, float* dweight, float* dbias, float* dpre,
+                          float* dout, float* pre, const float* inp, const float* weight,
+                          int B, int T, int C, int OC) {
+    // backward of matmul_gelu_forward, where dout is the gradient of the GELU output.
+    // gelu_backward runs as the input stage of matmul_backward, together with the bias
+    // gradient, and leaves dpre, the gradient of pre, for the two weight GEMMs
+    gelu_backward_colsum(dpre, dbias, pre, dout, B * T, OC);
+    // dinp (B*T,C) += dpre (B*T,OC) @ weight (OC,C)
+    matmul_sgemm(0, 0, B * T, C, OC, dpre, OC, weight, C, NULL, dinp, C, 1, NULL, NULL, NULL, NULL);
+    // dweight (OC,C) += dpre^T (OC,B*T) @ inp (B*T,C)
+    gemm_sgemm(1, 0, OC, C, B * T, dpre, OC, inp, C, NULL, dweight, C, 1);
+}
+
+void matmul_residual_backward(float* dinp, float* dweight, float* dbias, float* dresidual,
+                              const float* dout, const float* inp, const float* weight,
+                              int B, int T, int C, int OC) {
+    // backward of matmul_residual_forward: the residual passes dout through unchanged
+    matmul_backward(dinp, dweight, dbias, dout, inp, weight, B, T, C, OC);
+    OMP_PRAGMA(omp parallel for)
+    for (int i = 0; i < B * T * OC; i++) {
+        dresidual[i] += dout[i];
+    }
+}
+
+// the matmuls that consume a layernorm, reading the raw residual stream inp (B,T,C)
+// instead of its normalized copy: mean and rstd (B,T) come from layernorm_forward or
+// residual_layernorm_forward with a NULL out, and the GEMM prologue normalizes the rows
+// of inp as it packs them. These are forward only, since the weight gradient needs the
+// normalized copy, see transformer_block_forward_nograd
+
+void matmul_layernorm_forward(float* out, const float* inp, const float* mean, const float* rstd,
+                              const float* ln_weight, const float* ln_bias,
+                              const float* weight, const float* bias, int B, int T, int C, int OC) {
+    // matmul_forward of layernorm(inp)
+    GemmPrologue prologue = { mean, rstd, ln_weight, ln_bias };
+    matmul_sgemm(0, 1, B * T, OC, C, inp, C, weight, C, bias, out, OC, 0, NULL, NULL, &prologue, NULL);
+}
+
+void matmul_layernorm_forward_qkv(float* out, const float* inp, const float* mean, const float* rstd,
+                                  const float* ln_weight, const float* ln_bias,
+                                  const float* weight, const float* bias, int B, int T, int C, int NH) {
+    // matmul_forward_qkv of layernorm(inp), out is head-major as there
+    int OC = 3 * C;
+    int hs = C / NH;
+    GemmLayout layout = { T, hs, (size_t)OC * T, (size_t)T * hs };
+    GemmPrologue prologue = { mean, rstd, ln_weight, ln_bias };
+    matmul_sgemm(0, 1, B * T, OC, C, inp, C, weight, C, bias, out, OC, 0, &layout, NULL, &prologue, NULL);
+}
+
+void matmul_layernorm_gelu_forward(float* pre, float* out, const float* inp, const float* mean, const float* rstd,
+                                   const float* ln_weight, const float* ln_bias,
+                                   const float* weight, const float* bias, int B, int T, int C, int OC) {
+    // matmul_gelu_forward of layernorm(inp)
+    GemmPrologue prologue = { mean, rstd, ln_weight, ln_bias };
+    GemmEpilogue epilogue = { GEMM_EPILOGUE_GELU, out, OC };
+    matmul_sgemm(0, 1, B * T, OC, C, inp, C, weight, C, bias, pre, OC, 0, NULL, NULL, &prologue, &epilogue);
+}
+
+// one (b,t) row of softmax_forward; probs_bt may be logits_bt
+static inline void softmax_forward_row(float* probs_bt, const float* logits_bt, int V, int Vp) {
+    // maxval is only calculated and subtracted for numerical stability
+    float maxval = -10000.0f; // TODO something better
+    for (int i = 0; i < V; i++) {
+        if (logits_bt[i] > maxval) {
+            maxval = logits_bt[i];
+        }
+    }
+    float sum = 0.0f;
+    for (int i = 0; i < V; i++) {
+        probs_bt[i] = vmath_expf(logits_bt[i] - maxval);
+        sum += probs_bt[i];
+    }
+    // note we only loop to V, leaving the padded dimensions
+    for (int i = 0; i < V; i++) {
+        probs_bt[i] /= sum;
+    }
+    // for extra super safety we may wish to include this too,
+    // forcing the probabilities here to be zero, but it shouldn't matter
+    for (int i = V; i < Vp; i++) {
+        probs_bt[i] = 0.0f;
+    }
+}
+
+CPU_VARIANTS(, softmax_forward_row, , (float* probs_bt, const float* logits_bt, int V, int Vp),
+             (probs_bt, logits_bt, V, Vp))
+
+void softmax_forward(float* probs, float* logits, int B, int T, int V, int Vp) {
     // output: probs are (B,T,Vp) of the probabilities (sums to 1.0 in each b,t position)
     // input: logits is (B,T,Vp) of the unnormalized log probabilities
+    // probs may be logits, to softmax in place
     // Vp is the padded vocab size (for efficiency), V is the "real" vocab size
     // example: Vp is 50304 and V is 50257
-    
-    // #pragma omp parallel for collapse(2)
+    int isa = cpu_kernel_isa(CPU_OP_SOFTMAX);
+    OMP_PRAGMA(omp parallel for collapse(2))
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
             // probs <- softmax(logits)
             float* logits_bt = logits + b * T * Vp + t * Vp;
             float* probs_bt = probs + b * T * Vp + t * Vp;
-
-            // maxval is only calculated and subtracted for numerical stability
-            float maxval = -10000.0f; // TODO something better
-            for (int i = 0; i < V; i++) {
-                if (logits_bt[i] > maxval) {
-                    maxval = logits_bt[i];
-                }
-            }
-            float sum = 0.0f;
-            for (int i = 0; i < V; i++) {
-                probs_bt[i] = expf(logits_bt[i] - maxval);
-                sum += probs_bt[i];
-            }
-            // note we only loop to V, leaving the padded dimensions
-            for (int i = 0; i < V; i++) {
-                probs_bt[i] /= sum;
-            }
-            // for extra super safety we may wish to include this too,
-            // forcing the probabilities here to be zero, but it shouldn't matter
-            for (int i = V; i < Vp; i++) {
-                probs_bt[i] = 0.0f;
-            }
+            CPU_DISPATCH(isa, softmax_forward_row, , probs_bt, logits_bt, V, Vp);
         }
     }
 }
 
+// one (b,t) row of softmax_backward; dlogits_bt may be dprobs_bt
+static inline void softmax_backward_row(float* dlogits_bt, float* dprobs_bt, const float* probs_bt, int V, int Vp) {
+    float dot = 0.0f;
+    for (int i = 0; i < V; i++) {
+        dot += dprobs_bt[i] * probs_bt[i];
+    }
+    for (int i = 0; i < V; i++) {
+        float d = probs_bt[i] * (dprobs_bt[i] - dot);
+        dprobs_bt[i] = 0.0f;
+        dlogits_bt[i] += d;
+    }
+    // the padded probs are constant zeros
+    for (int i = V; i < Vp; i++) {
+        dprobs_bt[i] = 0.0f;
+    }
+}
+
+CPU_VARIANTS(, softmax_backward_row, , (float* dlogits_bt, float* dprobs_bt, const float* probs_bt, int V, int Vp),
+             (dlogits_bt, dprobs_bt, probs_bt, V, Vp))
+
+void softmax_backward(float* dlogits, float* dprobs, float* probs, int B, int T, int V, int Vp) {
+    // backward of softmax_forward: dlogits = probs * (dprobs - <dprobs, probs>), accumulated.
+    // dprobs is zeroed as it is consumed, so dlogits may be dprobs for the in place softmax
+    int isa = cpu_kernel_isa(CPU_OP_SOFTMAX);
+    OMP_PRAGMA(omp parallel for)
+    for (int bt = 0; bt < B * T; bt++) {
+        CPU_DISPATCH(isa, softmax_backward_row, , dlogits + (size_t)bt * Vp, dprobs + (size_t)bt * Vp,
+                     probs + (size_t)bt * Vp, V, Vp);
+    }
+}
+
 void crossentropy_forward(float* __restrict losses,
                           float* __restrict probs, int* targets,
                           int B, int T, int Vp) {
     // output: losses is (B,T) of the individual losses at each position
     // input: probs are (B,T,Vp) of the probabilities
     // input: targets is (B,T) of integers giving the correct index in logits
+    OMP_PRAGMA(omp parallel for collapse(2))
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
             // loss = -log(probs[target])
             float* probs_bt = probs + b * T * Vp + t * Vp;
             int ix = targets[b * T + t];
-            losses[b * T + t] = -logf(probs_bt[ix]);
+            losses[b * T + t] = -vmath_logf(probs_bt[ix]);
         }
     }
 }
 
+void crossentropy_softmax_backward(float* dlogits,
+                           float* dlosses, float* probs, int* targets,
+                           int B, int T, int V, int Vp) {
+    // backwards through both softmax and crossentropy
+    OMP_PRAGMA(omp parallel for collapse(2))
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            float* dlogits_bt = dlogits + b * T * Vp + t * Vp;
+            float* probs_bt = probs + b * T * Vp + t * Vp;
+            float dloss = dlosses[b * T + t];
+            int ix = targets[b * T + t];
+            // note we only loop to V, leaving the padded dimensions
+            // of dlogits untouched, so gradient there stays at zero
+            for (int i = 0; i < V; i++) {
+                float p = probs_bt[i];
+                float indicator = i == ix ? 1.0f : 0.0f;
+                dlogits_bt[i] += (p - indicator) * dloss;
+            }
+        }
+    }
+}
+
+// rows of the batch and columns of the vocabulary in one block of logits of the fused loss head
+#define LM_HEAD_ROWS 512
+#define LM_HEAD_CHUNK 2048
+
+// one row of a block of logits in lm_head_loss_forward: the n logits of vocabulary chunk v0
+// fold into the running max and sum of the row, and give its loss if they hold the target
+static inline void lm_head_loss_row(float* __restrict row_max, float* __restrict row_sum, float* __restrict loss,
+                                    const float* __restrict logits_i, int n, int v0, int target) {
+    float m = logits_i[0];
+    for (int j = 1; j < n; j++) { m = logits_i[j] > m ? logits_i[j] : m; }
+    // fold the chunk into the running sum, rescaled to the new maximum
+    float s = 0.0f;
+    if (v0 > 0) {
+        m = *row_max > m ? *row_max : m;
+        s = *row_sum * vmath_expf(*row_max - m);
+    }
+    for (int j = 0; j < n; j++) { s += vmath_expf(logits_i[j] - m); }
+    *row_max = m;
+    *row_sum = s;
+    // loss = logsumexp - logit[target], the logsumexp is added once it is complete
+    int ix = target - v0;
+    if (0 <= ix && ix < n) { *loss = -logits_i[ix]; }
+}
+
+CPU_VARIANTS(, lm_head_loss_row, ,
+             (float* __restrict row_max, float* __restrict row_sum, float* __restrict loss,
+              const float* __restrict logits_i, int n, int v0, int target),
+             (row_max, row_sum, loss, logits_i, n, v0, target))
+
+// one row of a block of lm_head_loss_backward: the logits become dlogits in place
+static inline void lm_head_dlogits_row(float* __restrict dlogits_i, int n, float lse_i, float dloss, int ix) {
+    for (int j = 0; j < n; j++) {
+        float p = vmath_expf(dlogits_i[j] - lse_i);
+        float indicator = j == ix ? 1.0f : 0.0f;
+        dlogits_i[j] = (p - indicator) * dloss;
+    }
+}
+
+CPU_VARIANTS(, lm_head_dlogits_row, , (float* __restrict dlogits_i, int n, float lse_i, float dloss, int ix),
+             (dlogits_i, n, lse_i, dloss, ix))
+
+__attribute__((noinline))
+void lm_head_loss_forward(float* __restrict losses, float* __restrict lse,
+                          const float* __restrict inp, const float* __restrict wte, int* targets,
+                          int B, int T, int C, int V) {
+    // the LM head, softmax and cross-entropy in one: losses (B,T) = -log softmax(inp @ wte^T)[target]
+    // for inp (B,T,C) and wte (V,C). The logits are computed one LM_HEAD_ROWS x LM_HEAD_CHUNK
+    // block at a time and folded into a running (online) logsumexp per row, so neither the
+    // (B,T,Vp) logits nor the probs are ever stored, and the padded vocabulary is skipped.
+    // lse (B,T) keeps the logsumexp of every row for lm_head_loss_backward
+#ifndef ENZYME_FULL_AD
+    int BT = B * T;
+    int isa = cpu_kernel_isa(CPU_OP_SOFTMAX);
+    float* logits = (float*)mallocCheck((size_t)LM_HEAD_ROWS * LM_HEAD_CHUNK * sizeof(float));
+    float row_max[LM_HEAD_ROWS];
+    float row_sum[LM_HEAD_ROWS];
+    for (int r0 = 0; r0 < BT; r0 += LM_HEAD_ROWS) {
+        int rows = BT - r0 < LM_HEAD_ROWS ? BT - r0 : LM_HEAD_ROWS;
+        for (int v0 = 0; v0 < V; v0 += LM_HEAD_CHUNK) {
+            int n = V - v0 < LM_HEAD_CHUNK ? V - v0 : LM_HEAD_CHUNK;
+            matmul_sgemm(0, 1, rows, n, C, inp + (size_t)r0 * C, C, wte + (size_t)v0 * C, C, NULL, logits, n, 0, NULL, NULL, NULL, NULL);
+            OMP_PRAGMA(omp parallel for)
+            for (int i = 0; i < rows; i++) {
+                CPU_DISPATCH(isa, lm_head_loss_row, , &row_max[i], &row_sum[i], &losses[r0 + i],
+                             logits + (size_t)i * n, n, v0, targets[r0 + i]);
+            }
+        }
+        for (int i = 0; i < rows; i++) {
+            lse[r0 + i] = row_max[i] + vmath_logf(row_sum[i]);
+            losses[r0 + i] += lse[r0 + i];
+        }
+    }
+    free(logits);
+#else
+    for (int bt = 0; bt < B * T; bt++) {
+        const float* x = inp + (size_t)bt * C;
+        float m = 0.0f;
+        float s = 0.0f;
+        float target_logit = 0.0f;
+        for (int v = 0; v < V; v++) {
+            const float* w = wte + (size_t)v * C;
+            float logit = 0.0f;
+            for (int i = 0; i < C; i++) { logit += x[i] * w[i]; }
+            if (v == 0 || logit > m) {
+                s = v == 0 ? 0.0f : s * vmath_expf(m - logit);
+                m = logit;
+            }
+            s += vmath_expf(logit - m);
+            if (v == targets[bt]) { target_logit = logit; }
+        }
+        lse[bt] = m + vmath_logf(s);
+        losses[bt] = lse[bt] - target_logit;
+    }
+#endif
+}
+
+void lm_head_loss_backward(float* dinp, float* dwte, float* dlosses,
+                           const float* inp, const float* wte, const float* lse, int* targets,
+                           int B, int T, int C, int V) {
+    // backward of lm_head_loss_forward: every block of logits is recomputed, turned into
+    // dlogits = (softmax - onehot(target)) * dloss in place using the saved lse, and
+    // multiplied straight into dinp (B,T,C) and dwte (V,C), which are accumulated into
+    int BT = B * T;
+    int isa = cpu_kernel_isa(CPU_OP_SOFTMAX);
+    float* dlogits = (float*)mallocCheck((size_t)LM_HEAD_ROWS * LM_HEAD_CHUNK * sizeof(float));
+    for (int r0 = 0; r0 < BT; r0 += LM_HEAD_ROWS) {
+        int rows = BT - r0 < LM_HEAD_ROWS ? BT - r0 : LM_HEAD_ROWS;
+        for (int v0 = 0; v0 < V; v0 += LM_HEAD_CHUNK) {
+            int n = V - v0 < LM_HEAD_CHUNK ? V - v0 : LM_HEAD_CHUNK;
+            matmul_sgemm(0, 1, rows, n, C, inp + (size_t)r0 * C, C, wte + (size_t)v0 * C, C, NULL, dlogits, n, 0, NULL, NULL, NULL, NULL);
+            OMP_PRAGMA(omp parallel for)
+            for (int i = 0; i < rows; i++) {
+                CPU_DISPATCH(isa, lm_head_dlogits_row, , dlogits + (size_t)i * n, n, lse[r0 + i],
+                             dlosses[r0 + i], targets[r0 + i] - v0);
+            }
+            // dinp (rows,C) += dlogits (rows,n) @ wte (n,C)
+            matmul_sgemm(0, 0, rows, C, n, dlogits, n, wte + (size_t)v0 * C, C, NULL, dinp + (size_t)r0 * C, C, 1, NULL, NULL, NULL, NULL);
+            // dwte (n,C) += dlogits^T (n,rows) @ inp (rows,C)
+            gemm_sgemm(1, 0, n, C, rows, dlogits, n, inp + (size_t)r0 * C, C, NULL, dwte + (size_t)v0 * C, C, 1);
+        }
+    }
+    free(dlogits);
+}
+
+// ----------------------------------------------------------------------------
+// custom derivatives for Enzyme
+// Differentiating gpt2_forward end to end makes Enzyme re-derive (and tape) the
+// matmul, attention, layernorm and loss kernels, which is where ~95% of the step
+// time goes. Instead we register the hand-written backward kernels as the reverse
+// pass of every layer, and Enzyme only auto-differentiates the glue around them
+// (the layer loop, the pointer arithmetic and the loss mean). This also keeps the
+// OpenMP regions out of Enzyme's view, so the reverse pass runs multi-threaded with
+// the race-free kernels above instead of atomic updates. Compile with -DENZYME_FULL_AD to turn
+// this off and have Enzyme differentiate everything, e.g. for gradient checking.
+// Calling convention: every float pointer argument is passed as (primal, shadow),
+// ints and the targets buffer are passed once, and the reverse pass gets the tape
+// returned by the augmented forward as its last argument. The activations the
+// backward kernels need are already saved in ActivationTensors, so the augmented
+// forwards return a NULL tape and the reverse passes read ActivationTensors: Enzyme
+// never caches a copy of them. What Enzyme tapes for the glue is reported at runtime
+// by gpt2_tape_report. Building with -mllvm -enzyme-print-perf lists every value it
+// decided to cache, at compile time.
+// The reverse pass accumulates into the shadows of the inputs and zeroes the shadows
+// of the outputs, since the primal function overwrote them. The exceptions are the
+// layernorm mean/rstd and the attention and loss head logsumexps: nothing outside these
+// functions reads them, so their shadows are always zero and are never touched here,
+// which lets gpt2_build_shadow skip allocating them.
+#ifndef ENZYME_FULL_AD
+
+void* matmul_forward_augment(float* out, float* dout,
+                             const float* inp, float* dinp,
+                             const float* weight, float* dweight,
+                             const float* bias, float* dbias,
+                             int B, int T, int C, int OC) {
+    matmul_forward(out, inp, weight, bias, B, T, C, OC);
+    return NULL;
+}
+
+void matmul_forward_reverse(float* out, float* dout,
+                            const float* inp, float* dinp,
+                            const float* weight, float* dweight,
+                            const float* bias, float* dbias,
+                            int B, int T, int C, int OC, void* tape) {
+    matmul_backward(dinp, dweight, dbias, dout, inp, weight, B, T, C, OC);
+    memset(dout, 0, (size_t)B * T * OC * sizeof(float));
+}
+
+void* matmul_forward_qkv_augment(float* out, float* dout,
+                                 const float* inp, float* dinp,
+                                 const float* weight, float* dweight,
+                                 const float* bias, float* dbias,
+                                 int B, int T, int C, int NH) {
+    matmul_forward_qkv(out, inp, weight, bias, B, T, C, NH);
+    return NULL;
+}
+
+void matmul_forward_qkv_reverse(float* out, float* dout,
+                                const float* inp, float* dinp,
+                                const float* weight, float* dweight,
+                                const float* bias, float* dbias,
+                                int B, int T, int C, int NH, void* tape) {
+    matmul_backward_qkv(dinp, dweight, dbias, dout, inp, weight, B, T, C, NH);
+    memset(dout, 0, (size_t)B * T * 3 * C * sizeof(float));
+}
+
+void* matmul_gelu_forward_augment(float* pre, float* dpre, float* out, float* dout,
+                                  const float* inp, float* dinp,
+                                  const float* weight, float* dweight,
+                                  const float* bias, float* dbias,
+                                  int B, int T, int C, int OC) {
+    matmul_gelu_forward(pre, out, inp, weight, bias, B, T, C, OC);
+    return NULL;
+}
+
+void matmul_gelu_forward_reverse(float* pre, float* dpre, float* out, float* dout,
+                                 const float* inp, float* dinp,
+                                 const float* weight, float* dweight,
+                                 const float* bias, float* dbias,
+                                 int B, int T, int C, int OC, void* tape) {
+    matmul_gelu_backward(dinp, dweight, dbias, dpre, dout, pre, inp, weight, B, T, C, OC);
+    memset(dpre, 0, (size_t)B * T * OC * sizeof(float));
+    memset(dout, 0, (size_t)B * T * OC * sizeof(float));
+}
+
+void* matmul_residual_forward_augment(float* out, float* dout,
+                                      const float* inp, float* dinp,
+                                      const float* weight, float* dweight,
+                                      const float* bias, float* dbias,
+                                      float* residual, float* dresidual,
+                                      int B, int T, int C, int OC) {
+    matmul_residual_forward(out, inp, weight, bias, residual, B, T, C, OC);
+    return NULL;
+}
+
+void matmul_residual_forward_reverse(float* out, float* dout,
+                                     const float* inp, float* dinp,
+                                     const float* weight, float* dweight,
+                                     const float* bias, float* dbias,
+                                     float* residual, float* dresidual,
+                                     int B, int T, int C, int OC, void* tape) {
+    matmul_residual_backward(dinp, dweight, dbias, dresidual, dout, inp, weight, B, T, C, OC);
+    memset(dout, 0, (size_t)B * T * OC * sizeof(float));
+}
+
+void* layernorm_forward_augment(float* out, float* dout, float* mean, float* dmean,
+                                float* rstd, float* drstd, float* inp, float* dinp,
+                                float* weight, float* dweight, float* bias, float* dbias,
+                                int B, int T, int C) {
+    layernorm_forward(out, mean, rstd, inp, weight, bias, B, T, C);
+    return NULL;
+}
+
+void layernorm_forward_reverse(float* out, float* dout, float* mean, float* dmean,
+                               float* rstd, float* drstd, float* inp, float* dinp,
+                               float* weight, float* dweight, float* bias, float* dbias,
+                               int B, int T, int C, void* tape) {
+    layernorm_backward(dinp, dweight, dbias, dout, inp, weight, mean, rstd, B, T, C);
+    memset(dout, 0, (size_t)B * T * C * sizeof(float));
+}
+
+void* residual_layernorm_forward_augment(float* residual, float* dresidual, float* out, float* dout,
+                                         float* mean, float* dmean, float* rstd, float* drstd,
+                                         float* inp1, float* dinp1, float* inp2, float* dinp2,
+                                         float* weight, float* dweight, float* bias, float* dbias,
+                                         int B, int T, int C) {
+    residual_layernorm_forward(residual, out, mean, rstd, inp1, inp2, weight, bias, B, T, C);
+    return NULL;
+}
+
+void residual_layernorm_forward_reverse(float* residual, float* dresidual, float* out, float* dout,
+                                        float* mean, float* dmean, float* rstd, float* drstd,
+                                        float* inp1, float* dinp1, float* inp2, float* dinp2,
+                                        float* weight, float* dweight, float* bias, float* dbias,
+                                        int B, int T, int C, void* tape) {
+    residual_layernorm_backward(dinp1, dinp2, dweight, dbias, dresidual, dout, residual, weight,
+                                mean, rstd, B, T, C);
+    memset(dresidual, 0, (size_t)B * T * C * sizeof(float));
+    memset(dout, 0, (size_t)B * T * C * sizeof(float));
+}
+
+void* attention_forward_augment(float* out, float* dout, float* lse, float* dlse,
+                                float* inp, float* dinp,
+                                int B, int T, int C, int NH) {
+    attention_forward(out, lse, inp, B, T, C, NH);
+    return NULL;
+}
+
+void attention_forward_reverse(float* out, float* dout, float* lse, float* dlse,
+                               float* inp, float* dinp,
+                               int B, int T, int C, int NH, void* tape) {
+    attention_backward(dinp, dout, inp, out, lse, B, T, C, NH);
+    memset(dout, 0, (size_t)B * T * C * sizeof(float));
+}
+
+void* lm_head_loss_forward_augment(float* losses, float* dlosses, float* lse, float* dlse,
+                                   const float* inp, float* dinp, const float* wte, float* dwte,
+                                   int* targets, int B, int T, int C, int V) {
+    lm_head_loss_forward(losses, lse, inp, wte, targets, B, T, C, V);
+    return NULL;
+}
+
+void lm_head_loss_forward_reverse(float* losses, float* dlosses, float* lse, float* dlse,
+                                  const float* inp, float* dinp, const float* wte, float* dwte,
+                                  int* targets, int B, int T, int C, int V, void* tape) {
+    lm_head_loss_backward(dinp, dwte, dlosses, inp, wte, lse, targets, B, T, C, V);
+    memset(dlosses, 0, (size_t)B * T * sizeof(float));
+}
+
+void* encoder_forward_augment(float* out, float* dout, int* inp,
+                              float* wte, float* dwte, float* wpe, float* dwpe,
+                              int B, int T, int C) {
+    encoder_forward(out, inp, wte, wpe, B, T, C);
+    return NULL;
+}
+
+void encoder_forward_reverse(float* out, float* dout, int* inp,
+                             float* wte, float* dwte, float* wpe, float* dwpe,
+                             int B, int T, int C, void* tape) {
+    encoder_backward(dwte, dwpe, dout, inp, B, T, C);
+    memset(dout, 0, (size_t)B * T * C * sizeof(float));
+}
+
+void* gelu_forward_augment(float* out, float* dout, float* inp, float* dinp, int N) {
+    gelu_forward(out, inp, N);
+    return NULL;
+}
+
+void gelu_forward_reverse(float* out, float* dout, float* inp, float* dinp, int N, void* tape) {
+    gelu_backward(dinp, inp, dout, N);
+    memset(dout, 0, (size_t)N * sizeof(float));
+}
+
+void* residual_forward_augment(float* out, float* dout, float* inp1, float* dinp1,
+                               float* inp2, float* dinp2, int N) {
+    residual_forward(out, inp1, inp2, N);
+    return NULL;
+}
+
+void residual_forward_reverse(float* out, float* dout, float* inp1, float* dinp1,
+                              float* inp2, float* dinp2, int N, void* tape) {
+    residual_backward(dinp1, dinp2, dout, N);
+    memset(dout, 0, (size_t)N * sizeof(float));
+}
+
+// only the head without targets calls softmax_forward, but Enzyme would still have to
+// differentiate its OpenMP region and the bit manipulation in vmath_expf without this
+void* softmax_forward_augment(float* probs, float* dprobs, float* logits, float* dlogits,
+                              int B, int T, int V, int Vp) {
+    softmax_forward(probs, logits, B, T, V, Vp);
+    return NULL;
+}
+
+void softmax_forward_reverse(float* probs, float* dprobs, float* logits, float* dlogits,
+                             int B, int T, int V, int Vp, void* tape) {
+    // softmax_backward zeroes dprobs itself, it may be dlogits
+    softmax_backward(dlogits, dprobs, probs, B, T, V, Vp);
+}
+
+void* __enzyme_register_gradient_encoder_forward[3] = {
+    (void*)encoder_forward, (void*)encoder_forward_augment, (void*)encoder_forward_reverse };
+void* __enzyme_register_gradient_gelu_forward[3] = {
+    (void*)gelu_forward, (void*)gelu_forward_augment, (void*)gelu_forward_reverse };
+void* __enzyme_register_gradient_residual_forward[3] = {
+    (void*)residual_forward, (void*)residual_forward_augment, (void*)residual_forward_reverse };
+void* __enzyme_register_gradient_matmul_forward[3] = {
+    (void*)matmul_forward, (void*)matmul_forward_augment, (void*)matmul_forward_reverse };
+void* __enzyme_register_gradient_matmul_forward_qkv[3] = {
+    (void*)matmul_forward_qkv, (void*)matmul_forward_qkv_augment, (void*)matmul_forward_qkv_reverse };
+void* __enzyme_register_gradient_matmul_gelu_forward[3] = {
+    (void*)matmul_gelu_forward, (void*)matmul_gelu_forward_augment, (void*)matmul_gelu_forward_reverse };
+void* __enzyme_register_gradient_matmul_residual_forward[3] = {
+    (void*)matmul_residual_forward, (void*)matmul_residual_forward_augment,
+    (void*)matmul_residual_forward_reverse };
+void* __enzyme_register_gradient_layernorm_forward[3] = {
+    (void*)layernorm_forward, (void*)layernorm_forward_augment, (void*)layernorm_forward_reverse };
+void* __enzyme_register_gradient_residual_layernorm_forward[3] = {
+    (void*)residual_layernorm_forward, (void*)residual_layernorm_forward_augment,
+    (void*)residual_layernorm_forward_reverse };
+void* __enzyme_register_gradient_attention_forward[3] = {
+    (void*)attention_forward, (void*)attention_forward_augment, (void*)attention_forward_reverse };
+void* __enzyme_register_gradient_lm_head_loss_forward[3] = {
+    (void*)lm_head_loss_forward, (void*)lm_head_loss_forward_augment, (void*)lm_head_loss_forward_reverse };
+void* __enzyme_register_gradient_softmax_forward[3] = {
+    (void*)softmax_forward, (void*)softmax_forward_augment, (void*)softmax_forward_reverse };
+
+#endif // ENZYME_FULL_AD
+
 // ----------------------------------------------------------------------------
 // GPT-2 model definition
 
@@ -404,16 +1891,15 @@ float* malloc_and_point_parameters(ParameterTensors* params, size_t* param_sizes
     return params_memory;
 }
 
-#define NUM_ACTIVATION_TENSORS 23
+#define NUM_ACTIVATION_TENSORS 21
 typedef struct {
     float* encoded; // (B, T, C)
     float* ln1; // (L, B, T, C)
     float* ln1_mean; // (L, B, T)
     float* ln1_rstd; // (L, B, T)
-    float* qkv; // (L, B, T, 3*C)
+    float* qkv; // (L, B, 3, NH, T, C/NH), head-major, see matmul_forward_qkv
     float* atty; // (L, B, T, C)
-    float* preatt; // (L, B, NH, T, T)
-    float* att; // (L, B, NH, T, T)
+    float* att_lse; // (L, B, NH, T)
     float* attproj; // (L, B, T, C)
     float* residual2; // (L, B, T, C)
     float* ln2; // (L, B, T, C)
@@ -421,13 +1907,12 @@ typedef struct {
     float* ln2_rstd; // (L, B, T)
     float* fch; // (L, B, T, 4*C)
     float* fch_gelu; // (L, B, T, 4*C)
-    float* fcproj; // (L, B, T, C)
     float* residual3; // (L, B, T, C)
     float* lnf; // (B, T, C)
     float* lnf_mean; // (B, T)
     float* lnf_rstd; // (B, T)
-    float* logits; // (B, T, V)
-    float* probs; // (B, T, V)
+    float* logits_lse; // (B, T), logsumexp of the logits, see lm_head_loss_forward
+    float* probs; // (B, T, Vp), only written by a forward without targets
     float* losses; // (B, T)
 } ActivationTensors;
 
@@ -442,23 +1927,21 @@ void fill_in_activation_sizes(size_t* act_sizes, GPT2Config config, int B, int T
     act_sizes[3] = L * B * T; // ln1_rstd
     act_sizes[4] = L * B * T * 3 * C; // qkv
     act_sizes[5] = L * B * T * C; // atty
-    act_sizes[6] = L * B * NH * T * T; // preatt
-    act_sizes[7] = L * B * NH * T * T; // att
-    act_sizes[8] = L * B * T * C; // attproj
-    act_sizes[9] = L * B * T * C; // residual2
-    act_sizes[10] = L * B * T * C; // ln2
-    act_sizes[11] = L * B * T; // ln2_mean
-    act_sizes[12] = L * B * T; // ln2_rstd
-    act_sizes[13] = L * B * T * 4 * C; // fch
-    act_sizes[14] = L * B * T * 4 * C; // fch_gelu
-    act_sizes[15] = L * B * T * C; // fcproj
-    act_sizes[16] = L * B * T * C; // residual3
-    act_sizes[17] = B * T * C; // lnf
-    act_sizes[18] = B * T; // lnf_mean
-    act_sizes[19] = B * T; // lnf_rstd
-    act_sizes[20] = B * T * Vp; // logits
-    act_sizes[21] = B * T * Vp; // probs
-    act_sizes[22] = B * T; // losses
+    act_sizes[6] = L * B * NH * T; // att_lse
+    act_sizes[7] = L * B * T * C; // attproj
+    act_sizes[8] = L * B * T * C; // residual2
+    act_sizes[9] = L * B * T * C; // ln2
+    act_sizes[10] = L * B * T; // ln2_mean
+    act_sizes[11] = L * B * T; // ln2_rstd
+    act_sizes[12] = L * B * T * 4 * C; // fch
+    act_sizes[13] = L * B * T * 4 * C; // fch_gelu
+    act_sizes[14] = L * B * T * C; // residual3
+    act_sizes[15] = B * T * C; // lnf
+    act_sizes[16] = B * T; // lnf_mean
+    act_sizes[17] = B * T; // lnf_rstd
+    act_sizes[18] = B * T; // logits_lse
+    act_sizes[19] = B * T * Vp; // probs
+    act_sizes[20] = B * T; // losses
 }
 
 float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes) {
@@ -469,9 +1952,9 @@ float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes)
     float* acts_memory = (float*)mallocCheck(num_activations * sizeof(float));
     float** ptrs[] = {
         &acts->encoded, &acts->ln1, &acts->ln1_mean, &acts->ln1_rstd, &acts->qkv, &acts->atty,
-        &acts->preatt, &acts->att, &acts->attproj, &acts->residual2, &acts->ln2, &acts->ln2_mean,
-        &acts->ln2_rstd, &acts->fch, &acts->fch_gelu, &acts->fcproj, &acts->residual3, &acts->lnf,
-        &acts->lnf_mean, &acts->lnf_rstd, &acts->logits, &acts->probs, &acts->losses
+        &acts->att_lse, &acts->attproj, &acts->residual2, &acts->ln2, &acts->ln2_mean,
+        &acts->ln2_rstd, &acts->fch, &acts->fch_gelu, &acts->residual3, &acts->lnf,
+        &acts->lnf_mean, &acts->lnf_rstd, &acts->logits_lse, &acts->probs, &acts->losses
     };
     float* acts_memory_iterator = acts_memory;
     for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
@@ -499,6 +1982,8 @@ typedef struct {
     // buffers for the AdamW optimizer
     float* m_memory;
     float* v_memory;
+    // under ENABLE_BF16, the bf16 copy of the weights the matmuls read (else NULL)
+    bf16* params_bf16;
     // the activations of the model, and their sizes
     size_t num_activations;
     // gradients of the activations
@@ -593,6 +2078,8 @@ void gpt2_build_from_checkpoint(GPT2 *model, GPT2Const *const_model, const char*
     printf("num_layers: %zu\n", L);
     printf("num_heads: %zu\n", NH);
     printf("channels: %zu\n", C);
+    printf("kernels: %s\n", kernels_specialized(C, NH) ? "specialized for C and head size" : "generic");
+    cpu_dispatch_print();
 
     // allocate space for all the parameters and read them in
     fill_in_parameter_sizes(model->param_sizes,  const_model->config);
@@ -609,6 +2096,18 @@ void gpt2_build_from_checkpoint(GPT2 *model, GPT2Const *const_model, const char*
     model->params_memory = malloc_and_point_parameters(&model->params, model->param_sizes);
     freadCheck(model->params_memory, sizeof(float), num_parameters, model_file);
     fcloseCheck(model_file);
+#ifdef ENABLE_BF16
+    // bf16 weights: the weights just read stay the fp32 master weights that AdamW updates,
+    // and the matmuls read a bf16 copy, rounded to nearest here and stochastically by every
+    // update after (see gpt2_update)
+    const_model->params_bf16 = (bf16*)mallocCheck(num_parameters * sizeof(bf16));
+    bf16_round_array(const_model->params_bf16, model->params_memory, num_parameters);
+    bf16_register_weights(model->params_memory, const_model->params_bf16, num_parameters);
+    printf("precision: bf16 weights for the matmuls, fp32 master weights and optimizer state\n");
+#else
+    const_model->params_bf16 = NULL;
+    printf("precision: fp32\n");
+#endif
        // other inits
     model->acts_memory = NULL;
     const_model->grads_memory = NULL;
@@ -658,6 +2157,141 @@ void gpt2_init(GPT2 *model, GPT2Const *model_const, size_t B, size_t T) {
     }
 }
 
+// activations whose shadows are never read or written during the Enzyme reverse pass
+// once the custom derivatives are registered: ln1_mean, ln1_rstd, att_lse,
+// ln2_mean, ln2_rstd, lnf_mean, lnf_rstd, logits_lse, and probs, which only a forward
+// without targets writes
+#define NUM_UNUSED_SHADOW_ACTS 9
+#ifdef ENZYME_FULL_AD
+#define SHADOW_SKIP_UNUSED_ACTS 0
+#else
+#define SHADOW_SKIP_UNUSED_ACTS 1
+#endif
+const int unused_shadow_acts[NUM_UNUSED_SHADOW_ACTS] = {2, 3, 6, 10, 11, 16, 17, 18, 19};
+
+void gpt2_build_shadow_params(GPT2 *shadow_model, GPT2Const *model_const) {
+    // the parameter half of the shadow model: the weight gradients, all zeros
+    fill_in_parameter_sizes(shadow_model->param_sizes, model_const->config);
+    shadow_model->params_memory = malloc_and_point_parameters(&shadow_model->params, shadow_model->param_sizes);
+    memset(shadow_model->params_memory, 0, model_const->num_parameters * sizeof(float));
+    shadow_model->acts_memory = NULL;
+}
+
+void gpt2_build_shadow(GPT2 *shadow_model, GPT2Const *model_const, int skip_unused_acts) {
+    // the shadow model holds the gradients Enzyme accumulates into: same layout as
+    // the model, sized from the config and the B,T of gpt2_init, and all zeros.
+    // no checkpoint is read, the shadow never holds weights.
+    if (model_const->batch_size == 0) {
+        printf("Error: call gpt2_init on the model before gpt2_build_shadow.\n");
+        exit(1);
+    }
+#ifdef ENZYME_FULL_AD
+    if (skip_unused_acts) {
+        printf("Error: full Enzyme autodiff needs every shadow activation.\n");
+        exit(1);
+    }
+#endif
+    gpt2_build_shadow_params(shadow_model, model_const);
+
+    fill_in_activation_sizes(shadow_model->act_sizes, model_const->config,
+                             model_const->batch_size, model_const->seq_len);
+    if (skip_unused_acts) {
+        for (int i = 0; i < NUM_UNUSED_SHADOW_ACTS; i++) {
+            shadow_model->act_sizes[unused_shadow_acts[i]] = 0;
+        }
+    }
+    size_t num_activations = 0;
+    for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
+        num_activations += shadow_model->act_sizes[i];
+    }
+    printf("shadow num_activations: %zu (of %zu)\n", num_activations, model_const->num_activations);
+    shadow_model->acts_memory = malloc_and_point_activations(&shadow_model->acts, shadow_model->act_sizes);
+    memset(shadow_model->acts_memory, 0, num_activations * sizeof(float));
+    if (skip_unused_acts) {
+        // Enzyme still offsets into these, but nothing dereferences them
+        float** ptrs[] = {
+            &shadow_model->acts.ln1_mean, &shadow_model->acts.ln1_rstd, &shadow_model->acts.att_lse,
+            &shadow_model->acts.ln2_mean, &shadow_model->acts.ln2_rstd,
+            &shadow_model->acts.lnf_mean, &shadow_model->acts.lnf_rstd, &shadow_model->acts.logits_lse,
+            &shadow_model->acts.probs
+        };
+        for (int i = 0; i < NUM_UNUSED_SHADOW_ACTS; i++) {
+            *(ptrs[i]) = NULL;
+        }
+    }
+}
+
+void transformer_block_forward(ParameterTensors * __restrict params, ActivationTensors * __restrict acts,
+                               float * __restrict residual, int l, int la,
+                               size_t B, size_t T, size_t C, size_t NH) {
+    // one transformer block: reads residual (B,T,C), writes the block output to
+    // acts->residual3 at layer slot la. the weights are those of layer l, which only
+    // differs from la when acts holds a single block's worth of activations
+    float *l_ln1w = params->ln1w + l * C;
+    float *l_ln1b = params->ln1b + l * C;
+    float *l_qkvw = params->qkvw + l * 3 * C * C;
+    float *l_qkvb = params->qkvb + l * 3 * C;
+    float *l_attprojw = params->attprojw + l * C * C;
+    float *l_attprojb = params->attprojb + l * C;
+    float *l_ln2w = params->ln2w + l * C;
+    float *l_ln2b = params->ln2b + l * C;
+    float *l_fcw = params->fcw + l * 4 * C * C;
+    float *l_fcb = params->fcb + l * 4 * C;
+    float *l_fcprojw = params->fcprojw + l * C * 4 * C;
+    float *l_fcprojb = params->fcprojb + l * C;
+
+    float *l_ln1 = acts->ln1 + la * B * T * C;
+    float *l_ln1_mean = acts->ln1_mean + la * B * T;
+    float *l_ln1_rstd = acts->ln1_rstd + la * B * T;
+    float *l_qkv = acts->qkv + la * B * T * 3 * C;
+    float *l_atty = acts->atty + la * B * T * C;
+    float *l_att_lse = acts->att_lse + la * B * NH * T;
+    float *l_attproj = acts->attproj + la * B * T * C;
+    float *l_residual2 = acts->residual2 + la * B * T * C;
+    float *l_ln2 = acts->ln2 + la * B * T * C;
+    float *l_ln2_mean = acts->ln2_mean + la * B * T;
+    float *l_ln2_rstd = acts->ln2_rstd + la * B * T;
+    float *l_fch = acts->fch + la * B * T * 4 * C;
+    float *l_fch_gelu = acts->fch_gelu + la * B * T * 4 * C;
+    float *l_residual3 = acts->residual3 + la * B * T * C;
+
+    layernorm_forward(l_ln1, l_ln1_mean, l_ln1_rstd, residual, l_ln1w, l_ln1b, B, T, C);
+    matmul_forward_qkv(l_qkv, l_ln1, l_qkvw, l_qkvb, B, T, C, NH);
+    attention_forward(l_atty, l_att_lse, l_qkv, B, T, C, NH);
+    matmul_forward(l_attproj, l_atty, l_attprojw, l_attprojb, B, T, C, C);
+    residual_layernorm_forward(l_residual2, l_ln2, l_ln2_mean, l_ln2_rstd, residual, l_attproj,
+                               l_ln2w, l_ln2b, B, T, C);
+    matmul_gelu_forward(l_fch, l_fch_gelu, l_ln2, l_fcw, l_fcb, B, T, C, 4 * C);
+    matmul_residual_forward(l_residual3, l_fch_gelu, l_fcprojw, l_fcprojb, l_residual2, B, T, 4 * C, C);
+}
+
+void gpt2_loss_forward(ParameterTensors * __restrict params, ActivationTensors * __restrict acts,
+                       int * __restrict targets, size_t B, size_t T, size_t C, size_t V, float * __restrict res) {
+    // the fused lm head and loss from acts->lnf, and the mean loss into res
+    lm_head_loss_forward(acts->losses, acts->logits_lse, acts->lnf, params->wte, targets, B, T, C, V);
+    float mean_loss = 0.0f;
+    for (size_t i = 0; i < B * T; i++) {
+        mean_loss += acts->losses[i];
+    }
+    mean_loss /= (B * T);
+    *res = mean_loss;
+}
+
+void gpt2_head_forward(ParameterTensors * __restrict params, ActivationTensors * __restrict acts,
+                       float * __restrict residual, int * __restrict targets,
+                       size_t B, size_t T, size_t C, size_t V, size_t Vp, float * __restrict res) {
+    // final layernorm, lm head and loss. writes the mean loss to res, or -1 without targets,
+    // in which case the probs are computed instead, in place of their logits
+    layernorm_forward(acts->lnf, acts->lnf_mean, acts->lnf_rstd, residual, params->lnfw, params->lnfb, B, T, C);
+    if (targets != NULL) {
+        gpt2_loss_forward(params, acts, targets, B, T, C, V, res);
+    } else {
+        matmul_forward(acts->probs, acts->lnf, params->wte, NULL, B, T, C, Vp);
+        softmax_forward(acts->probs, acts->probs, B, T, V, Vp);
+        *res = -1.0f;
+    }
+}
+
 void gpt2_forward(GPT2 * __restrict model, GPT2Const * __restrict model_consts, int * __restrict inputs, int * __restrict targets, size_t B, size_t T, float * __restrict res) {
     // Validate inputs
     size_t V = model_consts->config.vocab_size;
@@ -669,92 +2303,376 @@ void gpt2_forward(GPT2 * __restrict model, GPT2Const * __restrict model_consts,
         }
     }
 
-    // Initialize model (if not done already)
-    // gpt2_init(model, B, T);
-
-    // Cache inputs and targets
-    // memcpy(model_consts->inputs, inputs, B * T * sizeof(int));
-    // if (targets != NULL) {
-    //     memcpy(model_consts->targets, targets, B * T * sizeof(int));
-    // }
-
     // Forward pass
-    ParameterTensors params = model->params;
-    ActivationTensors acts = model->acts;
+    size_t C = model_consts->config.channels;
+    size_t NH = model_consts->config.num_heads;
+    int L = model_consts->config.num_layers;
     float *residual;
 
-    encoder_forward(acts.encoded, inputs, params.wte, params.wpe, B, T, model_consts->config.channels);
-
-    for (int l = 0; l < model_consts->config.num_layers; l++) {
-        size_t C = model_consts->config.channels;
-        size_t NH = model_consts->config.num_heads;
-
-        residual = (l == 0) ? acts.encoded : acts.residual3 + (l - 1) * B * T * C;
-
-        // Get layer-specific weight and activation pointers
-        float *l_ln1w = params.ln1w + l * C;
-        float *l_ln1b = params.ln1b + l * C;
-        float *l_qkvw = params.qkvw + l * 3 * C * C;
-        float *l_qkvb = params.qkvb + l * 3 * C;
-        float *l_attprojw = params.attprojw + l * C * C;
-        float *l_attprojb = params.attprojb + l * C;
-        float *l_ln2w = params.ln2w + l * C;
-        float *l_ln2b = params.ln2b + l * C;
-        float *l_fcw = params.fcw + l * 4 * C * C;
-        float *l_fcb = params.fcb + l * 4 * C;
-        float *l_fcprojw = params.fcprojw + l * C * 4 * C;
-        float *l_fcprojb = params.fcprojb + l * C;
-
-        float *l_ln1 = acts.ln1 + l * B * T * C;
-        float *l_ln1_mean = acts.ln1_mean + l * B * T;
-        float *l_ln1_rstd = acts.ln1_rstd + l * B * T;
-        float *l_qkv = acts.qkv + l * B * T * 3 * C;
-        float *l_atty = acts.atty + l * B * T * C;
-        float *l_preatt = acts.preatt + l * B * NH * T * T;
-        float *l_att = acts.att + l * B * NH * T * T;
-        float *l_attproj = acts.attproj + l * B * T * C;
-        float *l_residual2 = acts.residual2 + l * B * T * C;
-        float *l_ln2 = acts.ln2 + l * B * T * C;
-        float *l_ln2_mean = acts.ln2_mean + l * B * T;
-        float *l_ln2_rstd = acts.ln2_rstd + l * B * T;
-        float *l_fch = acts.fch + l * B * T * 4 * C;
-        float *l_fch_gelu = acts.fch_gelu + l * B * T * 4 * C;
-        float *l_fcproj = acts.fcproj + l * B * T * C;
-        float *l_residual3 = acts.residual3 + l * B * T * C;
-
-        // Perform forward computations
-        layernorm_forward(l_ln1, l_ln1_mean, l_ln1_rstd, residual, l_ln1w, l_ln1b, B, T, C);
-        matmul_forward(l_qkv, l_ln1, l_qkvw, l_qkvb, B, T, C, 3 * C);
-        attention_forward(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH);
-        matmul_forward(l_attproj, l_atty, l_attprojw, l_attprojb, B, T, C, C);
-        residual_forward(l_residual2, residual, l_attproj, B * T * C);
-        layernorm_forward(l_ln2, l_ln2_mean, l_ln2_rstd, l_residual2, l_ln2w, l_ln2b, B, T, C);
-        matmul_forward(l_fch, l_ln2, l_fcw, l_fcb, B, T, C, 4 * C);
-        gelu_forward(l_fch_gelu, l_fch, B * T * 4 * C);
-        matmul_forward(l_fcproj, l_fch_gelu, l_fcprojw, l_fcprojb, B, T, 4 * C, C);
-        residual_forward(l_residual3, l_residual2, l_fcproj, B * T * C);
-    }
-
-    residual = acts.residual3 + (model_consts->config.num_layers - 1) * B * T * model_consts->config.channels;
-
-    layernorm_forward(acts.lnf, acts.lnf_mean, acts.lnf_rstd, residual, params.lnfw, params.lnfb, B, T, model_consts->config.channels);
-    matmul_forward(acts.logits, acts.lnf, params.wte, NULL, B, T, model_consts->config.channels, Vp);
-    softmax_forward(acts.probs, acts.logits, B, T, V, Vp);
-
-    // Compute loss if targets are available
+    encoder_forward(model->acts.encoded, inputs, model->params.wte, model->params.wpe, B, T, C);
+
+    for (int l = 0; l < L; l++) {
+        residual = (l == 0) ? model->acts.encoded : model->acts.residual3 + (l - 1) * B * T * C;
+        transformer_block_forward(&model->params, &model->acts, residual, l, l, B, T, C, NH);
+    }
+
+    residual = model->acts.residual3 + (L - 1) * B * T * C;
+    // the head writes the loss straight from its local: model_consts is enzyme_const,
+    // so a round trip through it would cut the derivative off
+    gpt2_head_forward(&model->params, &model->acts, residual, targets, B, T, C, V, Vp, res);
+    model_consts->mean_loss = *res;
+}
+
+// ----------------------------------------------------------------------------
+// forward passes that no gradient is taken of: validation, sampling, and the
+// forward sweep of blockwise training, whose reverse sweep recomputes every block.
+// Nothing reads their ln1, ln2 and lnf later, so these do not write them: the layernorms
+// only compute mean and rstd, and the matmuls after them normalize in the GEMM prologue.
+// The fused loss head is the exception, it needs lnf.
+// The results match transformer_block_forward and gpt2_head_forward
+
+void transformer_block_forward_nograd(ParameterTensors *params, ActivationTensors *acts,
+                                      float *residual, int l, int la,
+                                      size_t B, size_t T, size_t C, size_t NH) {
+    float *l_ln1w = params->ln1w + l * C;
+    float *l_ln1b = params->ln1b + l * C;
+    float *l_qkvw = params->qkvw + l * 3 * C * C;
+    float *l_qkvb = params->qkvb + l * 3 * C;
+    float *l_attprojw = params->attprojw + l * C * C;
+    float *l_attprojb = params->attprojb + l * C;
+    float *l_ln2w = params->ln2w + l * C;
+    float *l_ln2b = params->ln2b + l * C;
+    float *l_fcw = params->fcw + l * 4 * C * C;
+    float *l_fcb = params->fcb + l * 4 * C;
+    float *l_fcprojw = params->fcprojw + l * C * 4 * C;
+    float *l_fcprojb = params->fcprojb + l * C;
+
+    float *l_ln1_mean = acts->ln1_mean + la * B * T;
+    float *l_ln1_rstd = acts->ln1_rstd + la * B * T;
+    float *l_qkv = acts->qkv + la * B * T * 3 * C;
+    float *l_atty = acts->atty + la * B * T * C;
+    float *l_att_lse = acts->att_lse + la * B * NH * T;
+    float *l_attproj = acts->attproj + la * B * T * C;
+    float *l_residual2 = acts->residual2 + la * B * T * C;
+    float *l_ln2_mean = acts->ln2_mean + la * B * T;
+    float *l_ln2_rstd = acts->ln2_rstd + la * B * T;
+    float *l_fch = acts->fch + la * B * T * 4 * C;
+    float *l_fch_gelu = acts->fch_gelu + la * B * T * 4 * C;
+    float *l_residual3 = acts->residual3 + la * B * T * C;
+
+    layernorm_forward(NULL, l_ln1_mean, l_ln1_rstd, residual, l_ln1w, l_ln1b, B, T, C);
+    matmul_layernorm_forward_qkv(l_qkv, residual, l_ln1_mean, l_ln1_rstd, l_ln1w, l_ln1b,
+                                 l_qkvw, l_qkvb, B, T, C, NH);
+    attention_forward(l_atty, l_att_lse, l_qkv, B, T, C, NH);
+    matmul_forward(l_attproj, l_atty, l_attprojw, l_attprojb, B, T, C, C);
+    residual_layernorm_forward(l_residual2, NULL, l_ln2_mean, l_ln2_rstd, residual, l_attproj,
+                               l_ln2w, l_ln2b, B, T, C);
+    matmul_layernorm_gelu_forward(l_fch, l_fch_gelu, l_residual2, l_ln2_mean, l_ln2_rstd, l_ln2w, l_ln2b,
+                                  l_fcw, l_fcb, B, T, C, 4 * C);
+    matmul_residual_forward(l_residual3, l_fch_gelu, l_fcprojw, l_fcprojb, l_residual2, B, T, 4 * C, C);
+}
+
+void gpt2_head_forward_nograd(ParameterTensors *params, ActivationTensors *acts,
+                              float *residual, int *targets,
+                              size_t B, size_t T, size_t C, size_t V, size_t Vp, float *res) {
     if (targets != NULL) {
-        crossentropy_forward(model->acts.losses, model->acts.probs, targets, B, T, Vp);
-        float mean_loss = 0.0f;
-        for (int i = 0; i < B * T; i++) {
-            mean_loss += model->acts.losses[i];
-        }
-        model_consts->mean_loss = mean_loss / (B * T);
+        // the fused loss head reads lnf as rows of its GEMMs, so it is written here
+        layernorm_forward(acts->lnf, acts->lnf_mean, acts->lnf_rstd, residual, params->lnfw, params->lnfb, B, T, C);
+        gpt2_loss_forward(params, acts, targets, B, T, C, V, res);
     } else {
-        model_consts->mean_loss = -1.0f;
+        layernorm_forward(NULL, acts->lnf_mean, acts->lnf_rstd, residual, params->lnfw, params->lnfb, B, T, C);
+        matmul_layernorm_forward(acts->probs, residual, acts->lnf_mean, acts->lnf_rstd, params->lnfw, params->lnfb,
+                                 params->wte, NULL, B, T, C, Vp);
+        softmax_forward(acts->probs, acts->probs, B, T, V, Vp);
+        *res = -1.0f;
     }
-    *res = model_consts->mean_loss;
 }
 
+void gpt2_forward_nograd(GPT2 *model, GPT2Const *model_consts, int *inputs, int *targets,
+                         size_t B, size_t T, float *res) {
+    // gpt2_forward, for when it is not differentiated
+    size_t V = model_consts->config.vocab_size;
+    size_t Vp = model_consts->config.padded_vocab_size;
+    for (size_t i = 0; i < B * T; i++) {
+        assert(0 <= inputs[i] && (size_t)inputs[i] < V);
+        if (targets != NULL) {
+            assert(0 <= targets[i] && (size_t)targets[i] < V);
+        }
+    }
+    size_t C = model_consts->config.channels;
+    size_t NH = model_consts->config.num_heads;
+    int L = model_consts->config.num_layers;
+    float *residual;
+
+    encoder_forward(model->acts.encoded, inputs, model->params.wte, model->params.wpe, B, T, C);
+    for (int l = 0; l < L; l++) {
+        residual = (l == 0) ? model->acts.encoded : model->acts.residual3 + (l - 1) * B * T * C;
+        transformer_block_forward_nograd(&model->params, &model->acts, residual, l, l, B, T, C, NH);
+    }
+    residual = model->acts.residual3 + (L - 1) * B * T * C;
+    gpt2_head_forward_nograd(&model->params, &model->acts, residual, targets, B, T, C, V, Vp, res);
+    model_consts->mean_loss = *res;
+}
+
+// ----------------------------------------------------------------------------
+// blockwise training
+// Differentiating gpt2_forward as a whole keeps all L layers of activations (and
+// whatever Enzyme tapes) alive until the reverse pass. The blockwise step instead
+// keeps only the residual stream at each block boundary. The reverse sweep then
+// differentiates one block at a time, and the Enzyme call recomputes that block's
+// forward from its saved input into a single block's worth of activations. Peak
+// memory becomes one block plus L*(B,T,C), for the price of a second block forward.
+// Under ENABLE_BF16 those L*(B,T,C) checkpoints are stored in bf16, rounded to nearest.
+// Each block then runs from its checkpoint widened back to fp32, in the forward and in
+// the recompute alike, so the reverse sweep differentiates exactly the forward that
+// produced the loss (the rounding itself passes the gradient through).
+
+typedef struct {
+    // activations and their shadows, sized as if num_layers were 1, so every layer
+    // reuses slot 0. encoded, lnf, logits_lse, probs and losses are there as usual
+    size_t act_sizes[NUM_ACTIVATION_TENSORS];
+    ActivationTensors acts;
+    float* acts_memory;
+    ActivationTensors grads_acts;
+    float* grads_acts_memory;
+#ifdef ENABLE_BF16
+    bf16* residuals; // (L, B, T, C) the output of every block, rounded to bf16
+    float* residual_in; // (B, T, C) the input of the current block, widened from residuals
+    float* residual_out; // (B, T, C) the output of the current block, before rounding
+#else
+    float* residuals; // (L, B, T, C) the output of every block
+#endif
+    float* dresidual; // (2, B, T, C) gradient of the block output and input
+} GPT2Blockwise;
+
+// the input of block l as fp32: the encoding for l = 0, else the output of block l - 1
+float* gpt2_blockwise_input(GPT2Blockwise *bw, int l, size_t BTC) {
+    if (l == 0) { return bw->acts.encoded; }
+#ifdef ENABLE_BF16
+    bf16_to_float_array(bw->residual_in, bw->residuals + (l - 1) * BTC, BTC);
+    return bw->residual_in;
+#else
+    return bw->residuals + (l - 1) * BTC;
+#endif
+}
+
+// where block l writes its output, and gpt2_blockwise_save then checkpoints it
+float* gpt2_blockwise_output(GPT2Blockwise *bw, int l, size_t BTC) {
+#ifdef ENABLE_BF16
+    return bw->residual_out;
+#else
+    return bw->residuals + l * BTC;
+#endif
+}
+
+void gpt2_blockwise_save(GPT2Blockwise *bw, int l, size_t BTC) {
+#ifdef ENABLE_BF16
+    bf16_round_array(bw->residuals + l * BTC, bw->residual_out, BTC);
+#endif
+}
+
+void gpt2_blockwise_init(GPT2Blockwise *bw, GPT2Const *model_const, size_t B, size_t T, int skip_unused_acts) {
+#ifdef ENZYME_FULL_AD
+    if (skip_unused_acts) {
+        printf("Error: full Enzyme autodiff needs every shadow activation.\n");
+        exit(1);
+    }
+#endif
+    size_t C = model_const->config.channels;
+    size_t L = model_const->config.num_layers;
+    model_const->batch_size = B;
+    model_const->seq_len = T;
+
+    GPT2Config block_config = model_const->config;
+    block_config.num_layers = 1;
+    fill_in_activation_sizes(bw->act_sizes, block_config, B, T);
+    size_t num_activations = 0;
+    for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
+        num_activations += bw->act_sizes[i];
+    }
+    bw->acts_memory = malloc_and_point_activations(&bw->acts, bw->act_sizes);
+
+    size_t grad_act_sizes[NUM_ACTIVATION_TENSORS];
+    memcpy(grad_act_sizes, bw->act_sizes, sizeof(grad_act_sizes));
+    if (skip_unused_acts) {
+        for (int i = 0; i < NUM_UNUSED_SHADOW_ACTS; i++) {
+            grad_act_sizes[unused_shadow_acts[i]] = 0;
+        }
+    }
+    size_t num_grad_activations = 0;
+    for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
+        num_grad_activations += grad_act_sizes[i];
+    }
+    bw->grads_acts_memory = malloc_and_point_activations(&bw->grads_acts, grad_act_sizes);
+    memset(bw->grads_acts_memory, 0, num_grad_activations * sizeof(float));
+
+#ifdef ENABLE_BF16
+    bw->residuals = (bf16*)mallocCheck(L * B * T * C * sizeof(bf16));
+    bw->residual_in = (float*)mallocCheck(B * T * C * sizeof(float));
+    bw->residual_out = (float*)mallocCheck(B * T * C * sizeof(float));
+    bw->dresidual = (float*)calloc(2 * B * T * C, sizeof(float));
+    printf("blockwise num_activations: %zu + %zu shadow + %zu bf16 residuals + %zu residuals\n",
+           num_activations, num_grad_activations, L * B * T * C, 4 * B * T * C);
+#else
+    bw->residuals = (float*)mallocCheck(L * B * T * C * sizeof(float));
+    bw->dresidual = (float*)calloc(2 * B * T * C, sizeof(float));
+    printf("blockwise num_activations: %zu + %zu shadow + %zu residuals\n",
+           num_activations, num_grad_activations, (L + 2) * B * T * C);
+#endif
+}
+
+void gpt2_blockwise_forward(GPT2 *model, GPT2Blockwise *bw, GPT2Const *model_const,
+                            int* inputs, int* targets, size_t B, size_t T) {
+    // same result as gpt2_forward, probs end up in bw->acts.probs
+    size_t C = model_const->config.channels;
+    size_t NH = model_const->config.num_heads;
+    size_t V = model_const->config.vocab_size;
+    size_t Vp = model_const->config.padded_vocab_size;
+    int L = model_const->config.num_layers;
+
+    encoder_forward(bw->acts.encoded, inputs, model->params.wte, model->params.wpe, B, T, C);
+    ActivationTensors acts = bw->acts;
+    for (int l = 0; l < L; l++) {
+        float* residual = gpt2_blockwise_input(bw, l, B * T * C);
+        acts.residual3 = gpt2_blockwise_output(bw, l, B * T * C);
+        transformer_block_forward_nograd(&model->params, &acts, residual, l, 0, B, T, C, NH);
+        gpt2_blockwise_save(bw, l, B * T * C);
+    }
+    float res;
+    gpt2_head_forward_nograd(&model->params, &bw->acts, gpt2_blockwise_input(bw, L, B * T * C),
+                             targets, B, T, C, V, Vp, &res);
+    model_const->mean_loss = res;
+}
+
+void gpt2_blockwise_forward_backward(GPT2 *model, GPT2 *shadow_model, GPT2Blockwise *bw, GPT2Const *model_const,
+                                     int* inputs, int* targets, size_t B, size_t T) {
+    // accumulates the gradient of the mean loss into shadow_model->params and sets
+    // model_const->mean_loss. only the shadow parameters of shadow_model are used
+    size_t C = model_const->config.channels;
+    size_t NH = model_const->config.num_heads;
+    size_t V = model_const->config.vocab_size;
+    size_t Vp = model_const->config.padded_vocab_size;
+    int L = model_const->config.num_layers;
+    for (size_t i = 0; i < B * T; i++) {
+        assert(0 <= inputs[i] && (size_t)inputs[i] < V);
+        assert(0 <= targets[i] && (size_t)targets[i] < V);
+    }
+
+    // forward up to the head, keeping only the block outputs
+    encoder_forward(bw->acts.encoded, inputs, model->params.wte, model->params.wpe, B, T, C);
+    ActivationTensors acts = bw->acts;
+    for (int l = 0; l < L; l++) {
+        float* residual = gpt2_blockwise_input(bw, l, B * T * C);
+        acts.residual3 = gpt2_blockwise_output(bw, l, B * T * C);
+        transformer_block_forward_nograd(&model->params, &acts, residual, l, 0, B, T, C, NH);
+        gpt2_blockwise_save(bw, l, B * T * C);
+    }
+
+    // the head computes the loss, and its reverse pass seeds the top of the residual stream.
+    // dout and din are zero on entry to each block, and the block's reverse zeroes dout
+    float* dout = bw->dresidual;
+    float* din = bw->dresidual + B * T * C;
+    float res = 0.0f;
+    float dres = 1.0f;
+    __enzyme_autodiff((void *) gpt2_head_forward,
+                      enzyme_dup, &model->params, &shadow_model->params,
+                      enzyme_dup, &bw->acts, &bw->grads_acts,
+                      enzyme_dup, gpt2_blockwise_input(bw, L, B * T * C), dout,
+                      enzyme_const, targets, enzyme_const, B, enzyme_const, T, enzyme_const, C,
+                      enzyme_const, V, enzyme_const, Vp, enzyme_dupnoneed, &res, &dres);
+    model_const->mean_loss = res;
+
+    // reverse sweep over the blocks, each one re-run forward from its saved input
+    ActivationTensors grads_acts = bw->grads_acts;
+    for (int l = L - 1; l >= 0; l--) {
+        float* residual = gpt2_blockwise_input(bw, l, B * T * C);
+        acts.residual3 = gpt2_blockwise_output(bw, l, B * T * C);
+        grads_acts.residual3 = dout;
+        __enzyme_autodiff((void *) transformer_block_forward,
+                          enzyme_dup, &model->params, &shadow_model->params,
+                          enzyme_dup, &acts, &grads_acts,
+                          enzyme_dup, residual, din,
+                          enzyme_const, l, enzyme_const, 0,
+                          enzyme_const, B, enzyme_const, T, enzyme_const, C, enzyme_const, NH);
+        float* tmp = dout; dout = din; din = tmp;
+    }
+
+    // and finally the embeddings
+    __enzyme_autodiff((void *) encoder_forward,
+                      enzyme_dupnoneed, bw->acts.encoded, dout,
+                      enzyme_const, inputs,
+                      enzyme_dup, model->params.wte, shadow_model->params.wte,
+                      enzyme_dup, model->params.wpe, shadow_model->params.wpe,
+                      enzyme_const, (int)B, enzyme_const, (int)T, enzyme_const, (int)C);
+}
+
+// ----------------------------------------------------------------------------
+// tape introspection
+// Runs one forward/backward through Enzyme's split mode and reports how much it
+// tapes: the fixed-size tape of each differentiated entry point (__enzyme_augmentsize),
+// and the heap still held between the augmented forward and the reverse pass, which
+// is where per-iteration caches of values inside loops live. Both are compared to
+// the activations the hand-written backward keeps (act_sizes). The gradients are
+// accumulated into shadow_model exactly as one __enzyme_autodiff training step would.
+
+// the bytes malloc has handed out: the arena chunks (uordblks) plus the chunks above the
+// mmap threshold (hblkhd), which is where tapes and caches at GPT-2 sizes end up
+static size_t heap_in_use(void) {
+#ifdef __GLIBC__
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+void gpt2_tape_report(GPT2 *model, GPT2 *shadow_model, GPT2Const *model_const,
+                      int* inputs, int* targets, size_t B, size_t T) {
+    size_t acts_bytes = model_const->num_activations * sizeof(float);
+
+    // fixed-size tapes of every function we differentiate as a unit
+    size_t gpt2_tape = __enzyme_augmentsize((void *) gpt2_forward, enzyme_dup, enzyme_const,
+                                            enzyme_const, enzyme_const, enzyme_const, enzyme_const,
+                                            enzyme_dupnoneed);
+    size_t block_tape = __enzyme_augmentsize((void *) transformer_block_forward, enzyme_dup, enzyme_dup,
+                                             enzyme_dup, enzyme_const, enzyme_const, enzyme_const,
+                                             enzyme_const, enzyme_const, enzyme_const);
+    size_t head_tape = __enzyme_augmentsize((void *) gpt2_head_forward, enzyme_dup, enzyme_dup, enzyme_dup,
+                                            enzyme_const, enzyme_const, enzyme_const, enzyme_const,
+                                            enzyme_const, enzyme_const, enzyme_dupnoneed);
+    size_t encoder_tape = __enzyme_augmentsize((void *) encoder_forward, enzyme_dupnoneed, enzyme_const,
+                                               enzyme_dup, enzyme_dup, enzyme_const, enzyme_const,
+                                               enzyme_const);
+
+    // one training step in split mode, measuring the heap the tape keeps alive
+    void* tape = mallocCheck(gpt2_tape > 0 ? gpt2_tape : 1);
+    float res = 0.0f;
+    float dres = 1.0f;
+    size_t heap_before = heap_in_use();
+    __enzyme_augmentfwd((void *) gpt2_forward, enzyme_allocated, gpt2_tape, enzyme_tape, tape,
+                        enzyme_dup, model, shadow_model, enzyme_const, model_const,
+                        enzyme_const, inputs, enzyme_const, targets,
+                        enzyme_const, B, enzyme_const, T, enzyme_dupnoneed, &res, &dres);
+    // signed, since the allocator can trim more than the tape holds
+    long long heap_tape = (long long)heap_in_use() - (long long)heap_before;
+    __enzyme_reverse((void *) gpt2_forward, enzyme_allocated, gpt2_tape, enzyme_tape, tape,
+                     enzyme_dup, model, shadow_model, enzyme_const, model_const,
+                     enzyme_const, inputs, enzyme_const, targets,
+                     enzyme_const, B, enzyme_const, T, enzyme_dupnoneed, &res, &dres);
+    free(tape);
+
+    printf("[tape] activations (act_sizes):      %10.2f MiB\n", acts_bytes / 1048576.0);
+    printf("[tape] gpt2_forward tape:            %10zu bytes %+.2f MiB on the heap (%.1f%% of activations)\n",
+           gpt2_tape, heap_tape / 1048576.0, acts_bytes ? 100.0 * ((double)gpt2_tape + heap_tape) / acts_bytes : 0.0);
+    printf("[tape] transformer_block_forward:    %10zu bytes\n", block_tape);
+    printf("[tape] gpt2_head_forward:            %10zu bytes\n", head_tape);
+    printf("[tape] encoder_forward:              %10zu bytes\n", encoder_tape);
+#ifdef ENZYME_FULL_AD
+    printf("[tape] ENZYME_FULL_AD: the kernels are differentiated by Enzyme and tape their own values\n");
+#else
+    printf("[tape] custom derivatives: every kernel's augmented forward tapes nothing\n");
+#endif
+}
 
 void gpt2_zero_grad(GPT2Const *const_model) {
     if(const_model->grads_memory != NULL) { memset(const_model->grads_memory, 0, const_model->num_parameters * sizeof(float)); }
@@ -762,42 +2680,19 @@ void gpt2_zero_grad(GPT2Const *const_model) {
 }
 
 
-void gpt2_update(GPT2 *model, GPT2 *shadow_model, GPT2Const * const_model, float learning_rate, float beta1, float beta2, float eps, float weight_decay, int t) {
-    // reference: https://pytorch.org/docs/stable/generated/torch.optim.AdamW.html
+float gpt2_update(GPT2 *model, GPT2 *shadow_model, GPT2Const * const_model, float learning_rate, float beta1, float beta2, float eps, float weight_decay, float grad_clip, int t) {
+    // AdamW on the gradients in the shadow model, which are zeroed as they are read, since
+    // Enzyme accumulates into them. grad_clip > 0 clips their global norm, which is returned
+    // (see adamw_update). Under ENABLE_BF16 the update also refreshes the bf16 copy of the weights
 
     // lazily allocate the memory for m_memory and v_memory
     if (const_model->m_memory == NULL) {
         const_model->m_memory = (float*)calloc(const_model->num_parameters, sizeof(float));
         const_model->v_memory = (float*)calloc(const_model->num_parameters, sizeof(float));
     }
-    // printf("--\n");
-    for (size_t i = 0; i < const_model->num_parameters; i++) {
-        float param = model->params_memory[i];
-        float grad = shadow_model->params_memory[i];
-        shadow_model->params_memory[i] = 0;
-    
-        // update the first moment (momentum)
-        float m = beta1 * const_model->m_memory[i] + (1.0f - beta1) * grad;
-        // update the second moment (RMSprop)
-        float v = beta2 * const_model->v_memory[i] + (1.0f - beta2) * grad * grad;
-        // bias-correct both moments
-        float m_hat = m / (1.0f - powf(beta1, t));
-        float v_hat = v / (1.0f - powf(beta2, t));
-        if (i == 0) {
-            printf("grad: %f\n", grad);
-            printf("old weight: %f\n", model->params_memory[i]);
-            fflush(stdout);
-        }
-        float update = learning_rate * (m_hat / (sqrtf(v_hat) + eps) + weight_decay * param);
-        // update
-        const_model->m_memory[i] = m;
-        const_model->v_memory[i] = v;
-        model->params_memory[i] -= update;
-        if (i == 0) {
-            printf("new weight: %f (update: %f)\n", model->params_memory[i], update);
-            fflush(stdout);
-        }
-    }
+    return adamw_update(model->params_memory, shadow_model->params_memory, const_model->m_memory,
+                        const_model->v_memory, const_model->num_parameters, learning_rate, beta1, beta2,
+                        eps, weight_decay, grad_clip, 1, t, const_model->params_bf16);
 }
 
 
@@ -847,11 +2742,12 @@ int main() {
     // objects for the main model
     GPT2 model;
     GPT2Const const_model;
-    // objects for the shadow model
+    // the shadow model, which receives the gradients
     GPT2 shadow_model;
-    GPT2Const const_shadow_model;
-    
-    //gpt2_build_from_checkpoint(&shadow_model, "gpt2_124M.bin");
+#ifdef BLOCKWISE_AD
+    // compile with -DBLOCKWISE_AD to train with the per-block reverse sweep
+    GPT2Blockwise blockwise;
+#endif
 
     // build the DataLoaders from tokens files. for now use tiny_shakespeare if available, else tiny_stories
     const char* tiny_stories_train = "dev/data/tinystories/TinyStories_train.bin";
@@ -867,9 +2763,13 @@ int main() {
     dataloader_init(&val_loader, val_tokens, B, T, 0, 1, 0);
     // init gpt 2
     gpt2_build_from_checkpoint(&model, &const_model, "gpt2_124M.bin");
-    gpt2_build_from_checkpoint(&shadow_model, &const_shadow_model, "gpt2_124M.bin");
+#ifdef BLOCKWISE_AD
+    gpt2_blockwise_init(&blockwise, &const_model, B, T, SHADOW_SKIP_UNUSED_ACTS);
+    gpt2_build_shadow_params(&shadow_model, &const_model);
+#else
     gpt2_init(&model, &const_model, B, T);
-    gpt2_init(&shadow_model, &const_shadow_model, B, T);
+    gpt2_build_shadow(&shadow_model, &const_model, SHADOW_SKIP_UNUSED_ACTS);
+#endif
     printf("train dataset num_batches: %zu\n", train_loader.num_tokens / (B*T));
     printf("val dataset num_batches: %zu\n", val_loader.num_tokens / (B*T));
     int val_num_batches = 5;
@@ -883,6 +2783,9 @@ int main() {
     int* gen_tokens = (int*)mallocCheck(B * T * sizeof(int));
     const int genT = 64; // number of steps of inference we will do
 
+    // set GPT2_GRAD_CLIP to clip the global gradient norm to it (off by default)
+    float grad_clip = getenv("GPT2_GRAD_CLIP") != NULL ? (float)atof(getenv("GPT2_GRAD_CLIP")) : 0.0f;
+
     // train
     struct timespec start, end;
     for (int step = 0; step <= 40; step++) {
@@ -893,8 +2796,12 @@ int main() {
             dataloader_reset(&val_loader);
             for (int i = 0; i < val_num_batches; i++) {
                 dataloader_next_batch(&val_loader);
+#ifdef BLOCKWISE_AD
+                gpt2_blockwise_forward(&model, &blockwise, &const_model, val_loader.inputs, val_loader.targets, B, T);
+#else
                 float res = 0.0;
-                gpt2_forward(&model, &const_model, val_loader.inputs, val_loader.targets, B, T, &res);
+                gpt2_forward_nograd(&model, &const_model, val_loader.inputs, val_loader.targets, B, T, &res);
+#endif
                 val_loss += const_model.mean_loss;
             }
             val_loss /= val_num_batches;
@@ -914,13 +2821,19 @@ int main() {
                 // we re-calculate the forward pass for all of (B,T) positions from scratch
                 // but the inference here is just for sanity checking anyway
                 // and we can maybe optimize a bit more later, with careful tests
+#ifdef BLOCKWISE_AD
+                gpt2_blockwise_forward(&model, &blockwise, &const_model, gen_tokens, NULL, B, T);
+                float* probs_all = blockwise.acts.probs;
+#else
 		float res = 0.0;
-                gpt2_forward(&model, &const_model, gen_tokens, NULL, B, T, &res);
+                gpt2_forward_nograd(&model, &const_model, gen_tokens, NULL, B, T, &res);
+                float* probs_all = model.acts.probs;
+#endif
                 // furthermore, below we're only using b=0 (i.e. the first row) of all B rows
                 // we're in principle running B "inference streams" in parallel here
                 // but only using position 0
                 // get the Vp-dimensional vector probs[0, t-1, :]
-                float* probs = model.acts.probs + (t-1) * const_model.config.padded_vocab_size;
+                float* probs = probs_all + (t-1) * const_model.config.padded_vocab_size;
                 float coin = random_f32(&rng_state);
                 // note we're only sampling from the first V elements, ignoring padding
                 // (the probabilities in the padded region should be zero anyway)
@@ -947,14 +2860,26 @@ int main() {
         // gpt2_backward(&model, &const_model);
         printf("before __enzyme_autodiff\n");
         fflush(stdout);
-	float res = 0.0;
-	float dres = 1.0;
-        __enzyme_autodiff((void *) gpt2_forward, enzyme_dup, &model, &shadow_model, enzyme_const, &const_model,
-                            enzyme_const, train_loader.inputs, enzyme_const, train_loader.targets, 
-                            enzyme_const, B, enzyme_const, T, enzyme_dupnoneed, &res, &dres);
+#ifdef BLOCKWISE_AD
+        gpt2_blockwise_forward_backward(&model, &shadow_model, &blockwise, &const_model,
+                                        train_loader.inputs, train_loader.targets, B, T);
+#else
+        if (step == 0 && getenv("GPT2_TAPE_REPORT") != NULL) {
+            // set GPT2_TAPE_REPORT to have the first step report what Enzyme tapes
+            gpt2_tape_report(&model, &shadow_model, &const_model, train_loader.inputs, train_loader.targets, B, T);
+        } else {
+            float res = 0.0;
+            float dres = 1.0;
+            __enzyme_autodiff((void *) gpt2_forward, enzyme_dup, &model, &shadow_model, enzyme_const, &const_model,
+                                enzyme_const, train_loader.inputs, enzyme_const, train_loader.targets,
+                                enzyme_const, B, enzyme_const, T, enzyme_dupnoneed, &res, &dres);
+        }
+#endif
         printf("after __enzyme_autodiff \n");
         fflush(stdout);
-        gpt2_update(&model, &shadow_model, &const_model, 1e-4f, 0.9f, 0.999f, 1e-8f, 0.0f, step+1);
+        float grad_norm = gpt2_update(&model, &shadow_model, &const_model, 1e-4f, 0.9f, 0.999f, 1e-8f, 0.0f,
+                                      grad_clip, step+1);
+        if (grad_clip > 0.0f) { printf("grad norm %f\n", grad_norm); }
         printf("checkpoint");
         fflush(stdout);
         clock_gettime(CLOCK_MONOTONIC, &end);
@@ -977,9 +2902,8 @@ int main() {
 static void BM_EnzymeForward(benchmark::State& state) {
     GPT2 model;
     GPT2Const const_model;
-    // objects for the shadow model
+    // the shadow model, which receives the gradients
     GPT2 shadow_model;
-    GPT2Const const_shadow_model;
 
     const char* tiny_stories_train = "dev/data/tinystories/TinyStories_train.bin";
     const char* tiny_stories_val = "dev/data/tinystories/TinyStories_val.bin";
@@ -993,9 +2917,8 @@ static void BM_EnzymeForward(benchmark::State& state) {
     dataloader_init(&train_loader, train_tokens, B, T, 0, 1, 1);
 
     gpt2_build_from_checkpoint(&model, &const_model, "gpt2_124M.bin");
-    gpt2_build_from_checkpoint(&shadow_model, &const_shadow_model, "gpt2_124M.bin");
     gpt2_init(&model, &const_model, B, T);
-    gpt2_init(&shadow_model, &const_shadow_model, B, T);
+    gpt2_build_shadow(&shadow_model, &const_model, SHADOW_SKIP_UNUSED_ACTS);
 
 
     for (auto _ : state) {
@@ -1013,9 +2936,8 @@ BENCHMARK(BM_EnzymeForward)->Iterations(25);
 static void BM_EnzymeForwardBackward(benchmark::State& state) {
     GPT2 model;
     GPT2Const const_model;
-    // objects for the shadow model
+    // the shadow model, which receives the gradients
     GPT2 shadow_model;
-    GPT2Const const_shadow_model;
 
     const char* tiny_stories_train = "dev/data/tinystories/TinyStories_train.bin";
     const char* tiny_stories_val = "dev/data/tinystories/TinyStories_val.bin";
@@ -1029,9 +2951,8 @@ static void BM_EnzymeForwardBackward(benchmark::State& state) {
     dataloader_init(&train_loader, train_tokens, B, T, 0, 1, 1);
 
     gpt2_build_from_checkpoint(&model, &const_model, "gpt2_124M.bin");
-    gpt2_build_from_checkpoint(&shadow_model, &const_shadow_model, "gpt2_124M.bin");
     gpt2_init(&model, &const_model, B, T);
-    gpt2_init(&shadow_model, &const_shadow_model, B, T);
+    gpt2_build_shadow(&shadow_model, &const_model, SHADOW_SKIP_UNUSED_ACTS);
 
 
     for (auto _ : state) {
@@ -1042,7 +2963,7 @@ static void BM_EnzymeForwardBackward(benchmark::State& state) {
         __enzyme_autodiff((void *) gpt2_forward, enzyme_dup, &model, &shadow_model, enzyme_const, &const_model,
                             enzyme_const, train_loader.inputs, enzyme_const, train_loader.targets, 
                             enzyme_const, B, enzyme_const, T, enzyme_dupnoneed, &res, &dres);
-        // gpt2_update(&model, &shadow_model, &const_model, 1e-4f, 0.9f, 0.999f, 1e-8f, 0.0f, step+1);
+        // gpt2_update(&model, &shadow_model, &const_model, 1e-4f, 0.9f, 0.999f, 1e-8f, 0.0f, 0.0f, step+1);
     }
 
     // Cleanup
@@ -1051,6 +2972,37 @@ static void BM_EnzymeForwardBackward(benchmark::State& state) {
 }
 BENCHMARK(BM_EnzymeForwardBackward)->Iterations(25);
 
+static void BM_EnzymeBlockwiseForwardBackward(benchmark::State& state) {
+    GPT2 model;
+    GPT2Const const_model;
+    // the shadow model, which receives the gradients
+    GPT2 shadow_model;
+    GPT2Blockwise blockwise;
+
+    const char* tiny_stories_train = "dev/data/tinystories/TinyStories_train.bin";
+    const char* tiny_shakespeare_train = "dev/data/tinyshakespeare/tiny_shakespeare_train.bin";
+    const char* train_tokens = access(tiny_shakespeare_train, F_OK) != -1 ? tiny_shakespeare_train : tiny_stories_train;
+
+    size_t B = 4; 
+    size_t T = 64; 
+    DataLoader train_loader;
+    dataloader_init(&train_loader, train_tokens, B, T, 0, 1, 1);
+
+    gpt2_build_from_checkpoint(&model, &const_model, "gpt2_124M.bin");
+    gpt2_blockwise_init(&blockwise, &const_model, B, T, SHADOW_SKIP_UNUSED_ACTS);
+    gpt2_build_shadow_params(&shadow_model, &const_model);
+
+    for (auto _ : state) {
+        dataloader_next_batch(&train_loader);
+        gpt2_blockwise_forward_backward(&model, &shadow_model, &blockwise, &const_model,
+                                        train_loader.inputs, train_loader.targets, B, T);
+    }
+
+    // Cleanup
+    dataloader_free(&train_loader);
+}
+BENCHMARK(BM_EnzymeBlockwiseForwardBackward)->Iterations(25);
+
 int main(int argc, char** argv) {
     ::benchmark::Initialize(&argc, argv);
     ::benchmark::RunSpecifiedBenchmarks();
@@ -14,6 +14,7 @@ There will be other versions of this code that specialize it and make it fast.
 #include <stdint.h>
 #include <assert.h>
 #include <math.h>
+#include <float.h>
 #include <time.h>
 #include <string.h>
 #include <unistd.h>
@@ -28,6 +29,10 @@ There will be other versions of this code that specialize it and make it fast.
 #include "llmc/tokenizer.h"
 // defines: dataloader_init, dataloader_reset, dataloader_next_batch, dataloader_free
 #include "llmc/dataloader.h"
+// defines: vmath_expf, vmath_logf, vmath_tanhf, vmath_coshf
+#include "llmc/vmath.h"
+// defines: gemm_sgemm
+#include "llmc/gemm.h"
 
 
 // ----------------------------------------------------------------------------
@@ -41,32 +46,37 @@ int enzyme_const;
 double EPSILON = 1e-4;
 double TOLERANCE = 1e-3;
 float __enzyme_autodiff(void *, ...);
+void __enzyme_fwddiff(void *, ...);
+// at most this many failing elements are printed by check_gradients(_2d)
+#define GRADCHECK_MAX_REPORTED 8
 
 // finite distance checking for f: R^n -> R
-void check_gradients(
+// prints the first few failures and a one-line summary, returns the number of failures
+int check_gradients(
     float *numerical_gradients,   // Perturbed values (numerical approximation)
     float *analytical_gradients, // Gradients from backpropagation
     int size,                  // Size of the vector
     float epsilon,             // Perturbation value
     float tolerance            // Acceptable tolerance for error
 ) {
+    int failed = 0;
+    float max_difference = 0.0f;
     for (int i = 0; i < size; i++) {
-        // Compute numerical gradient using finite differences
-        float numerical_gradient = numerical_gradients[i];
-
         // Compare numerical gradient with analytical gradient
+        float numerical_gradient = numerical_gradients[i];
         float difference = fabs(numerical_gradient - analytical_gradients[i]);
+        if (difference > max_difference) { max_difference = difference; }
         if (difference > tolerance) {
-            printf("Gradient check failed at index %d:\n", i);
-            printf("  Analytical Gradient: %f\n", analytical_gradients[i]);
-            printf("  Numerical Gradient: %f\n", numerical_gradient);
-            printf("  Difference: %f (tolerance: %f)\n", difference, tolerance);
-        } else {
-            printf("Gradient check passed at index %d:\n", i);
-            printf("  Analytical Gradient: %f\n", analytical_gradients[i]);
-            printf("  Numerical Gradient: %f\n", numerical_gradient);
+            if (failed < GRADCHECK_MAX_REPORTED) {
+                printf("Gradient check failed at index %d: analytical %f, numerical %f\n",
+                       i, analytical_gradients[i], numerical_gradient);
+            }
+            failed++;
         }
     }
+    printf("Gradient check %s: %d/%d failed, max difference %e (tolerance %e)\n",
+           failed ? "FAILED" : "passed", failed, size, max_difference, tolerance);
+    return failed;
 }
 
 void print_tensor(const char* name, float* tensor, int size) {
@@ -77,8 +87,20 @@ void print_tensor(const char* name, float* tensor, int size) {
     printf("]\n");
 }
 
+// Single-call vector-Jacobian products (the *_vjp_enzyme functions below).
+// Each takes the upstream gradient of the whole output, seeds it into one
+// __enzyme_autodiff call and accumulates dout^T * J into the caller's gradient
+// buffers, i.e. the same contract as the hand-written *_backward kernels.
+// The forward is re-run into scratch outputs. Enzyme consumes (zeroes) the
+// shadow of the output on the way back, so it gets a copy of dout.
+float* vjp_seed(const float* dout, size_t n) {
+    float* seed = (float*)mallocCheck(n * sizeof(float));
+    memcpy(seed, dout, n * sizeof(float));
+    return seed;
+}
+
 
-void check_gradients_2d(
+int check_gradients_2d(
     float *plus_perturbed,       // Function values with positive perturbation (1D array, 2D representation)
     float *minus_perturbed,      // Function values with negative perturbation (1D array, 2D representation)
     float *analytical_gradients, // Gradients from backpropagation (1D array, 2D representation)
@@ -88,27 +110,26 @@ void check_gradients_2d(
     float tolerance              // Acceptable tolerance for error
 ) {
     int size = h * w; // Total number of elements in the 2D representation
+    int failed = 0;
+    float max_difference = 0.0f;
     for (int i = 0; i < size; i++) {
         // Compute numerical gradient using finite differences
         float numerical_gradient = (plus_perturbed[i] - minus_perturbed[i]) / (2.0f * epsilon);
 
         // Compare numerical gradient with analytical gradient
         float difference = fabs(numerical_gradient - analytical_gradients[i]);
+        if (difference > max_difference) { max_difference = difference; }
         if (difference > tolerance) {
-            int row = i / w; // Convert linear index to 2D row
-            int col = i % w; // Convert linear index to 2D column
-            printf("Gradient check failed at (%d, %d):\n", row, col);
-            printf("  Analytical Gradient: %f\n", analytical_gradients[i]);
-            printf("  Numerical Gradient: %f\n", numerical_gradient);
-            printf("  Difference: %f (tolerance: %f)\n", difference, tolerance);
-        } else {
-            int row = i / w; // Convert linear index to 2D row
-            int col = i % w; // Convert linear index to 2D column
-            printf("Gradient check passed at (%d, %d):\n", row, col);
-            printf("  Analytical Gradient: %f\n", analytical_gradients[i]);
-            printf("  Numerical Gradient: %f\n", numerical_gradient);
+            if (failed < GRADCHECK_MAX_REPORTED) {
+                printf("Gradient check failed at (%d, %d): analytical %f, numerical %f\n",
+                       i / w, i % w, analytical_gradients[i], numerical_gradient);
+            }
+            failed++;
         }
     }
+    printf("Gradient check %s: %d/%d failed, max difference %e (tolerance %e)\n",
+           failed ? "FAILED" : "passed", failed, size, max_difference, tolerance);
+    return failed;
 }
 
 
@@ -161,6 +182,23 @@ void encoder_enzyme_backward(float *out, int *inp, float *wte, float *dwte, floa
     free(d_out);
 }
 
+void encoder_vjp_enzyme(float* dwte, float* dwpe,
+                        float* dout, int* inp, float* wte, float* wpe,
+                        int B, int T, int C) {
+    float* out = (float*)mallocCheck((size_t)B * T * C * sizeof(float));
+    float* d_out = vjp_seed(dout, (size_t)B * T * C);
+    __enzyme_autodiff(
+        (void*)encoder_forward,
+        enzyme_dup, out, d_out,
+        enzyme_const, inp,
+        enzyme_dup, wte, dwte,
+        enzyme_dup, wpe, dwpe,
+        enzyme_const, B,
+        enzyme_const, T, enzyme_const, C);
+    free(out);
+    free(d_out);
+}
+
 void test_encoder_backward(){
     int B = 1; // Batch size
     int T = 2; // Sequence length
@@ -329,6 +367,28 @@ void layernorm_backward_enzyme_no_loops(float* out, float* mean, float* rstd,
     free(d_out);
 }
 
+void layernorm_vjp_enzyme(float* dinp, float* dweight, float* dbias,
+                          float* dout, float* inp, float* weight, float* bias,
+                          int B, int T, int C) {
+    float* out = (float*)mallocCheck((size_t)B * T * C * sizeof(float));
+    float* mean = (float*)mallocCheck((size_t)B * T * sizeof(float));
+    float* rstd = (float*)mallocCheck((size_t)B * T * sizeof(float));
+    float* d_out = vjp_seed(dout, (size_t)B * T * C);
+    __enzyme_autodiff(
+        (void*)layernorm_forward,
+        enzyme_dup, out, d_out,
+        enzyme_const, mean, enzyme_const, rstd,
+        enzyme_dup, inp, dinp,
+        enzyme_dup, weight, dweight,
+        enzyme_dup, bias, dbias,
+        enzyme_const, B,
+        enzyme_const, T, enzyme_const, C);
+    free(out);
+    free(mean);
+    free(rstd);
+    free(d_out);
+}
+
 // void test_layernorm_backward_enzyme() {
 //      const int B = 1, T = 4, C = 3; // No batching, sequence length 4, embedding size 3
 
@@ -422,8 +482,7 @@ void matmul_forward_naive(float *__restrict out,
                          const float *__restrict inp, const float *__restrict weight, const float *__restrict bias,
                          int B, int T, int C, int OC) { 
     // the most naive implementation of matrix multiplication
-    // this serves as an algorithmic reference, and as a fallback for
-    // unfriendly input shapes inside matmul_forward(), below.
+    // this serves as an algorithmic reference for matmul_forward(), below.
    
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
@@ -445,6 +504,40 @@ void matmul_forward_naive(float *__restrict out,
 
 
 
+// the register tile of matmul_forward(): rows [obt, obt + nbt) of the collapsed (B*T)
+// dimension, for every output channel. nbt is MATMUL_LOOP_UNROLL for all full tiles and
+// smaller only for the last one, so B*T does not have to be a multiple of the tile.
+// always_inline lets the compiler specialize the full tiles on the constant nbt.
+#define MATMUL_LOOP_UNROLL 8
+static inline __attribute__((always_inline))
+void matmul_forward_tile(float *__restrict out,
+                         const float *__restrict inp, const float *__restrict weight, const float *__restrict bias,
+                         int obt, int nbt, int C, int OC) {
+    for (int o = 0; o < OC; o++) {
+        // we'll keep MATMUL_LOOP_UNROLL many results in registers
+        float result[MATMUL_LOOP_UNROLL];
+        // initialize the bias, if it exists
+        for (int ibt = 0; ibt < nbt; ibt++) {
+            result[ibt] = (bias != NULL) ? bias[o] : 0.0f;
+        }
+        // inner loops. Because we do nbt steps of inner bt, we can cache
+        // the value of weight[i + o * C] and reuse it.
+        // we compile with -Ofast, so the compiler will turn the inner loop into FMAs
+        for (int i = 0; i < C; i++) {
+            float w = weight[i + o * C];
+            for (int ibt = 0; ibt < nbt; ibt++) {
+                int bt = obt + ibt;
+                result[ibt] += inp[bt * C + i] * w;
+            }
+        }
+        // write back results to main memory
+        for (int ibt = 0; ibt < nbt; ibt++) {
+            int bt = obt + ibt;
+            out[bt * OC + o] = result[ibt];
+        }
+    }
+}
+
 void matmul_forward(float *__restrict out,
                     const float *__restrict inp, const float *__restrict weight, const float *__restrict bias,
                     int B, int T, int C, int OC) {
@@ -454,40 +547,18 @@ void matmul_forward(float *__restrict out,
     // OC is short for "output channels"
     // inp is (B,T,C), weight is (OC, C), bias is (OC)
     // out will be (B,T,OC)
-    // make sure the tiled loop will be correct or fallback to naive version
-    const int LOOP_UNROLL = 8;
-    if (B*T % LOOP_UNROLL != 0) {
-        matmul_forward_naive(out, inp, weight, bias, B, T, C, OC);
-        return;
-    }
 
     // collapse the B and T loops into one and turn it into a strided loop.
-    // then we can tile the inner loop, and reuse the loaded weight LOOP_UNROLL many times
-   
-    for (int obt = 0; obt < B * T; obt += LOOP_UNROLL) {
-        for (int o = 0; o < OC; o++) {
-            // we'll keep LOOP_UNROLL many results in registers
-            float result[LOOP_UNROLL];
-            // initialize the bias, if it exists
-            for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
-                result[ibt] = (bias != NULL) ? bias[o] : 0.0f;
-            }
-            // inner loops. Because we do LOOP_UNROLL steps of inner bt, we can cache
-            // the value of weight[i + o * C] and reuse it.
-            // we compile with -Ofast, so the compiler will turn the inner loop into FMAs
-            for (int i = 0; i < C; i++) {
-                float w = weight[i + o * C];
-                for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
-                    int bt = obt + ibt;
-                    result[ibt] += inp[bt * C + i] * w;
-                }
-            }
-            // write back results to main memory
-            for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
-                int bt = obt + ibt;
-                out[bt * OC + o] = result[ibt];
-            }
-        }
+    // then we can tile the inner loop, and reuse the loaded weight MATMUL_LOOP_UNROLL many times.
+    // the rows left over after the full tiles (e.g. B*T = 1 when decoding) form one
+    // shorter tile, so no shape falls back to the naive loops
+    int BT = B * T;
+    int BT_full = BT - BT % MATMUL_LOOP_UNROLL;
+    for (int obt = 0; obt < BT_full; obt += MATMUL_LOOP_UNROLL) {
+        matmul_forward_tile(out, inp, weight, bias, obt, MATMUL_LOOP_UNROLL, C, OC);
+    }
+    if (BT_full < BT) {
+        matmul_forward_tile(out, inp, weight, bias, BT_full, BT - BT_full, C, OC);
     }
 }
 
@@ -580,6 +651,35 @@ void matmul_backward_naive_enzyme(float* out,
     }      
 }
 
+void matmul_vjp_enzyme(float* dinp, float* dweight, float* dbias,
+                       float* dout, const float* inp, const float* weight, const float* bias,
+                       int B, int T, int C, int OC) {
+    // bias (and with it dbias) may be NULL, e.g. for the tied LM head
+    float* out = (float*)mallocCheck((size_t)B * T * OC * sizeof(float));
+    float* d_out = vjp_seed(dout, (size_t)B * T * OC);
+    if (bias != NULL) {
+        __enzyme_autodiff(
+            (void*)matmul_forward,
+            enzyme_dup, out, d_out,
+            enzyme_dup, inp, dinp,
+            enzyme_dup, weight, dweight,
+            enzyme_dup, bias, dbias,
+            enzyme_const, B,
+            enzyme_const, T, enzyme_const, C, enzyme_const, OC);
+    } else {
+        __enzyme_autodiff(
+            (void*)matmul_forward,
+            enzyme_dup, out, d_out,
+            enzyme_dup, inp, dinp,
+            enzyme_dup, weight, dweight,
+            enzyme_const, bias,
+            enzyme_const, B,
+            enzyme_const, T, enzyme_const, C, enzyme_const, OC);
+    }
+    free(out);
+    free(d_out);
+}
+
 
 void matmul_backward_enzyme_test() {
     int B = 2, T = 3, C = 4, OC = 2;
@@ -622,10 +722,10 @@ void matmul_backward_enzyme_test() {
 
 
 
-void matmul_backward(float* dinp, float* dweight, float* dbias,
-                     const float* dout, const float* inp, const float* weight,
-                     int B, int T, int C, int OC) {
-    // most of the running time is spent here and in matmul_forward
+void matmul_backward_naive(float* dinp, float* dweight, float* dbias,
+                           const float* dout, const float* inp, const float* weight,
+                           int B, int T, int C, int OC) {
+    // the loop reference for matmul_backward(), below
     // this backward could be done in a single "round" of loops
     // but that doesn't afford an efficient parallelization strategy
 
@@ -662,6 +762,19 @@ void matmul_backward(float* dinp, float* dweight, float* dbias,
     }
 }
 
+void matmul_backward(float* dinp, float* dweight, float* dbias,
+                     const float* dout, const float* inp, const float* weight,
+                     int B, int T, int C, int OC) {
+    // most of the running time is spent here and in matmul_forward
+    // both weight products are GEMMs on the blocked engine of llmc/gemm.h:
+    // dinp (B*T,C) += dout (B*T,OC) @ weight (OC,C)
+    gemm_sgemm(0, 0, B * T, C, OC, dout, OC, weight, C, NULL, dinp, C, 1);
+    // dweight (OC,C) += dout^T (OC,B*T) @ inp (B*T,C)
+    gemm_sgemm(1, 0, OC, C, B * T, dout, OC, inp, C, NULL, dweight, C, 1);
+    // dbias (OC) += column sums of dout
+    if (dbias != NULL) { gemm_colsum(dbias, dout, B * T, OC, OC, NULL); }
+}
+
 void attention_forward(float*__restrict out, float*__restrict preatt, float*__restrict att,
                        float*__restrict inp,
                        int B, int T, int C, int NH) {
@@ -739,6 +852,335 @@ void attention_forward(float*__restrict out, float*__restrict preatt, float*__re
     }
 }
 
+// query rows and key columns per tile of the fused attention, and the largest head size
+#define ATTN_BLOCK 32
+#define ATTN_MAX_HS 128
+// (b,h) heads per thread below which attention_backward_flash splits work inside a head
+#define ATTN_HEADS_PER_THREAD 4
+
+// Causal attention work is triangular: query tile qb reads qb + 1 key tiles, and key
+// tile kb is read by num_blocks - kb query tiles. Splitting (b, t, h) evenly would
+// leave the threads that own the last rows with twice the average work. Instead one
+// parallel work item is a pair of tiles, tile p and tile num_blocks - 1 - p, whose
+// combined cost is the same for every p, so a static schedule is balanced.
+static inline int attention_num_pairs(int num_blocks) {
+    return (num_blocks + 1) / 2;
+}
+
+static inline int attention_pair_tile(int pair, int side, int num_blocks) {
+    // tile of one side of a pair, or -1 for the missing partner of the middle tile
+    int tile = side == 0 ? pair : num_blocks - 1 - pair;
+    return (side == 1 && tile == pair) ? -1 : tile;
+}
+
+static inline void attention_forward_flash_tile(float* __restrict out, float* __restrict lse,
+                                                const float* __restrict inp,
+                                                int b, int h, int t0, int nq,
+                                                int T, int C, int NH) {
+    // one tile of nq queries starting at t0, for batch b and head h
+    int C3 = C*3;
+    int hs = C / NH; // head size
+    float scale = 1.0 / sqrtf(hs);
+    float acc[ATTN_BLOCK][ATTN_MAX_HS];
+    float score[ATTN_BLOCK][ATTN_BLOCK];
+    float m[ATTN_BLOCK], l[ATTN_BLOCK];
+    for (int iq = 0; iq < nq; iq++) {
+        m[iq] = -FLT_MAX;
+        l[iq] = 0.0f;
+        for (int i = 0; i < hs; i++) { acc[iq][i] = 0.0f; }
+    }
+
+    // key tiles up to and including the diagonal one
+    for (int k0 = 0; k0 < t0 + nq; k0 += ATTN_BLOCK) {
+        int nk = t0 + nq - k0 < ATTN_BLOCK ? t0 + nq - k0 : ATTN_BLOCK;
+        for (int iq = 0; iq < nq; iq++) {
+            int t = t0 + iq;
+            // keys k0 .. t are visible to query t
+            int nvalid = t - k0 + 1 < nk ? t - k0 + 1 : nk;
+            if (nvalid <= 0) { continue; }
+            const float* query_t = inp + b * T * C3 + t * C3 + h * hs;
+
+            // (query_t) dot (key_t2), and the max of this tile
+            float maxval = m[iq];
+            for (int jk = 0; jk < nvalid; jk++) {
+                const float* key_t2 = inp + b * T * C3 + (k0 + jk) * C3 + h * hs + C; // +C because it's key
+                float val = 0.0f;
+                for (int i = 0; i < hs; i++) {
+                    val += query_t[i] * key_t2[i];
+                }
+                val *= scale;
+                score[iq][jk] = val;
+                if (val > maxval) { maxval = val; }
+            }
+
+            // rescale what was accumulated under the old max, then add this tile
+            float correction = expf(m[iq] - maxval);
+            l[iq] *= correction;
+            for (int i = 0; i < hs; i++) { acc[iq][i] *= correction; }
+            for (int jk = 0; jk < nvalid; jk++) {
+                const float* value_t2 = inp + b * T * C3 + (k0 + jk) * C3 + h * hs + C*2; // +C*2 because it's value
+                float expv = expf(score[iq][jk] - maxval);
+                l[iq] += expv;
+                for (int i = 0; i < hs; i++) {
+                    acc[iq][i] += expv * value_t2[i];
+                }
+            }
+            m[iq] = maxval;
+        }
+    }
+
+    // normalize, and keep the logsumexp so backward can rebuild the softmax
+    for (int iq = 0; iq < nq; iq++) {
+        int t = t0 + iq;
+        float* out_bth = out + b * T * C + t * C + h * hs;
+        float l_inv = 1.0f / l[iq];
+        for (int i = 0; i < hs; i++) { out_bth[i] = acc[iq][i] * l_inv; }
+        lse[b*NH*T + h*T + t] = m[iq] + logf(l[iq]);
+    }
+}
+
+void attention_forward_flash(float*__restrict out, float*__restrict lse,
+                             float*__restrict inp,
+                             int B, int T, int C, int NH) {
+    // input is (B, T, 3C) holding the query, key, value (Q, K, V) vectors
+    // lse is (B, NH, T), the logsumexp of every row of scaled scores (used in backward)
+    // output is (B, T, C)
+    // attention is the only layer that mixes information across time
+    // every other operation is applied at every (b,t) position independently
+    // (and of course, no layer mixes information across batch)
+    // the (T, T) pre-attention scores and softmax are never materialized: a tile of
+    // ATTN_BLOCK queries streams the key/value tiles at or below the causal diagonal,
+    // keeping a running max m and running sum l of exp(score - m) per query, and
+    // rescales its output accumulator whenever the max grows (online softmax)
+    assert(C / NH <= ATTN_MAX_HS);
+    int num_blocks = (T + ATTN_BLOCK - 1) / ATTN_BLOCK;
+    int num_pairs = attention_num_pairs(num_blocks);
+
+    #pragma omp parallel for collapse(3) schedule(static)
+    for (int b = 0; b < B; b++) {
+        for (int h = 0; h < NH; h++) {
+            for (int pair = 0; pair < num_pairs; pair++) {
+                for (int side = 0; side < 2; side++) {
+                    int qb = attention_pair_tile(pair, side, num_blocks);
+                    if (qb < 0) { continue; }
+                    int t0 = qb * ATTN_BLOCK;
+                    int nq = T - t0 < ATTN_BLOCK ? T - t0 : ATTN_BLOCK;
+                    attention_forward_flash_tile(out, lse, inp, b, h, t0, nq, T, C, NH);
+                }
+            }
+        }
+    }
+}
+
+// the per-(t, t2) update of attention_backward_flash_head, split out so that the compiler
+// sees the gradient rows as non-aliasing and vectorizes over the head size
+static inline void attention_backward_flash_accumulate(float* __restrict dquery_t, float* __restrict dkey_t2,
+                                                       float* __restrict dvalue_t2, const float* __restrict query_t,
+                                                       const float* __restrict key_t2, const float* __restrict dout_bth,
+                                                       float att, float dpreatt, int hs) {
+    for (int i = 0; i < hs; i++) {
+        dvalue_t2[i] += att * dout_bth[i];
+        dquery_t[i] += key_t2[i] * dpreatt;
+        dkey_t2[i] += query_t[i] * dpreatt;
+    }
+}
+
+static inline void attention_backward_flash_head(float* dinp, const float* dout,
+                                                 const float* inp, const float* out, const float* lse,
+                                                 int b, int h, int T, int C, int NH) {
+    // all of one (b,h): position t writes dkey/dvalue at every t2 <= t, but only
+    // within its own head, so one pass in t computes att once per (t, t2)
+    int C3 = C*3;
+    int hs = C / NH; // head size
+    float scale = 1.f / sqrtf(hs);
+    for (int t = 0; t < T; t++) {
+        const float* query_t = inp + b * T * C3 + t * C3 + h * hs;
+        float* dquery_t = dinp + b * T * C3 + t * C3 + h * hs;
+        const float* out_bth = out + b * T * C + t * C + h * hs;
+        const float* dout_bth = dout + b * T * C + t * C + h * hs;
+        float lse_bth = lse[b*NH*T + h*T + t];
+        float D = 0.0f;
+        for (int i = 0; i < hs; i++) {
+            D += dout_bth[i] * out_bth[i];
+        }
+
+        for (int t2 = 0; t2 <= t; t2++) {
+            const float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
+            const float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
+            float* dkey_t2 = dinp + b * T * C3 + t2 * C3 + h * hs + C;
+            float* dvalue_t2 = dinp + b * T * C3 + t2 * C3 + h * hs + C*2;
+            // recompute att[t2], and get datt[t2] through the value accumulation
+            float preatt = 0.0f;
+            float datt = 0.0f;
+            for (int i = 0; i < hs; i++) {
+                preatt += query_t[i] * key_t2[i];
+                datt += dout_bth[i] * value_t2[i];
+            }
+            float att = expf(preatt * scale - lse_bth);
+            // through the softmax, then the query @ key matmul
+            float dpreatt = att * (datt - D) * scale;
+            attention_backward_flash_accumulate(dquery_t, dkey_t2, dvalue_t2, query_t, key_t2, dout_bth,
+                                          att, dpreatt, hs);
+        }
+    }
+}
+
+static inline void attention_backward_flash_query_tile(float* __restrict dinp, const float* __restrict dout,
+                                                       const float* __restrict inp, const float* __restrict out,
+                                                       const float* __restrict lse,
+                                                       int b, int h, int t0, int nq,
+                                                       int T, int C, int NH) {
+    // dquery of nq queries starting at t0: each one reads the keys t2 <= t
+    int C3 = C*3;
+    int hs = C / NH; // head size
+    float scale = 1.f / sqrtf(hs);
+    for (int t = t0; t < t0 + nq; t++) {
+        const float* query_t = inp + b * T * C3 + t * C3 + h * hs;
+        const float* out_bth = out + b * T * C + t * C + h * hs;
+        const float* dout_bth = dout + b * T * C + t * C + h * hs;
+        float lse_bth = lse[b*NH*T + h*T + t];
+        float D = 0.0f;
+        for (int i = 0; i < hs; i++) {
+            D += dout_bth[i] * out_bth[i];
+        }
+        float dquery[ATTN_MAX_HS];
+        for (int i = 0; i < hs; i++) { dquery[i] = 0.0f; }
+        for (int t2 = 0; t2 <= t; t2++) {
+            const float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
+            const float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
+            // recompute att[t2], and get datt[t2] through the value accumulation
+            float preatt = 0.0f;
+            float datt = 0.0f;
+            for (int i = 0; i < hs; i++) {
+                preatt += query_t[i] * key_t2[i];
+                datt += dout_bth[i] * value_t2[i];
+            }
+            float att = expf(preatt * scale - lse_bth);
+            // through the softmax, then the query @ key matmul
+            float dpreatt = att * (datt - D) * scale;
+            for (int i = 0; i < hs; i++) {
+                dquery[i] += key_t2[i] * dpreatt;
+            }
+        }
+        float* dquery_t = dinp + b * T * C3 + t * C3 + h * hs;
+        for (int i = 0; i < hs; i++) { dquery_t[i] += dquery[i]; }
+    }
+}
+
+static inline void attention_backward_flash_key_tile(float* __restrict dinp, const float* __restrict dout,
+                                                     const float* __restrict inp, const float* __restrict out,
+                                                     const float* __restrict lse,
+                                                     int b, int h, int k0, int nk,
+                                                     int T, int C, int NH) {
+    // dkey and dvalue of nk keys starting at k0: each one is read by the queries t >= t2
+    int C3 = C*3;
+    int hs = C / NH; // head size
+    float scale = 1.f / sqrtf(hs);
+    float dkey[ATTN_BLOCK][ATTN_MAX_HS];
+    float dvalue[ATTN_BLOCK][ATTN_MAX_HS];
+    for (int jk = 0; jk < nk; jk++) {
+        for (int i = 0; i < hs; i++) { dkey[jk][i] = 0.0f; dvalue[jk][i] = 0.0f; }
+    }
+    for (int t = k0; t < T; t++) {
+        const float* query_t = inp + b * T * C3 + t * C3 + h * hs;
+        const float* out_bth = out + b * T * C + t * C + h * hs;
+        const float* dout_bth = dout + b * T * C + t * C + h * hs;
+        float lse_bth = lse[b*NH*T + h*T + t];
+        float D = 0.0f;
+        for (int i = 0; i < hs; i++) {
+            D += dout_bth[i] * out_bth[i];
+        }
+        // keys k0 .. t of this tile are visible to query t
+        int nvalid = t - k0 + 1 < nk ? t - k0 + 1 : nk;
+        for (int jk = 0; jk < nvalid; jk++) {
+            const float* key_t2 = inp + b * T * C3 + (k0 + jk) * C3 + h * hs + C; // +C because it's key
+            const float* value_t2 = inp + b * T * C3 + (k0 + jk) * C3 + h * hs + C*2; // +C*2 because it's value
+            float preatt = 0.0f;
+            float datt = 0.0f;
+            for (int i = 0; i < hs; i++) {
+                preatt += query_t[i] * key_t2[i];
+                datt += dout_bth[i] * value_t2[i];
+            }
+            float att = expf(preatt * scale - lse_bth);
+            float dpreatt = att * (datt - D) * scale;
+            for (int i = 0; i < hs; i++) {
+                dvalue[jk][i] += att * dout_bth[i];
+                dkey[jk][i] += query_t[i] * dpreatt;
+            }
+        }
+    }
+    for (int jk = 0; jk < nk; jk++) {
+        float* dkey_t2 = dinp + b * T * C3 + (k0 + jk) * C3 + h * hs + C;
+        float* dvalue_t2 = dinp + b * T * C3 + (k0 + jk) * C3 + h * hs + C*2;
+        for (int i = 0; i < hs; i++) {
+            dkey_t2[i] += dkey[jk][i];
+            dvalue_t2[i] += dvalue[jk][i];
+        }
+    }
+}
+
+void attention_backward_flash(float* dinp, float* dout, float* inp, float* out, float* lse,
+                              int B, int T, int C, int NH) {
+    // inp/dinp are (B, T, 3C) Q,K,V
+    // out/dout are (B, T, C), lse is (B, NH, T): only what attention_forward_flash kept
+    // the softmax is recomputed from the queries, keys and lse instead of being read
+    // back from (B, NH, T, T) buffers: with att = exp(query_t . key_t2 * scale - lse_t)
+    // and datt = dout_t . value_t2, the softmax backward is att * (datt - D_t), where
+    // D_t = sum_t2 att * datt = dout_t . out_t needs no pass over t2 of its own
+    assert(C / NH <= ATTN_MAX_HS);
+    int nthreads = 1;
+    #ifdef OMP
+    nthreads = omp_get_max_threads();
+#endif
+
+    // with enough (b,h) heads per thread, whole heads are the cheapest unit of work
+    if (nthreads == 1 || B * NH >= ATTN_HEADS_PER_THREAD * nthreads) {
+        #pragma omp parallel for collapse(2) schedule(static)
+        for (int b = 0; b < B; b++) {
+            for (int h = 0; h < NH; h++) {
+                attention_backward_flash_head(dinp, dout, inp, out, lse, b, h, T, C, NH);
+            }
+        }
+        return;
+    }
+
+    // otherwise split below the head: dquery is owned by the query rows and dkey/dvalue
+    // by the key rows, so one pass over query tiles and one over key tiles both write
+    // without races, for the price of recomputing att twice
+    int num_blocks = (T + ATTN_BLOCK - 1) / ATTN_BLOCK;
+    int num_pairs = attention_num_pairs(num_blocks);
+
+    #pragma omp parallel for collapse(3) schedule(static)
+    for (int b = 0; b < B; b++) {
+        for (int h = 0; h < NH; h++) {
+            for (int pair = 0; pair < num_pairs; pair++) {
+                for (int side = 0; side < 2; side++) {
+                    int qb = attention_pair_tile(pair, side, num_blocks);
+                    if (qb < 0) { continue; }
+                    int t0 = qb * ATTN_BLOCK;
+                    int nq = T - t0 < ATTN_BLOCK ? T - t0 : ATTN_BLOCK;
+                    attention_backward_flash_query_tile(dinp, dout, inp, out, lse, b, h, t0, nq, T, C, NH);
+                }
+            }
+        }
+    }
+
+    #pragma omp parallel for collapse(3) schedule(static)
+    for (int b = 0; b < B; b++) {
+        for (int h = 0; h < NH; h++) {
+            for (int pair = 0; pair < num_pairs; pair++) {
+                for (int side = 0; side < 2; side++) {
+                    int kb = attention_pair_tile(pair, side, num_blocks);
+                    if (kb < 0) { continue; }
+                    int k0 = kb * ATTN_BLOCK;
+                    int nk = T - k0 < ATTN_BLOCK ? T - k0 : ATTN_BLOCK;
+                    attention_backward_flash_key_tile(dinp, dout, inp, out, lse, b, h, k0, nk, T, C, NH);
+                }
+            }
+        }
+    }
+}
+
 void attention_backward_enzyme(float* out, float* preatt, float* dpreatt, float* att, float *datt, float* inp, float *dinp, int B, int T, int C, int NH) {
     float* d_out = (float*)calloc(B * T * C, sizeof(float));
     for (int b = 0; b < B; b++) {
@@ -788,6 +1230,34 @@ void attention_backward_enzyme_no_loops(float* out, float* preatt, float* dpreat
 }
 
 
+void attention_vjp_enzyme(float* dinp,
+                          float* dout, float* inp,
+                          int B, int T, int C, int NH) {
+    // preatt/att are internal to the layer here: scratch primals, and zeroed
+    // shadows that Enzyme uses to carry the gradient through the softmax
+    size_t att_size = (size_t)B * NH * T * T;
+    float* out = (float*)mallocCheck((size_t)B * T * C * sizeof(float));
+    float* preatt = (float*)mallocCheck(att_size * sizeof(float));
+    float* att = (float*)mallocCheck(att_size * sizeof(float));
+    float* dpreatt = (float*)calloc(att_size, sizeof(float));
+    float* datt = (float*)calloc(att_size, sizeof(float));
+    float* d_out = vjp_seed(dout, (size_t)B * T * C);
+    __enzyme_autodiff(
+        (void*)attention_forward,
+        enzyme_dup, out, d_out,
+        enzyme_dup, preatt, dpreatt,
+        enzyme_dup, att, datt,
+        enzyme_dup, inp, dinp,
+        enzyme_const, B,
+        enzyme_const, T, enzyme_const, C, enzyme_const, NH);
+    free(out);
+    free(preatt);
+    free(att);
+    free(dpreatt);
+    free(datt);
+    free(d_out);
+}
+
 
 void test_attention_backward_enzyme() {
     int T = 4;   // Sequence length
@@ -921,6 +1391,18 @@ void gelu_enzyme_backward(float *out, float *inp, float *dinp, int N) {
     free(d_out);
 }
 
+void gelu_vjp_enzyme(float* dinp, float* dout, float* inp, int N) {
+    float* out = (float*)mallocCheck((size_t)N * sizeof(float));
+    float* d_out = vjp_seed(dout, (size_t)N);
+    __enzyme_autodiff(
+        (void*)gelu_forward,
+        enzyme_dup, out, d_out,
+        enzyme_dup, inp, dinp,
+        enzyme_const, N);
+    free(out);
+    free(d_out);
+}
+
 void test_gelu_enzyme_backward(){
      int N = 5; // Example size
 
@@ -982,6 +1464,119 @@ void residual_backward(float* dinp1, float* dinp2, float* dout, int N) {
 }
 
 
+// lanes of the vectorized Welford pass of residual_layernorm_forward
+#define LN_WELFORD_LANES 16
+
+void residual_layernorm_forward(float*__restrict residual, float*__restrict out,
+                                float*__restrict mean, float*__restrict rstd,
+                                float*__restrict inp1, float*__restrict inp2,
+                                float*__restrict weight, float*__restrict bias,
+                                int B, int T, int C) {
+    // residual_forward followed by layernorm_forward of its output, in one pass:
+    // residual = inp1 + inp2 and out = layernorm(residual) are both (B,T,C),
+    // mean and rstd are (B,T) as in layernorm_forward.
+    // The mean and variance come from a single Welford pass over the sum as it is
+    // written, instead of separate passes for the add, the mean and the variance.
+    // Each of LN_WELFORD_LANES lanes runs the Welford recurrence over every
+    // LN_WELFORD_LANES-th channel, so the loop vectorizes, and the lanes are merged
+    // with the pairwise (Chan et al.) update at the end of the row
+    float eps = 1e-5f;
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            float* x1 = inp1 + b * T * C + t * C;
+            float* x2 = inp2 + b * T * C + t * C;
+            float* x = residual + b * T * C + t * C;
+            float lane_mean[LN_WELFORD_LANES] = {0.0f};
+            float lane_m2[LN_WELFORD_LANES] = {0.0f};
+            int steps = C / LN_WELFORD_LANES;
+            for (int k = 0; k < steps; k++) {
+                float inv_n = 1.0f / (k + 1);
+                for (int j = 0; j < LN_WELFORD_LANES; j++) {
+                    int i = k * LN_WELFORD_LANES + j;
+                    float xi = x1[i] + x2[i];
+                    x[i] = xi;
+                    float delta = xi - lane_mean[j];
+                    lane_mean[j] += delta * inv_n;
+                    lane_m2[j] += delta * (xi - lane_mean[j]);
+                }
+            }
+            // merge the lanes, each holding `steps` channels, then add the leftover channels
+            float n = 0.0f;
+            float m = 0.0f;
+            float m2 = 0.0f;
+            for (int j = 0; j < LN_WELFORD_LANES && steps > 0; j++) {
+                float n_new = n + steps;
+                float delta = lane_mean[j] - m;
+                m += delta * steps / n_new;
+                m2 += lane_m2[j] + delta * delta * n * steps / n_new;
+                n = n_new;
+            }
+            for (int i = steps * LN_WELFORD_LANES; i < C; i++) {
+                float xi = x1[i] + x2[i];
+                x[i] = xi;
+                n += 1.0f;
+                float delta = xi - m;
+                m += delta / n;
+                m2 += delta * (xi - m);
+            }
+            // the variance (without any bias correction), and the rstd
+            float s = 1.0f / sqrtf(m2 / C + eps);
+            // normalize, then scale and shift, while the row is still in L1
+            float* out_bt = out + b * T * C + t * C;
+            for (int i = 0; i < C; i++) {
+                float n_i = s * (x[i] - m);
+                out_bt[i] = n_i * weight[i] + bias[i];
+            }
+            mean[b * T + t] = m;
+            rstd[b * T + t] = s;
+        }
+    }
+}
+
+void residual_layernorm_backward(float* dinp1, float* dinp2, float* dweight, float* dbias,
+                                 float* dresidual, float* dout, float* residual, float* weight,
+                                 float* mean, float* rstd, int B, int T, int C) {
+    // backward of residual_layernorm_forward. The gradient of the residual sum is
+    // dresidual, from its other readers, plus the layernorm backward of dout, and it
+    // flows unchanged into both inputs, so residual_backward is folded into the row pass
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            float* dout_bt = dout + b * T * C + t * C;
+            float* x = residual + b * T * C + t * C;
+            float* dresidual_bt = dresidual + b * T * C + t * C;
+            float* dinp1_bt = dinp1 + b * T * C + t * C;
+            float* dinp2_bt = dinp2 + b * T * C + t * C;
+            float mean_bt = mean[b * T + t];
+            float rstd_bt = rstd[b * T + t];
+
+            // the two reductions of layernorm_backward
+            float dnorm_mean = 0.0f;
+            float dnorm_norm_mean = 0.0f;
+            for (int i = 0; i < C; i++) {
+                float norm_bti = (x[i] - mean_bt) * rstd_bt;
+                float dnorm_i = weight[i] * dout_bt[i];
+                dnorm_mean += dnorm_i;
+                dnorm_norm_mean += dnorm_i * norm_bti;
+            }
+            dnorm_mean = dnorm_mean / C;
+            dnorm_norm_mean = dnorm_norm_mean / C;
+
+            for (int i = 0; i < C; i++) {
+                float norm_bti = (x[i] - mean_bt) * rstd_bt;
+                float dnorm_i = weight[i] * dout_bt[i];
+                float dval = (dnorm_i - dnorm_mean - norm_bti * dnorm_norm_mean) * rstd_bt;
+                // gradient contribution to bias and weight
+                dbias[i] += dout_bt[i];
+                dweight[i] += norm_bti * dout_bt[i];
+                float dx = dresidual_bt[i] + dval;
+                dinp1_bt[i] += dx;
+                dinp2_bt[i] += dx;
+            }
+        }
+    }
+}
+
+
 void risidual_enzyme_backward(float *out, float *inp1, float *dinp1, float *inp2, float *dinp2, int N) {
     float* d_out = (float*)calloc(N, sizeof(float));
     for (int i = 0; i < N; i++) {
@@ -999,6 +1594,20 @@ void risidual_enzyme_backward(float *out, float *inp1, float *dinp1, float *inp2
     free(d_out);
 }
 
+void residual_vjp_enzyme(float* dinp1, float* dinp2, float* dout,
+                         float* inp1, float* inp2, int N) {
+    float* out = (float*)mallocCheck((size_t)N * sizeof(float));
+    float* d_out = vjp_seed(dout, (size_t)N);
+    __enzyme_autodiff(
+        (void*)residual_forward,
+        enzyme_dup, out, d_out,
+        enzyme_dup, inp1, dinp1,
+        enzyme_dup, inp2, dinp2,
+        enzyme_const, N);
+    free(out);
+    free(d_out);
+}
+
 void test_risidual_enzyme_backward() {
     int N = 5; // Example size
 
@@ -1088,6 +1697,8 @@ void softmax_forward(float* probs, float* logits, int B, int T, int V, int Vp) {
 }
 
 void softmax_backward_enzyme(float* probs, float* logits, float* d_logits, int B, int T, int V, int Vp) {
+    // only meant for checking at toy sizes (see test_softmax_enzyme): d_logits is
+    // B*T*Vp*Vp floats, use crossentropy_softmax_backward_enzyme for the loss head
     // Zero-initialize gradients for logits
     // returns jacobian marix of partial softmax / partial logits (d_logtis, size Vp * Vp)
 
@@ -1129,6 +1740,20 @@ void softmax_backward_enzyme(float* probs, float* logits, float* d_logits, int B
     free(temp_d_logits);
 }
 
+void softmax_vjp_enzyme(float* dlogits, float* dprobs, float* logits,
+                        int B, int T, int V, int Vp) {
+    float* probs = (float*)mallocCheck((size_t)B * T * Vp * sizeof(float));
+    float* d_probs = vjp_seed(dprobs, (size_t)B * T * Vp);
+    __enzyme_autodiff(
+        (void*)softmax_forward,
+        enzyme_dup, probs, d_probs,
+        enzyme_dup, logits, dlogits,
+        enzyme_const, B,
+        enzyme_const, T, enzyme_const, V, enzyme_const, Vp);
+    free(probs);
+    free(d_probs);
+}
+
 
 void test_softmax_enzyme() {
     const int B = 1, T = 1, Vp = 4, V = 4;
@@ -1288,6 +1913,20 @@ void crossentropy_backward_enzyme_no_loops(float* probs, float* d_probs,
 }
 
 
+void crossentropy_vjp_enzyme(float* dprobs, float* dlosses, float* probs, int* targets,
+                             int B, int T, int Vp) {
+    float* losses = (float*)mallocCheck((size_t)B * T * sizeof(float));
+    float* d_losses = vjp_seed(dlosses, (size_t)B * T);
+    __enzyme_autodiff(
+        (void*)crossentropy_forward,
+        enzyme_dup, losses, d_losses,
+        enzyme_dup, probs, dprobs,
+        enzyme_const, targets,
+        enzyme_const, B, enzyme_const, T, enzyme_const, Vp);
+    free(losses);
+    free(d_losses);
+}
+
 
 // void test_crossentropy_enzyme() {
 //     const int B = 1, T = 1, Vp = 4;
@@ -1345,35 +1984,47 @@ void crossentropy_backward_enzyme_no_loops(float* probs, float* d_probs,
 //     check_gradients(numerical_gradients, d_probs, B * T * Vp, EPSILON, TOLERANCE);
 //     printf("\n");
 // }
+void softmax_crossentropy_forward(float* losses, float* probs, float* logits, int* targets,
+                                  int B, int T, int V, int Vp) {
+    // the loss head as one function: logits -> probs -> losses
+    softmax_forward(probs, logits, B, T, V, Vp);
+    crossentropy_forward(losses, probs, targets, B, T, Vp);
+}
+
 void crossentropy_softmax_backward_enzyme(float* dlogits,
                                           float* dlosses,
-                                          float* probs,
+                                          float* logits,
                                           int* targets,
                                           int B, int T, int V, int Vp) {
-    // Allocate memory for intermediate gradients
-    float* d_probs = (float*)calloc(B * T * Vp, sizeof(float));
-
-    // Backprop through cross-entropy to compute d_probs
-    crossentropy_backward_enzyme(probs, d_probs, dlosses, targets, B, T, Vp);
-
-    // Backprop through softmax to compute dlogits
-    softmax_backward_enzyme(probs, probs, dlogits, B, T, V, Vp);
-
-    // Accumulate gradients from d_probs into dlogits
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            for (int v = 0; v < Vp; v++) {
-                dlogits[b * T * Vp + t * Vp + v] += d_probs[b * T * Vp + t * Vp + v];
-            }
-        }
-    }
-
-    // Free allocated memory
+    // backwards through both softmax and crossentropy with a single Enzyme call
+    // on the fused forward. The upstream dlosses is pulled back through probs
+    // into dlogits directly, so only (B,T,Vp)-sized buffers are ever touched,
+    // never the (Vp,Vp) softmax Jacobian that softmax_backward_enzyme builds.
+    // note this takes the logits, not the probs: the softmax is re-run here
+    size_t n = (size_t)B * T * Vp;
+    float* probs = (float*)mallocCheck(n * sizeof(float));
+    float* d_probs = (float*)calloc(n, sizeof(float));
+    float* losses = (float*)mallocCheck((size_t)B * T * sizeof(float));
+    float* d_losses = vjp_seed(dlosses, (size_t)B * T);
+    __enzyme_autodiff(
+        (void*)softmax_crossentropy_forward,
+        enzyme_dup, losses, d_losses,
+        enzyme_dup, probs, d_probs,
+        enzyme_dup, logits, dlogits,
+        enzyme_const, targets,
+        enzyme_const, B, enzyme_const, T, enzyme_const, V, enzyme_const, Vp);
+    free(probs);
     free(d_probs);
+    free(losses);
+    free(d_losses);
 }
 
 
 
+void crossentropy_softmax_backward(float* dlogits,
+                           float* dlosses, float* probs, int* targets,
+                           int B, int T, int V, int Vp);
+
 void test_crossentropy_softmax_backward_enzyme() {
     const int B = 1, T = 1, V = 3, Vp = 3; // Batch size, time steps, vocab size
     float logits[Vp] = {2.0f, 1.0f, 0.1f}; // Example logits
@@ -1384,10 +2035,12 @@ void test_crossentropy_softmax_backward_enzyme() {
     float dlosses[1] = {1.0f}; // Gradient of loss (dL/dloss)
 
     float dlogits[Vp] = {0.0}; // Output storage
+    float dlogits_ref[Vp] = {0.0}; // hand-written reference
     for (int i = 0; i < Vp; i++) dlogits[i] = 0.0f;
 
     // Run backward pass
-    crossentropy_softmax_backward_enzyme(dlogits, dlosses, probs, targets, B, T, V, Vp);
+    crossentropy_softmax_backward_enzyme(dlogits, dlosses, logits, targets, B, T, V, Vp);
+    crossentropy_softmax_backward(dlogits_ref, dlosses, probs, targets, B, T, V, Vp);
 
     // Print results
     printf("Softmax probabilities:\n");
@@ -1397,7 +2050,7 @@ void test_crossentropy_softmax_backward_enzyme() {
 
     printf("\nGradients of logits (dlogits):\n");
     for (int i = 0; i < Vp; i++) {
-        printf("dlogits[%d] = %.6f\n", i, dlogits[i]);
+        printf("dlogits[%d] = %.6f (expected %.6f)\n", i, dlogits[i], dlogits_ref[i]);
     }
 
 }
@@ -1423,6 +2076,335 @@ void crossentropy_softmax_backward(float* dlogits,
     }
 }
 
+float max_abs_diff(const float* a, const float* b, size_t n) {
+    float maxdiff = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        float d = fabsf(a[i] - b[i]);
+        if (d > maxdiff) { maxdiff = d; }
+    }
+    return maxdiff;
+}
+
+float* rand_tensor(size_t n, unsigned int seed) {
+    // deterministic pseudo-random values in [-1, 1)
+    float* x = (float*)mallocCheck(n * sizeof(float));
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        x[i] = (seed >> 8) / 8388608.0f - 1.0f;
+    }
+    return x;
+}
+
+// ----------------------------------------------------------------------------
+// directional gradient checks
+// Checking a backward kernel element by element costs one forward per input
+// element. Instead, for a random output cotangent u and a random input tangent v,
+// the backward kernel gives g = J^T u and a single __enzyme_fwddiff call gives
+// w = J v, and the two must agree on <g, v> = <u, w>. A wrong element of g shows
+// up with probability ~1 for random v, so a few directions per kernel are enough,
+// and each costs one forward and one backward, at any shape.
+// Tangents of outputs the backward kernels never read (layernorm mean/rstd,
+// attention preatt/att, probs) are computed but get a zero cotangent.
+
+typedef struct {
+    const char* name;
+    int directions;
+    int failed;
+    double max_rel_err;
+} GradCheck;
+
+double dot_f64(const float* a, const float* b, size_t n) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++) { sum += (double)a[i] * b[i]; }
+    return sum;
+}
+
+void gradcheck_add(GradCheck* gc, double vjp_dot, double jvp_dot) {
+    double scale = fmax(fmax(fabs(vjp_dot), fabs(jvp_dot)), 1e-6);
+    double rel_err = fabs(vjp_dot - jvp_dot) / scale;
+    if (rel_err > gc->max_rel_err) { gc->max_rel_err = rel_err; }
+    if (rel_err > TOLERANCE) { gc->failed++; }
+    gc->directions++;
+}
+
+void gradcheck_report(const GradCheck* gc) {
+    printf("%-22s %s  %d/%d directions failed, max rel err %.3e\n",
+           gc->name, gc->failed ? "FAIL" : "ok  ", gc->failed, gc->directions, gc->max_rel_err);
+}
+
+// the checks below use the hand-written backward kernel, or the single-call
+// Enzyme VJP when enzyme_vjp is set
+
+GradCheck jvp_check_encoder(int B, int T, int C, int V, int directions, int enzyme_vjp) {
+    GradCheck gc = {enzyme_vjp ? "encoder (enzyme vjp)" : "encoder", 0, 0, 0.0};
+    size_t n_out = (size_t)B * T * C, n_wte = (size_t)V * C, n_wpe = (size_t)T * C;
+    int* tokens = (int*)mallocCheck((size_t)B * T * sizeof(int));
+    for (int i = 0; i < B * T; i++) { tokens[i] = (i * 7919) % V; }
+    float* wte = rand_tensor(n_wte, 11);
+    float* wpe = rand_tensor(n_wpe, 12);
+    float* out = (float*)mallocCheck(n_out * sizeof(float));
+    float* w = (float*)mallocCheck(n_out * sizeof(float));
+    float* dwte = (float*)mallocCheck(n_wte * sizeof(float));
+    float* dwpe = (float*)mallocCheck(n_wpe * sizeof(float));
+    for (int d = 0; d < directions; d++) {
+        float* u = rand_tensor(n_out, 100 + d);
+        float* vwte = rand_tensor(n_wte, 200 + d);
+        float* vwpe = rand_tensor(n_wpe, 300 + d);
+        __enzyme_fwddiff((void*)encoder_forward,
+                         enzyme_dup, out, w, enzyme_const, tokens,
+                         enzyme_dup, wte, vwte, enzyme_dup, wpe, vwpe,
+                         enzyme_const, B, enzyme_const, T, enzyme_const, C);
+        memset(dwte, 0, n_wte * sizeof(float));
+        memset(dwpe, 0, n_wpe * sizeof(float));
+        if (enzyme_vjp) { encoder_vjp_enzyme(dwte, dwpe, u, tokens, wte, wpe, B, T, C); }
+        else { encoder_backward(dwte, dwpe, u, tokens, B, T, C); }
+        gradcheck_add(&gc, dot_f64(dwte, vwte, n_wte) + dot_f64(dwpe, vwpe, n_wpe), dot_f64(u, w, n_out));
+        free(u); free(vwte); free(vwpe);
+    }
+    free(tokens); free(wte); free(wpe); free(out); free(w); free(dwte); free(dwpe);
+    return gc;
+}
+
+GradCheck jvp_check_layernorm(int B, int T, int C, int directions, int enzyme_vjp) {
+    GradCheck gc = {enzyme_vjp ? "layernorm (enzyme vjp)" : "layernorm", 0, 0, 0.0};
+    size_t n = (size_t)B * T * C, BT = (size_t)B * T;
+    float* inp = rand_tensor(n, 21);
+    float* weight = rand_tensor(C, 22);
+    float* bias = rand_tensor(C, 23);
+    float* out = (float*)mallocCheck(n * sizeof(float));
+    float* w = (float*)mallocCheck(n * sizeof(float));
+    float* mean = (float*)mallocCheck(BT * sizeof(float));
+    float* rstd = (float*)mallocCheck(BT * sizeof(float));
+    float* wmean = (float*)mallocCheck(BT * sizeof(float));
+    float* wrstd = (float*)mallocCheck(BT * sizeof(float));
+    float* dinp = (float*)mallocCheck(n * sizeof(float));
+    float* dweight = (float*)mallocCheck(C * sizeof(float));
+    float* dbias = (float*)mallocCheck(C * sizeof(float));
+    for (int d = 0; d < directions; d++) {
+        float* u = rand_tensor(n, 100 + d);
+        float* vinp = rand_tensor(n, 200 + d);
+        float* vweight = rand_tensor(C, 300 + d);
+        float* vbias = rand_tensor(C, 400 + d);
+        __enzyme_fwddiff((void*)layernorm_forward,
+                         enzyme_dup, out, w, enzyme_dup, mean, wmean, enzyme_dup, rstd, wrstd,
+                         enzyme_dup, inp, vinp, enzyme_dup, weight, vweight, enzyme_dup, bias, vbias,
+                         enzyme_const, B, enzyme_const, T, enzyme_const, C);
+        memset(dinp, 0, n * sizeof(float));
+        memset(dweight, 0, C * sizeof(float));
+        memset(dbias, 0, C * sizeof(float));
+        if (enzyme_vjp) { layernorm_vjp_enzyme(dinp, dweight, dbias, u, inp, weight, bias, B, T, C); }
+        else { layernorm_backward(dinp, dweight, dbias, u, inp, weight, mean, rstd, B, T, C); }
+        gradcheck_add(&gc, dot_f64(dinp, vinp, n) + dot_f64(dweight, vweight, C) + dot_f64(dbias, vbias, C),
+                      dot_f64(u, w, n));
+        free(u); free(vinp); free(vweight); free(vbias);
+    }
+    free(inp); free(weight); free(bias); free(out); free(w); free(mean); free(rstd);
+    free(wmean); free(wrstd); free(dinp); free(dweight); free(dbias);
+    return gc;
+}
+
+GradCheck jvp_check_matmul(int B, int T, int C, int OC, int directions, int enzyme_vjp) {
+    GradCheck gc = {enzyme_vjp ? "matmul (enzyme vjp)" : "matmul", 0, 0, 0.0};
+    size_t n_inp = (size_t)B * T * C, n_w = (size_t)OC * C, n_out = (size_t)B * T * OC;
+    float* inp = rand_tensor(n_inp, 31);
+    float* weight = rand_tensor(n_w, 32);
+    float* bias = rand_tensor(OC, 33);
+    float* out = (float*)mallocCheck(n_out * sizeof(float));
+    float* w = (float*)mallocCheck(n_out * sizeof(float));
+    float* dinp = (float*)mallocCheck(n_inp * sizeof(float));
+    float* dweight = (float*)mallocCheck(n_w * sizeof(float));
+    float* dbias = (float*)mallocCheck(OC * sizeof(float));
+    for (int d = 0; d < directions; d++) {
+        float* u = rand_tensor(n_out, 100 + d);
+        float* vinp = rand_tensor(n_inp, 200 + d);
+        float* vweight = rand_tensor(n_w, 300 + d);
+        float* vbias = rand_tensor(OC, 400 + d);
+        __enzyme_fwddiff((void*)matmul_forward,
+                         enzyme_dup, out, w, enzyme_dup, inp, vinp,
+                         enzyme_dup, weight, vweight, enzyme_dup, bias, vbias,
+                         enzyme_const, B, enzyme_const, T, enzyme_const, C, enzyme_const, OC);
+        memset(dinp, 0, n_inp * sizeof(float));
+        memset(dweight, 0, n_w * sizeof(float));
+        memset(dbias, 0, OC * sizeof(float));
+        if (enzyme_vjp) { matmul_vjp_enzyme(dinp, dweight, dbias, u, inp, weight, bias, B, T, C, OC); }
+        else { matmul_backward(dinp, dweight, dbias, u, inp, weight, B, T, C, OC); }
+        gradcheck_add(&gc, dot_f64(dinp, vinp, n_inp) + dot_f64(dweight, vweight, n_w) + dot_f64(dbias, vbias, OC),
+                      dot_f64(u, w, n_out));
+        free(u); free(vinp); free(vweight); free(vbias);
+    }
+    free(inp); free(weight); free(bias); free(out); free(w); free(dinp); free(dweight); free(dbias);
+    return gc;
+}
+
+GradCheck jvp_check_attention(int B, int T, int C, int NH, int directions, int enzyme_vjp) {
+    GradCheck gc = {enzyme_vjp ? "attention (enzyme vjp)" : "attention", 0, 0, 0.0};
+    size_t n_inp = (size_t)B * T * 3 * C, n_out = (size_t)B * T * C, n_att = (size_t)B * NH * T * T;
+    float* inp = rand_tensor(n_inp, 41);
+    float* out = (float*)mallocCheck(n_out * sizeof(float));
+    float* w = (float*)mallocCheck(n_out * sizeof(float));
+    float* preatt = (float*)mallocCheck(n_att * sizeof(float));
+    float* att = (float*)mallocCheck(n_att * sizeof(float));
+    float* wpreatt = (float*)mallocCheck(n_att * sizeof(float));
+    float* watt = (float*)mallocCheck(n_att * sizeof(float));
+    float* dinp = (float*)mallocCheck(n_inp * sizeof(float));
+    float* dpreatt = (float*)mallocCheck(n_att * sizeof(float));
+    float* datt = (float*)mallocCheck(n_att * sizeof(float));
+    for (int d = 0; d < directions; d++) {
+        float* u = rand_tensor(n_out, 100 + d);
+        float* vinp = rand_tensor(n_inp, 200 + d);
+        __enzyme_fwddiff((void*)attention_forward,
+                         enzyme_dup, out, w, enzyme_dup, preatt, wpreatt, enzyme_dup, att, watt,
+                         enzyme_dup, inp, vinp,
+                         enzyme_const, B, enzyme_const, T, enzyme_const, C, enzyme_const, NH);
+        memset(dinp, 0, n_inp * sizeof(float));
+        if (enzyme_vjp) {
+            attention_vjp_enzyme(dinp, u, inp, B, T, C, NH);
+        } else {
+            memset(dpreatt, 0, n_att * sizeof(float));
+            memset(datt, 0, n_att * sizeof(float));
+            attention_backward(dinp, dpreatt, datt, u, inp, att, B, T, C, NH);
+        }
+        gradcheck_add(&gc, dot_f64(dinp, vinp, n_inp), dot_f64(u, w, n_out));
+        free(u); free(vinp);
+    }
+    free(inp); free(out); free(w); free(preatt); free(att); free(wpreatt); free(watt);
+    free(dinp); free(dpreatt); free(datt);
+    return gc;
+}
+
+GradCheck jvp_check_gelu(int N, int directions, int enzyme_vjp) {
+    GradCheck gc = {enzyme_vjp ? "gelu (enzyme vjp)" : "gelu", 0, 0, 0.0};
+    float* inp = rand_tensor(N, 51);
+    float* out = (float*)mallocCheck((size_t)N * sizeof(float));
+    float* w = (float*)mallocCheck((size_t)N * sizeof(float));
+    float* dinp = (float*)mallocCheck((size_t)N * sizeof(float));
+    for (int d = 0; d < directions; d++) {
+        float* u = rand_tensor(N, 100 + d);
+        float* vinp = rand_tensor(N, 200 + d);
+        __enzyme_fwddiff((void*)gelu_forward, enzyme_dup, out, w, enzyme_dup, inp, vinp, enzyme_const, N);
+        memset(dinp, 0, (size_t)N * sizeof(float));
+        if (enzyme_vjp) { gelu_vjp_enzyme(dinp, u, inp, N); }
+        else { gelu_backward(dinp, inp, u, N); }
+        gradcheck_add(&gc, dot_f64(dinp, vinp, N), dot_f64(u, w, N));
+        free(u); free(vinp);
+    }
+    free(inp); free(out); free(w); free(dinp);
+    return gc;
+}
+
+GradCheck jvp_check_residual(int N, int directions, int enzyme_vjp) {
+    GradCheck gc = {enzyme_vjp ? "residual (enzyme vjp)" : "residual", 0, 0, 0.0};
+    float* inp1 = rand_tensor(N, 61);
+    float* inp2 = rand_tensor(N, 62);
+    float* out = (float*)mallocCheck((size_t)N * sizeof(float));
+    float* w = (float*)mallocCheck((size_t)N * sizeof(float));
+    float* dinp1 = (float*)mallocCheck((size_t)N * sizeof(float));
+    float* dinp2 = (float*)mallocCheck((size_t)N * sizeof(float));
+    for (int d = 0; d < directions; d++) {
+        float* u = rand_tensor(N, 100 + d);
+        float* vinp1 = rand_tensor(N, 200 + d);
+        float* vinp2 = rand_tensor(N, 300 + d);
+        __enzyme_fwddiff((void*)residual_forward, enzyme_dup, out, w,
+                         enzyme_dup, inp1, vinp1, enzyme_dup, inp2, vinp2, enzyme_const, N);
+        memset(dinp1, 0, (size_t)N * sizeof(float));
+        memset(dinp2, 0, (size_t)N * sizeof(float));
+        if (enzyme_vjp) { residual_vjp_enzyme(dinp1, dinp2, u, inp1, inp2, N); }
+        else { residual_backward(dinp1, dinp2, u, N); }
+        gradcheck_add(&gc, dot_f64(dinp1, vinp1, N) + dot_f64(dinp2, vinp2, N), dot_f64(u, w, N));
+        free(u); free(vinp1); free(vinp2);
+    }
+    free(inp1); free(inp2); free(out); free(w); free(dinp1); free(dinp2);
+    return gc;
+}
+
+GradCheck jvp_check_softmax_crossentropy(int B, int T, int V, int Vp, int directions, int enzyme_vjp) {
+    GradCheck gc = {enzyme_vjp ? "softmax+ce (enzyme vjp)" : "softmax+ce", 0, 0, 0.0};
+    size_t n = (size_t)B * T * Vp, BT = (size_t)B * T;
+    int* targets = (int*)mallocCheck(BT * sizeof(int));
+    for (size_t i = 0; i < BT; i++) { targets[i] = (int)((i * 7919) % V); }
+    float* logits = rand_tensor(n, 71);
+    float* probs = (float*)mallocCheck(n * sizeof(float));
+    float* wprobs = (float*)mallocCheck(n * sizeof(float));
+    float* losses = (float*)mallocCheck(BT * sizeof(float));
+    float* w = (float*)mallocCheck(BT * sizeof(float));
+    float* dlogits = (float*)mallocCheck(n * sizeof(float));
+    for (int d = 0; d < directions; d++) {
+        float* u = rand_tensor(BT, 100 + d);
+        float* vlogits = rand_tensor(n, 200 + d);
+        __enzyme_fwddiff((void*)softmax_crossentropy_forward,
+                         enzyme_dup, losses, w, enzyme_dup, probs, wprobs, enzyme_dup, logits, vlogits,
+                         enzyme_const, targets,
+                         enzyme_const, B, enzyme_const, T, enzyme_const, V, enzyme_const, Vp);
+        memset(dlogits, 0, n * sizeof(float));
+        if (enzyme_vjp) { crossentropy_softmax_backward_enzyme(dlogits, u, logits, targets, B, T, V, Vp); }
+        else { crossentropy_softmax_backward(dlogits, u, probs, targets, B, T, V, Vp); }
+        gradcheck_add(&gc, dot_f64(dlogits, vlogits, n), dot_f64(u, w, BT));
+        free(u); free(vlogits);
+    }
+    free(targets); free(logits); free(probs); free(wprobs); free(losses); free(w); free(dlogits);
+    return gc;
+}
+
+GradCheck jvp_check_softmax_crossentropy_chained(int B, int T, int V, int Vp, int directions) {
+    // the separate softmax and crossentropy Enzyme VJPs, chained through dprobs
+    GradCheck gc = {"softmax+ce (chained vjps)", 0, 0, 0.0};
+    size_t n = (size_t)B * T * Vp, BT = (size_t)B * T;
+    int* targets = (int*)mallocCheck(BT * sizeof(int));
+    for (size_t i = 0; i < BT; i++) { targets[i] = (int)((i * 7919) % V); }
+    float* logits = rand_tensor(n, 71);
+    float* probs = (float*)mallocCheck(n * sizeof(float));
+    float* wprobs = (float*)mallocCheck(n * sizeof(float));
+    float* losses = (float*)mallocCheck(BT * sizeof(float));
+    float* w = (float*)mallocCheck(BT * sizeof(float));
+    float* dprobs = (float*)mallocCheck(n * sizeof(float));
+    float* dlogits = (float*)mallocCheck(n * sizeof(float));
+    for (int d = 0; d < directions; d++) {
+        float* u = rand_tensor(BT, 100 + d);
+        float* vlogits = rand_tensor(n, 200 + d);
+        __enzyme_fwddiff((void*)softmax_crossentropy_forward,
+                         enzyme_dup, losses, w, enzyme_dup, probs, wprobs, enzyme_dup, logits, vlogits,
+                         enzyme_const, targets,
+                         enzyme_const, B, enzyme_const, T, enzyme_const, V, enzyme_const, Vp);
+        memset(dprobs, 0, n * sizeof(float));
+        memset(dlogits, 0, n * sizeof(float));
+        crossentropy_vjp_enzyme(dprobs, u, probs, targets, B, T, Vp);
+        softmax_vjp_enzyme(dlogits, dprobs, logits, B, T, V, Vp);
+        gradcheck_add(&gc, dot_f64(dlogits, vlogits, n), dot_f64(u, w, BT));
+        free(u); free(vlogits);
+    }
+    free(targets); free(logits); free(probs); free(wprobs); free(losses); free(w);
+    free(dprobs); free(dlogits);
+    return gc;
+}
+
+int test_gradients_jvp(int B, int T, int C, int NH, int V, int Vp, int directions) {
+    // every layer's backward, hand-written and Enzyme VJP, at the given shape.
+    // returns the number of kernels that failed
+    printf("directional gradient check: B=%d T=%d C=%d NH=%d V=%d Vp=%d, %d directions, rel tol %.1e\n",
+           B, T, C, NH, V, Vp, directions, TOLERANCE);
+    int num_failed = 0;
+    for (int enzyme_vjp = 0; enzyme_vjp <= 1; enzyme_vjp++) {
+        GradCheck checks[] = {
+            jvp_check_encoder(B, T, C, V, directions, enzyme_vjp),
+            jvp_check_layernorm(B, T, C, directions, enzyme_vjp),
+            jvp_check_matmul(B, T, C, 3 * C, directions, enzyme_vjp),
+            jvp_check_attention(B, T, C, NH, directions, enzyme_vjp),
+            jvp_check_gelu(B * T * 4 * C, directions, enzyme_vjp),
+            jvp_check_residual(B * T * C, directions, enzyme_vjp),
+            jvp_check_softmax_crossentropy(B, T, V, Vp, directions, enzyme_vjp),
+        };
+        for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+            gradcheck_report(&checks[i]);
+            if (checks[i].failed) { num_failed++; }
+        }
+    }
+    GradCheck chained = jvp_check_softmax_crossentropy_chained(B, T, V, Vp, directions);
+    gradcheck_report(&chained);
+    if (chained.failed) { num_failed++; }
+    printf("directional gradient check: %d kernel(s) failed\n", num_failed);
+    return num_failed;
+}
+
 // ----------------------------------------------------------------------------
 // GPT-2 model definition
 
@@ -1837,7 +2819,7 @@ void gpt2_backward(GPT2 *model) {
     float dloss_mean = 1.0f / (B*T);
     for (int i = 0; i < B*T; i++) { grads_acts.losses[i] = dloss_mean; }
     
-    crossentropy_backward_enzyme(acts.probs, grads_acts.logits, grads_acts.losses, model->targets, B, T, Vp);
+    crossentropy_softmax_backward_enzyme(grads_acts.logits, grads_acts.losses, acts.logits, model->targets, B, T, V, Vp);
     // crossentropy_softmax_backward(grads_acts.logits, grads_acts.losses, acts.probs, model->targets, B, T, V, Vp);
     matmul_backward(grads_acts.lnf, grads.wte, NULL, grads_acts.logits, acts.lnf, params.wte, B, T, C, Vp);
     float* residual = acts.residual3 + (L-1) * B * T * C; // last layer's residual
@@ -2291,6 +3273,92 @@ static void BM_attention_forward_scaled(benchmark::State& state) {
     free(out);
 }
 
+// fused attention forward against attention_forward at the same shape: parity of the
+// output and of the logsumexp (computed from att as preatt - log(att) on the diagonal),
+// and the activation bytes each one keeps for backward
+static void BM_attention_forward_flash_scaled(benchmark::State& state) {
+    int B = state.range(0);
+    int T = state.range(1);
+    int C = state.range(2);
+    int NH = state.range(3);
+    size_t att_size = (size_t)B * NH * T * T;
+    float* inp = rand_tensor((size_t)B * T * 3 * C, 121);
+    float* out = (float*)calloc((size_t)B * T * C, sizeof(float));
+    float* lse = (float*)calloc((size_t)B * NH * T, sizeof(float));
+    float* out_ref = (float*)calloc((size_t)B * T * C, sizeof(float));
+    float* preatt = (float*)calloc(att_size, sizeof(float));
+    float* att = (float*)calloc(att_size, sizeof(float));
+
+    attention_forward_flash(out, lse, inp, B, T, C, NH);
+    attention_forward(out_ref, preatt, att, inp, B, T, C, NH);
+    float lse_err = 0.0f;
+    for (size_t bh = 0; bh < (size_t)B * NH; bh++) {
+        for (int t = 0; t < T; t++) {
+            size_t diag = bh * T * T + (size_t)t * T + t;
+            float err = fabsf(lse[bh * T + t] - (preatt[diag] - logf(att[diag])));
+            if (err > lse_err) { lse_err = err; }
+        }
+    }
+    free(preatt);
+    free(att);
+    state.counters["parity_err"] = max_abs_diff(out, out_ref, (size_t)B * T * C);
+    state.counters["lse_err"] = lse_err;
+    state.counters["saved_bytes"] = benchmark::Counter((double)B * NH * T * sizeof(float),
+                                                      benchmark::Counter::kDefaults, benchmark::Counter::OneK::kIs1024);
+    state.counters["saved_bytes_ref"] = benchmark::Counter(2.0 * att_size * sizeof(float),
+                                                          benchmark::Counter::kDefaults, benchmark::Counter::OneK::kIs1024);
+
+    for (auto _ : state) {
+        attention_forward_flash(out, lse, inp, B, T, C, NH);
+        benchmark::DoNotOptimize(out);
+    }
+    free(inp);
+    free(out);
+    free(lse);
+    free(out_ref);
+}
+
+// recompute-based attention backward against attention_backward on the saved att
+static void BM_attention_backward_flash_scaled(benchmark::State& state) {
+    int B = state.range(0);
+    int T = state.range(1);
+    int C = state.range(2);
+    int NH = state.range(3);
+    size_t att_size = (size_t)B * NH * T * T;
+    size_t inp_size = (size_t)B * T * 3 * C;
+    float* inp = rand_tensor(inp_size, 131);
+    float* dout = rand_tensor((size_t)B * T * C, 132);
+    float* out = (float*)calloc((size_t)B * T * C, sizeof(float));
+    float* lse = (float*)calloc((size_t)B * NH * T, sizeof(float));
+    float* dinp = (float*)calloc(inp_size, sizeof(float));
+    float* dinp_ref = (float*)calloc(inp_size, sizeof(float));
+    float* preatt = (float*)calloc(att_size, sizeof(float));
+    float* att = (float*)calloc(att_size, sizeof(float));
+    float* dpreatt = (float*)calloc(att_size, sizeof(float));
+    float* datt = (float*)calloc(att_size, sizeof(float));
+
+    attention_forward(out, preatt, att, inp, B, T, C, NH);
+    attention_backward(dinp_ref, dpreatt, datt, dout, inp, att, B, T, C, NH);
+    attention_forward_flash(out, lse, inp, B, T, C, NH);
+    attention_backward_flash(dinp, dout, inp, out, lse, B, T, C, NH);
+    state.counters["parity_err"] = max_abs_diff(dinp, dinp_ref, inp_size);
+    free(preatt);
+    free(att);
+    free(dpreatt);
+    free(datt);
+
+    for (auto _ : state) {
+        attention_backward_flash(dinp, dout, inp, out, lse, B, T, C, NH);
+        benchmark::DoNotOptimize(dinp);
+    }
+    free(inp);
+    free(dout);
+    free(out);
+    free(lse);
+    free(dinp);
+    free(dinp_ref);
+}
+
 // LAYER NORM
 
 static void BM_layernorm_forward_scaled(benchmark::State& state) {
@@ -2374,6 +3442,140 @@ static void BM_layernorm_backward_enzyme_scaled(benchmark::State& state) {
 }
 
 
+// fused residual + layernorm against residual_forward then layernorm_forward
+static void BM_residual_layernorm_forward_scaled(benchmark::State& state) {
+    int B = state.range(0);
+    int T = state.range(1);
+    int C = state.range(2);
+    size_t n = (size_t)B * T * C;
+    float* inp1 = rand_tensor(n, 141);
+    float* inp2 = rand_tensor(n, 142);
+    float* weight = rand_tensor(C, 143);
+    float* bias = rand_tensor(C, 144);
+    float* residual = (float*)calloc(n, sizeof(float));
+    float* out = (float*)calloc(n, sizeof(float));
+    float* mean = (float*)calloc((size_t)B * T, sizeof(float));
+    float* rstd = (float*)calloc((size_t)B * T, sizeof(float));
+    float* residual_ref = (float*)calloc(n, sizeof(float));
+    float* out_ref = (float*)calloc(n, sizeof(float));
+
+    residual_layernorm_forward(residual, out, mean, rstd, inp1, inp2, weight, bias, B, T, C);
+    residual_forward(residual_ref, inp1, inp2, (int)n);
+    layernorm_forward(out_ref, mean, rstd, residual_ref, weight, bias, B, T, C);
+    state.counters["parity_err"] = max_abs_diff(out, out_ref, n);
+
+    for (auto _ : state) {
+        residual_layernorm_forward(residual, out, mean, rstd, inp1, inp2, weight, bias, B, T, C);
+        benchmark::DoNotOptimize(residual);
+        benchmark::DoNotOptimize(out);
+    }
+    free(inp1);
+    free(inp2);
+    free(weight);
+    free(bias);
+    free(residual);
+    free(out);
+    free(mean);
+    free(rstd);
+    free(residual_ref);
+    free(out_ref);
+}
+
+// the unfused pair that residual_layernorm_forward replaces
+static void BM_residual_layernorm_forward_unfused_scaled(benchmark::State& state) {
+    int B = state.range(0);
+    int T = state.range(1);
+    int C = state.range(2);
+    size_t n = (size_t)B * T * C;
+    float* inp1 = rand_tensor(n, 141);
+    float* inp2 = rand_tensor(n, 142);
+    float* weight = rand_tensor(C, 143);
+    float* bias = rand_tensor(C, 144);
+    float* residual = (float*)calloc(n, sizeof(float));
+    float* out = (float*)calloc(n, sizeof(float));
+    float* mean = (float*)calloc((size_t)B * T, sizeof(float));
+    float* rstd = (float*)calloc((size_t)B * T, sizeof(float));
+
+    for (auto _ : state) {
+        residual_forward(residual, inp1, inp2, (int)n);
+        layernorm_forward(out, mean, rstd, residual, weight, bias, B, T, C);
+        benchmark::DoNotOptimize(residual);
+        benchmark::DoNotOptimize(out);
+    }
+    free(inp1);
+    free(inp2);
+    free(weight);
+    free(bias);
+    free(residual);
+    free(out);
+    free(mean);
+    free(rstd);
+}
+
+// fused backward against layernorm_backward then residual_backward
+static void BM_residual_layernorm_backward_scaled(benchmark::State& state) {
+    int B = state.range(0);
+    int T = state.range(1);
+    int C = state.range(2);
+    size_t n = (size_t)B * T * C;
+    float* inp1 = rand_tensor(n, 151);
+    float* inp2 = rand_tensor(n, 152);
+    float* weight = rand_tensor(C, 153);
+    float* bias = rand_tensor(C, 154);
+    float* dout = rand_tensor(n, 155);
+    float* dresidual = rand_tensor(n, 156);
+    float* residual = (float*)calloc(n, sizeof(float));
+    float* out = (float*)calloc(n, sizeof(float));
+    float* mean = (float*)calloc((size_t)B * T, sizeof(float));
+    float* rstd = (float*)calloc((size_t)B * T, sizeof(float));
+    float* dinp1 = (float*)calloc(n, sizeof(float));
+    float* dinp2 = (float*)calloc(n, sizeof(float));
+    float* dweight = (float*)calloc(C, sizeof(float));
+    float* dbias = (float*)calloc(C, sizeof(float));
+    float* dinp1_ref = (float*)calloc(n, sizeof(float));
+    float* dinp2_ref = (float*)calloc(n, sizeof(float));
+    float* dweight_ref = (float*)calloc(C, sizeof(float));
+    float* dbias_ref = (float*)calloc(C, sizeof(float));
+    float* dresidual_ref = (float*)malloc(n * sizeof(float));
+    memcpy(dresidual_ref, dresidual, n * sizeof(float));
+
+    residual_layernorm_forward(residual, out, mean, rstd, inp1, inp2, weight, bias, B, T, C);
+    residual_layernorm_backward(dinp1, dinp2, dweight, dbias, dresidual, dout, residual, weight,
+                                mean, rstd, B, T, C);
+    layernorm_backward(dresidual_ref, dweight_ref, dbias_ref, dout, residual, weight, mean, rstd, B, T, C);
+    residual_backward(dinp1_ref, dinp2_ref, dresidual_ref, (int)n);
+    float err = max_abs_diff(dinp1, dinp1_ref, n);
+    float err_w = max_abs_diff(dweight, dweight_ref, C);
+    state.counters["parity_err"] = err > err_w ? err : err_w;
+
+    for (auto _ : state) {
+        residual_layernorm_backward(dinp1, dinp2, dweight, dbias, dresidual, dout, residual, weight,
+                                    mean, rstd, B, T, C);
+        benchmark::DoNotOptimize(dinp1);
+        benchmark::DoNotOptimize(dinp2);
+    }
+    free(inp1);
+    free(inp2);
+    free(weight);
+    free(bias);
+    free(dout);
+    free(dresidual);
+    free(residual);
+    free(out);
+    free(mean);
+    free(rstd);
+    free(dinp1);
+    free(dinp2);
+    free(dweight);
+    free(dbias);
+    free(dinp1_ref);
+    free(dinp2_ref);
+    free(dweight_ref);
+    free(dbias_ref);
+    free(dresidual_ref);
+}
+
+
 // CROSSENTROPY
 static void BM_crossentropy_forward_scaled(benchmark::State& state) {
     int B = state.range(0);  // Batch size
@@ -2433,8 +3635,711 @@ static void BM_crossentropy_backward_enzyme_scaled(benchmark::State& state) {
 }
 
 
+// ----------------------------------------------------------------------------
+// layer benchmark matrix
+// every layer x {hand-written, Enzyme per-element loop, Enzyme single-call VJP}
+// x {toy, GPT-2 124M, 350M, 774M} shapes, B=4 T=64 as in training. Each cell
+// first checks its gradients against the hand-written kernel (same seed), then
+// times the backward and reports:
+// - FLOP/s: the arithmetic of the hand-written backward (transcendentals count as
+//   one), so the column is comparable across variants
+// - bytes_alloc / peak_bytes: heap bytes allocated per call and peak live heap
+//   above the baseline during the timed loop, which is where Enzyme's forward
+//   re-run, tape and scratch buffers show up
+// The per-element loops cost one Enzyme call per output element, so they only
+// run at the toy shape. They seed every output with 1 (they sum up J^T e_i),
+// so their parity check uses an all-ones dout; the other variants use a random one.
+
+#if defined(__GLIBC__) && !defined(NO_ALLOC_COUNT)
+// count heap traffic by interposing glibc's malloc family, including the aligned
+// allocations (e.g. the packed panels of gemm_sgemm), which free releases like any other
+#include <malloc.h>
+#include <errno.h>
+#include <atomic>
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+extern "C" void* __libc_memalign(size_t, size_t);
+extern "C" void __libc_free(void*);
+static std::atomic<size_t> alloc_total_bytes{0};
+static std::atomic<size_t> alloc_live_bytes{0};
+static std::atomic<size_t> alloc_peak_bytes{0};
+static void alloc_count_add(void* p) {
+    if (p == NULL) { return; }
+    size_t n = malloc_usable_size(p);
+    alloc_total_bytes += n;
+    size_t live = alloc_live_bytes += n;
+    size_t peak = alloc_peak_bytes.load();
+    while (live > peak && !alloc_peak_bytes.compare_exchange_weak(peak, live)) {}
+}
+extern "C" void* malloc(size_t size) noexcept {
+    void* p = __libc_malloc(size);
+    alloc_count_add(p);
+    return p;
+}
+extern "C" void* calloc(size_t n, size_t size) noexcept {
+    void* p = __libc_calloc(n, size);
+    alloc_count_add(p);
+    return p;
+}
+extern "C" void* realloc(void* ptr, size_t size) noexcept {
+    if (ptr != NULL) { alloc_live_bytes -= malloc_usable_size(ptr); }
+    void* p = __libc_realloc(ptr, size);
+    alloc_count_add(p);
+    return p;
+}
+extern "C" void* memalign(size_t alignment, size_t size) noexcept {
+    void* p = __libc_memalign(alignment, size);
+    alloc_count_add(p);
+    return p;
+}
+extern "C" void* aligned_alloc(size_t alignment, size_t size) noexcept {
+    return memalign(alignment, size);
+}
+extern "C" int posix_memalign(void** memptr, size_t alignment, size_t size) noexcept {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) { return EINVAL; }
+    void* p = memalign(alignment, size);
+    if (p == NULL) { return ENOMEM; }
+    *memptr = p;
+    return 0;
+}
+extern "C" void free(void* ptr) noexcept {
+    if (ptr != NULL) { alloc_live_bytes -= malloc_usable_size(ptr); }
+    __libc_free(ptr);
+}
+#define ALLOC_COUNTING 1
+#else
+#define ALLOC_COUNTING 0
+#endif
+
+typedef struct {
+    const char* name;
+    int B, T, C, NH, V, Vp;
+} BenchShape;
+
+static const BenchShape bench_shapes[] = {
+    {"toy", 2, 8, 32, 4, 37, 40},
+    {"124M", 4, 64, 768, 12, 50257, 50304},
+    {"350M", 4, 64, 1024, 16, 50257, 50304},
+    {"774M", 4, 64, 1280, 20, 50257, 50304},
+};
+#define NUM_BENCH_SHAPES (int)(sizeof(bench_shapes) / sizeof(bench_shapes[0]))
+
+enum { VARIANT_HAND, VARIANT_ENZYME_LOOP, VARIANT_ENZYME_VJP, NUM_VARIANTS };
+static const char* variant_names[NUM_VARIANTS] = {"hand", "enzyme_loop", "enzyme_vjp"};
+
+// buffers for one layer at one shape. in* are the layer inputs, out* the outputs
+// (and whatever the backward kernels read from the forward), g[] the gradients
+// and s* scratch for intermediate gradients
+#define MAX_LAYER_GRADS 3
+typedef struct {
+    BenchShape shape;
+    int* tokens;
+    float *in0, *in1, *in2;
+    float *out0, *out1, *out2, *out3;
+    float *s0, *s1;
+    float* dout;
+    size_t n_dout;
+    float* g[MAX_LAYER_GRADS];
+    size_t n_g[MAX_LAYER_GRADS];
+} LayerBench;
+
+typedef struct {
+    const char* name;
+    void (*setup)(LayerBench* lb);
+    // runs one backward, returns a bitmask of the g[] it produces
+    int (*run)(LayerBench* lb, int variant);
+    double (*flops)(const BenchShape* s);
+} LayerBenchDef;
+
+static float* bench_alloc(size_t n) {
+    return (float*)calloc(n, sizeof(float));
+}
+
+static void bench_set_grads(LayerBench* lb, size_t n0, size_t n1, size_t n2) {
+    size_t n[MAX_LAYER_GRADS] = {n0, n1, n2};
+    for (int i = 0; i < MAX_LAYER_GRADS; i++) {
+        lb->n_g[i] = n[i];
+        lb->g[i] = n[i] ? bench_alloc(n[i]) : NULL;
+    }
+}
+
+static void bench_free(LayerBench* lb) {
+    float* bufs[] = {lb->in0, lb->in1, lb->in2, lb->out0, lb->out1, lb->out2, lb->out3,
+                     lb->s0, lb->s1, lb->dout, lb->g[0], lb->g[1], lb->g[2]};
+    for (size_t i = 0; i < sizeof(bufs) / sizeof(bufs[0]); i++) { free(bufs[i]); }
+    free(lb->tokens);
+}
+
+static int* bench_tokens(const BenchShape* s) {
+    int* tokens = (int*)mallocCheck((size_t)s->B * s->T * sizeof(int));
+    for (int i = 0; i < s->B * s->T; i++) { tokens[i] = (i * 7919) % s->V; }
+    return tokens;
+}
+
+// encoder: in0 = wte (V, C), in1 = wpe (T, C); g = dwte | dwpe
+static void encoder_bench_setup(LayerBench* lb) {
+    const BenchShape* s = &lb->shape;
+    lb->tokens = bench_tokens(s);
+    lb->in0 = rand_tensor((size_t)s->V * s->C, 11);
+    lb->in1 = rand_tensor((size_t)s->T * s->C, 12);
+    lb->out0 = bench_alloc((size_t)s->B * s->T * s->C);
+    lb->n_dout = (size_t)s->B * s->T * s->C;
+    bench_set_grads(lb, (size_t)s->V * s->C, (size_t)s->T * s->C, 0);
+}
+static int encoder_bench_run(LayerBench* lb, int variant) {
+    const BenchShape* s = &lb->shape;
+    if (variant == VARIANT_HAND) {
+        encoder_backward(lb->g[0], lb->g[1], lb->dout, lb->tokens, s->B, s->T, s->C);
+    } else if (variant == VARIANT_ENZYME_LOOP) {
+        encoder_enzyme_backward(lb->out0, lb->tokens, lb->in0, lb->g[0], lb->in1, lb->g[1], s->B, s->T, s->C);
+    } else {
+        encoder_vjp_enzyme(lb->g[0], lb->g[1], lb->dout, lb->tokens, lb->in0, lb->in1, s->B, s->T, s->C);
+    }
+    return 0x3;
+}
+static double encoder_bench_flops(const BenchShape* s) {
+    return 2.0 * s->B * s->T * s->C;
+}
+
+// layernorm: in0 = inp, in1 = weight, in2 = bias; out0/1/2 = out, mean, rstd
+static void layernorm_bench_setup(LayerBench* lb) {
+    const BenchShape* s = &lb->shape;
+    size_t n = (size_t)s->B * s->T * s->C;
+    lb->in0 = rand_tensor(n, 21);
+    lb->in1 = rand_tensor(s->C, 22);
+    lb->in2 = rand_tensor(s->C, 23);
+    lb->out0 = bench_alloc(n);
+    lb->out1 = bench_alloc((size_t)s->B * s->T);
+    lb->out2 = bench_alloc((size_t)s->B * s->T);
+    layernorm_forward(lb->out0, lb->out1, lb->out2, lb->in0, lb->in1, lb->in2, s->B, s->T, s->C);
+    lb->n_dout = n;
+    bench_set_grads(lb, n, s->C, s->C);
+}
+static int layernorm_bench_run(LayerBench* lb, int variant) {
+    const BenchShape* s = &lb->shape;
+    if (variant == VARIANT_HAND) {
+        layernorm_backward(lb->g[0], lb->g[1], lb->g[2], lb->dout, lb->in0, lb->in1,
+                           lb->out1, lb->out2, s->B, s->T, s->C);
+    } else if (variant == VARIANT_ENZYME_LOOP) {
+        layernorm_backward_enzyme(lb->out0, lb->out1, lb->out2, lb->in0, lb->g[0], lb->in1, lb->g[1],
+                                  lb->in2, lb->g[2], s->B, s->T, s->C);
+    } else {
+        layernorm_vjp_enzyme(lb->g[0], lb->g[1], lb->g[2], lb->dout, lb->in0, lb->in1, lb->in2, s->B, s->T, s->C);
+    }
+    return 0x7;
+}
+static double layernorm_bench_flops(const BenchShape* s) {
+    // two passes over (B,T,C): 6 flops for the reductions, 9 for the gradients
+    return 15.0 * s->B * s->T * s->C;
+}
+
+// matmul, the MLP up-projection C -> 4C: in0 = inp, in1 = weight, in2 = bias
+static void matmul_bench_setup(LayerBench* lb) {
+    const BenchShape* s = &lb->shape;
+    int OC = 4 * s->C;
+    lb->in0 = rand_tensor((size_t)s->B * s->T * s->C, 31);
+    lb->in1 = rand_tensor((size_t)OC * s->C, 32);
+    lb->in2 = rand_tensor(OC, 33);
+    lb->out0 = bench_alloc((size_t)s->B * s->T * OC);
+    lb->n_dout = (size_t)s->B * s->T * OC;
+    bench_set_grads(lb, (size_t)s->B * s->T * s->C, (size_t)OC * s->C, OC);
+}
+static int matmul_bench_run(LayerBench* lb, int variant) {
+    const BenchShape* s = &lb->shape;
+    int OC = 4 * s->C;
+    if (variant == VARIANT_HAND) {
+        matmul_backward(lb->g[0], lb->g[1], lb->g[2], lb->dout, lb->in0, lb->in1, s->B, s->T, s->C, OC);
+        return 0x7;
+    } else if (variant == VARIANT_ENZYME_LOOP) {
+        // the loop version treats inp as constant, so there is no dinp
+        matmul_backward_enzyme(lb->out0, lb->in0, lb->in1, lb->g[1], lb->in2, lb->g[2], s->B, s->T, s->C, OC);
+        return 0x6;
+    } else {
+        matmul_vjp_enzyme(lb->g[0], lb->g[1], lb->g[2], lb->dout, lb->in0, lb->in1, lb->in2, s->B, s->T, s->C, OC);
+        return 0x7;
+    }
+}
+static double matmul_bench_flops(const BenchShape* s) {
+    double BT = (double)s->B * s->T, OC = 4.0 * s->C;
+    return 4.0 * BT * s->C * OC + BT * OC;
+}
+
+// attention: in0 = qkv (B, T, 3C); out0/1/2 = out, preatt, att; s0/s1 = dpreatt, datt
+static void attention_bench_setup(LayerBench* lb) {
+    const BenchShape* s = &lb->shape;
+    size_t n_att = (size_t)s->B * s->NH * s->T * s->T;
+    lb->in0 = rand_tensor((size_t)s->B * s->T * 3 * s->C, 41);
+    lb->out0 = bench_alloc((size_t)s->B * s->T * s->C);
+    lb->out1 = bench_alloc(n_att);
+    lb->out2 = bench_alloc(n_att);
+    lb->s0 = bench_alloc(n_att);
+    lb->s1 = bench_alloc(n_att);
+    attention_forward(lb->out0, lb->out1, lb->out2, lb->in0, s->B, s->T, s->C, s->NH);
+    lb->n_dout = (size_t)s->B * s->T * s->C;
+    bench_set_grads(lb, (size_t)s->B * s->T * 3 * s->C, 0, 0);
+}
+static int attention_bench_run(LayerBench* lb, int variant) {
+    const BenchShape* s = &lb->shape;
+    size_t n_att = (size_t)s->B * s->NH * s->T * s->T;
+    if (variant == VARIANT_HAND) {
+        memset(lb->s0, 0, n_att * sizeof(float));
+        memset(lb->s1, 0, n_att * sizeof(float));
+        attention_backward(lb->g[0], lb->s0, lb->s1, lb->dout, lb->in0, lb->out2, s->B, s->T, s->C, s->NH);
+    } else if (variant == VARIANT_ENZYME_LOOP) {
+        attention_backward_enzyme(lb->out0, lb->out1, lb->s0, lb->out2, lb->s1, lb->in0, lb->g[0],
+                                  s->B, s->T, s->C, s->NH);
+    } else {
+        attention_vjp_enzyme(lb->g[0], lb->dout, lb->in0, s->B, s->T, s->C, s->NH);
+    }
+    return 0x1;
+}
+static double attention_bench_flops(const BenchShape* s) {
+    // per (b,h): 4*hs flops for each of the T(T+1)/2 causal (t, t2) pairs in the
+    // value and the query/key passes, and 3 per (t2, t3) pair in the softmax
+    double T = s->T, hs = (double)s->C / s->NH;
+    double pairs = T * (T + 1) / 2;
+    double softmax_pairs = T * (T + 1) * (2 * T + 1) / 6;
+    return (double)s->B * s->NH * (8.0 * hs * pairs + 3.0 * softmax_pairs);
+}
+
+// gelu on the MLP hidden activations (B, T, 4C): in0 = inp
+static void gelu_bench_setup(LayerBench* lb) {
+    const BenchShape* s = &lb->shape;
+    size_t n = (size_t)s->B * s->T * 4 * s->C;
+    lb->in0 = rand_tensor(n, 51);
+    lb->out0 = bench_alloc(n);
+    lb->n_dout = n;
+    bench_set_grads(lb, n, 0, 0);
+}
+static int gelu_bench_run(LayerBench* lb, int variant) {
+    int N = (int)lb->n_dout;
+    if (variant == VARIANT_HAND) {
+        gelu_backward(lb->g[0], lb->in0, lb->dout, N);
+    } else if (variant == VARIANT_ENZYME_LOOP) {
+        gelu_enzyme_backward(lb->out0, lb->in0, lb->g[0], N);
+    } else {
+        gelu_vjp_enzyme(lb->g[0], lb->dout, lb->in0, N);
+    }
+    return 0x1;
+}
+static double gelu_bench_flops(const BenchShape* s) {
+    return 21.0 * s->B * s->T * 4 * s->C;
+}
+
+// residual: in0, in1 = the two (B, T, C) inputs
+static void residual_bench_setup(LayerBench* lb) {
+    const BenchShape* s = &lb->shape;
+    size_t n = (size_t)s->B * s->T * s->C;
+    lb->in0 = rand_tensor(n, 61);
+    lb->in1 = rand_tensor(n, 62);
+    lb->out0 = bench_alloc(n);
+    lb->n_dout = n;
+    bench_set_grads(lb, n, n, 0);
+}
+static int residual_bench_run(LayerBench* lb, int variant) {
+    int N = (int)lb->n_dout;
+    if (variant == VARIANT_HAND) {
+        residual_backward(lb->g[0], lb->g[1], lb->dout, N);
+    } else if (variant == VARIANT_ENZYME_LOOP) {
+        risidual_enzyme_backward(lb->out0, lb->in0, lb->g[0], lb->in1, lb->g[1], N);
+    } else {
+        residual_vjp_enzyme(lb->g[0], lb->g[1], lb->dout, lb->in0, lb->in1, N);
+    }
+    return 0x3;
+}
+static double residual_bench_flops(const BenchShape* s) {
+    return 2.0 * s->B * s->T * s->C;
+}
 
+// softmax + crossentropy: in0 = logits (B, T, Vp); out0/1 = probs, losses;
+// s0 = dprobs, s1 = the (B, T, Vp, Vp) softmax Jacobian of the loop version
+static void softmax_crossentropy_bench_setup(LayerBench* lb) {
+    const BenchShape* s = &lb->shape;
+    size_t n = (size_t)s->B * s->T * s->Vp;
+    lb->tokens = bench_tokens(s);
+    lb->in0 = rand_tensor(n, 71);
+    lb->out0 = bench_alloc(n);
+    lb->out1 = bench_alloc((size_t)s->B * s->T);
+    softmax_crossentropy_forward(lb->out1, lb->out0, lb->in0, lb->tokens, s->B, s->T, s->V, s->Vp);
+    lb->s0 = bench_alloc(n);
+    if (s->Vp <= 1024) { lb->s1 = bench_alloc(n * s->Vp); }
+    lb->n_dout = (size_t)s->B * s->T;
+    bench_set_grads(lb, n, 0, 0);
+}
+static int softmax_crossentropy_bench_run(LayerBench* lb, int variant) {
+    const BenchShape* s = &lb->shape;
+    if (variant == VARIANT_HAND) {
+        crossentropy_softmax_backward(lb->g[0], lb->dout, lb->out0, lb->tokens, s->B, s->T, s->V, s->Vp);
+    } else if (variant == VARIANT_ENZYME_LOOP) {
+        // dprobs from the per-loss loop, then through the per-element softmax Jacobian
+        crossentropy_backward_enzyme(lb->out0, lb->s0, lb->out1, lb->tokens, s->B, s->T, s->Vp);
+        softmax_backward_enzyme(lb->out0, lb->in0, lb->s1, s->B, s->T, s->V, s->Vp);
+        for (int bt = 0; bt < s->B * s->T; bt++) {
+            for (int v = 0; v < s->Vp; v++) {
+                float dp = lb->s0[bt * s->Vp + v];
+                float* jac_row = lb->s1 + ((size_t)bt * s->Vp + v) * s->Vp;
+                for (int i = 0; i < s->Vp; i++) {
+                    lb->g[0][bt * s->Vp + i] += dp * jac_row[i];
+                }
+            }
+        }
+    } else {
+        crossentropy_softmax_backward_enzyme(lb->g[0], lb->dout, lb->in0, lb->tokens, s->B, s->T, s->V, s->Vp);
+    }
+    return 0x1;
+}
+static double softmax_crossentropy_bench_flops(const BenchShape* s) {
+    return 3.0 * s->B * s->T * s->V;
+}
+
+static const LayerBenchDef layer_bench_defs[] = {
+    {"encoder", encoder_bench_setup, encoder_bench_run, encoder_bench_flops},
+    {"layernorm", layernorm_bench_setup, layernorm_bench_run, layernorm_bench_flops},
+    {"matmul", matmul_bench_setup, matmul_bench_run, matmul_bench_flops},
+    {"attention", attention_bench_setup, attention_bench_run, attention_bench_flops},
+    {"gelu", gelu_bench_setup, gelu_bench_run, gelu_bench_flops},
+    {"residual", residual_bench_setup, residual_bench_run, residual_bench_flops},
+    {"softmax_crossentropy", softmax_crossentropy_bench_setup, softmax_crossentropy_bench_run,
+     softmax_crossentropy_bench_flops},
+};
+
+static void BM_layer_matrix(benchmark::State& state, const LayerBenchDef* def) {
+    int shape_ix = (int)state.range(0);
+    int variant = (int)state.range(1);
+    LayerBench lb;
+    memset(&lb, 0, sizeof(lb));
+    lb.shape = bench_shapes[shape_ix];
+    state.SetLabel(std::string(lb.shape.name) + "/" + variant_names[variant]);
+    if (variant == VARIANT_ENZYME_LOOP && shape_ix != 0) {
+        state.SkipWithError("per-element Enzyme loop: one autodiff call per output, toy shape only");
+        for (auto _ : state) {}
+        return;
+    }
+    def->setup(&lb);
+
+    // parity against the hand-written kernel, on fresh gradient buffers
+    lb.dout = variant == VARIANT_ENZYME_LOOP ? bench_alloc(lb.n_dout) : rand_tensor(lb.n_dout, 91);
+    if (variant == VARIANT_ENZYME_LOOP) {
+        for (size_t i = 0; i < lb.n_dout; i++) { lb.dout[i] = 1.0f; }
+    }
+    float* ref[MAX_LAYER_GRADS] = {NULL, NULL, NULL};
+    int produced = def->run(&lb, variant);
+    for (int i = 0; i < MAX_LAYER_GRADS; i++) {
+        if (lb.g[i] == NULL) { continue; }
+        ref[i] = lb.g[i];
+        lb.g[i] = bench_alloc(lb.n_g[i]);
+    }
+    def->run(&lb, VARIANT_HAND);
+    float max_err = 0.0f, max_ref = 0.0f;
+    for (int i = 0; i < MAX_LAYER_GRADS; i++) {
+        if (ref[i] == NULL) { continue; }
+        if (produced & (1 << i)) {
+            float err = max_abs_diff(ref[i], lb.g[i], lb.n_g[i]);
+            if (err > max_err) { max_err = err; }
+            for (size_t j = 0; j < lb.n_g[i]; j++) {
+                if (fabsf(lb.g[i][j]) > max_ref) { max_ref = fabsf(lb.g[i][j]); }
+            }
+        }
+        free(ref[i]);
+    }
+    float parity_err = max_err / (max_ref > 1.0f ? max_ref : 1.0f);
+    if (parity_err > TOLERANCE) {
+        state.SetLabel(std::string(lb.shape.name) + "/" + variant_names[variant] + " PARITY FAIL");
+    }
 
+#if ALLOC_COUNTING
+    size_t total0 = alloc_total_bytes.load();
+    size_t live0 = alloc_live_bytes.load();
+    alloc_peak_bytes.store(live0);
+#endif
+    for (auto _ : state) {
+        def->run(&lb, variant);
+        benchmark::ClobberMemory();
+    }
+    state.counters["parity_err"] = parity_err;
+    state.counters["FLOP/s"] = benchmark::Counter(def->flops(&lb.shape), benchmark::Counter::kIsIterationInvariantRate);
+#if ALLOC_COUNTING
+    state.counters["bytes_alloc"] = benchmark::Counter((double)(alloc_total_bytes.load() - total0),
+                                                       benchmark::Counter::kAvgIterations,
+                                                       benchmark::Counter::OneK::kIs1024);
+    state.counters["peak_bytes"] = benchmark::Counter((double)(alloc_peak_bytes.load() - live0),
+                                                      benchmark::Counter::kDefaults,
+                                                      benchmark::Counter::OneK::kIs1024);
+#endif
+    bench_free(&lb);
+}
+
+void benchmark_layer_matrix() {
+    // filter with e.g. --benchmark_filter='layer_matrix/matmul/.*'
+    for (size_t i = 0; i < sizeof(layer_bench_defs) / sizeof(layer_bench_defs[0]); i++) {
+        const LayerBenchDef* def = &layer_bench_defs[i];
+        benchmark::RegisterBenchmark((std::string("layer_matrix/") + def->name).c_str(), BM_layer_matrix, def)
+            ->ArgsProduct({benchmark::CreateDenseRange(0, NUM_BENCH_SHAPES - 1, 1),
+                           benchmark::CreateDenseRange(0, NUM_VARIANTS - 1, 1)})
+            ->ArgNames({"shape", "variant"})
+            ->Unit(benchmark::kMicrosecond);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// GEMM engine benchmark: gemm_sgemm at every GEMM call site of gpt2_forward,
+// reported as FLOP/s and as a fraction of the measured FMA peak of this machine
+
+// peak FLOP/s of the FMA units over all threads: a register-only loop of
+// independent vector FMAs, the same width and accumulator count as the micro-kernel
+static double gemm_peak_flops() {
+    static double peak = 0.0;
+    if (peak > 0.0) { return peak; }
+    const long iters = 1L << 24;
+    float sink = 0.0f;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int nthreads = 1;
+    OMP_PRAGMA(omp parallel reduction(+:sink))
+    {
+#ifdef OMP
+        OMP_PRAGMA(omp single)
+        nthreads = omp_get_num_threads();
+#endif
+        gemm_vec acc[2 * GEMM_MR];
+        gemm_vec m, a;
+        for (int i = 0; i < GEMM_VL; i++) { m[i] = 0.999999f; a[i] = 1e-7f * (i + 1); }
+        for (int i = 0; i < 2 * GEMM_MR; i++) { acc[i] = a * (float)i; }
+        for (long it = 0; it < iters; it++) {
+            for (int i = 0; i < 2 * GEMM_MR; i++) { acc[i] = acc[i] * m + a; }
+        }
+        for (int i = 0; i < 2 * GEMM_MR; i++) { sink += acc[i][0]; }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    benchmark::DoNotOptimize(sink);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    peak = 2.0 * GEMM_VL * 2 * GEMM_MR * (double)iters * nthreads / secs;
+    return peak;
+}
+
+typedef struct {
+    const char* name;
+    int K_mult, N_mult; // K = K_mult * C, N = N_mult * C, or N = Vp if N_mult == 0
+    int has_bias;
+} GemmSite;
+
+static const GemmSite gemm_sites[] = {
+    {"qkv", 1, 3, 1},
+    {"attproj", 1, 1, 1},
+    {"fc", 1, 4, 1},
+    {"fcproj", 4, 1, 1},
+    {"lm_head", 1, 0, 0},
+};
+#define NUM_GEMM_SITES (int)(sizeof(gemm_sites) / sizeof(gemm_sites[0]))
+
+static void BM_gemm_sgemm(benchmark::State& state) {
+    const GemmSite* site = &gemm_sites[state.range(0)];
+    const BenchShape* s = &bench_shapes[state.range(1)];
+    int M = s->B * s->T;
+    int K = site->K_mult * s->C;
+    int N = site->N_mult ? site->N_mult * s->C : s->Vp;
+    state.SetLabel(std::string(site->name) + "/" + s->name);
+    float* inp = rand_tensor((size_t)M * K, 101);
+    float* weight = rand_tensor((size_t)N * K, 102);
+    float* bias = site->has_bias ? rand_tensor(N, 103) : NULL;
+    float* out = bench_alloc((size_t)M * N);
+    float* out_ref = bench_alloc((size_t)M * N);
+
+    // out = inp @ weight^T + bias, exactly as matmul_forward calls it
+    gemm_sgemm(0, 1, M, N, K, inp, K, weight, K, bias, out, N, 0);
+    matmul_forward_naive(out_ref, inp, weight, bias, s->B, s->T, K, N);
+    state.counters["parity_err"] = max_abs_diff(out, out_ref, (size_t)M * N);
+
+    double peak = gemm_peak_flops();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (auto _ : state) {
+        gemm_sgemm(0, 1, M, N, K, inp, K, weight, K, bias, out, N, 0);
+        benchmark::ClobberMemory();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double flops = 2.0 * M * N * K;
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    state.counters["FLOP/s"] = benchmark::Counter(flops, benchmark::Counter::kIsIterationInvariantRate);
+    state.counters["peak_frac"] = flops * state.iterations() / secs / peak;
+    free(inp);
+    free(weight);
+    free(bias);
+    free(out);
+    free(out_ref);
+}
+
+// gemm_sgemm as matmul_forward calls it, at the 124M qkv shape, for B*T rows that are
+// and are not multiples of the register tile, down to a single decoded token: FLOP/s
+// should not fall off a cliff for the unaligned row counts
+static void BM_gemm_sgemm_rows(benchmark::State& state) {
+    int BT = (int)state.range(0);
+    int C = 768, OC = 3 * 768;
+    float* inp = rand_tensor((size_t)BT * C, 111);
+    float* weight = rand_tensor((size_t)OC * C, 112);
+    float* bias = rand_tensor(OC, 113);
+    float* out = bench_alloc((size_t)BT * OC);
+    float* out_ref = bench_alloc((size_t)BT * OC);
+    gemm_sgemm(0, 1, BT, OC, C, inp, C, weight, C, bias, out, OC, 0);
+    matmul_forward_naive(out_ref, inp, weight, bias, 1, BT, C, OC);
+    state.counters["parity_err"] = max_abs_diff(out, out_ref, (size_t)BT * OC);
+    for (auto _ : state) {
+        gemm_sgemm(0, 1, BT, OC, C, inp, C, weight, C, bias, out, OC, 0);
+        benchmark::ClobberMemory();
+    }
+    state.counters["FLOP/s"] = benchmark::Counter(2.0 * BT * OC * C, benchmark::Counter::kIsIterationInvariantRate);
+    free(inp);
+    free(weight);
+    free(bias);
+    free(out);
+    free(out_ref);
+}
+
+// the two fused epilogues at their 124M sites, fc + GELU and fcproj + residual, against
+// gemm_sgemm followed by the separate gelu_forward / residual_forward pass they replace
+static void BM_gemm_sgemm_epilogue(benchmark::State& state) {
+    int kind = (int)state.range(0) == 0 ? GEMM_EPILOGUE_GELU : GEMM_EPILOGUE_RESIDUAL;
+    int fused = (int)state.range(1);
+    const BenchShape* s = &bench_shapes[state.range(2)];
+    int M = s->B * s->T;
+    int K = kind == GEMM_EPILOGUE_GELU ? s->C : 4 * s->C;
+    int N = kind == GEMM_EPILOGUE_GELU ? 4 * s->C : s->C;
+    state.SetLabel(std::string(kind == GEMM_EPILOGUE_GELU ? "fc+gelu" : "fcproj+residual") +
+                   (fused ? "/fused/" : "/unfused/") + s->name);
+    float* inp = rand_tensor((size_t)M * K, 121);
+    float* weight = rand_tensor((size_t)N * K, 122);
+    float* bias = rand_tensor(N, 123);
+    float* residual = rand_tensor((size_t)M * N, 124);
+    float* out = bench_alloc((size_t)M * N);
+    float* aux = bench_alloc((size_t)M * N);
+    float* out_ref = bench_alloc((size_t)M * N);
+    float* aux_ref = bench_alloc((size_t)M * N);
+    GemmEpilogue epilogue = { kind, kind == GEMM_EPILOGUE_GELU ? aux : residual, N };
+
+    // out must match the unfused pair exactly. aux only up to the last bits: the GELU epilogue
+    // uses vmath_tanhf, this file's gelu_forward (which Enzyme differentiates) libm's tanhf
+    gemm_sgemm_ex(0, 1, M, N, K, inp, K, weight, K, bias, out, N, 0, NULL, NULL, NULL, &epilogue);
+    gemm_sgemm(0, 1, M, N, K, inp, K, weight, K, bias, out_ref, N, 0);
+    if (kind == GEMM_EPILOGUE_GELU) {
+        gelu_forward(aux_ref, out_ref, M * N);
+        state.counters["parity_err"] = max_abs_diff(aux, aux_ref, (size_t)M * N);
+    } else {
+        memcpy(aux_ref, out_ref, (size_t)M * N * sizeof(float));
+        residual_forward(out_ref, residual, aux_ref, M * N);
+        state.counters["parity_err"] = max_abs_diff(out, out_ref, (size_t)M * N);
+    }
+
+    for (auto _ : state) {
+        if (fused) {
+            gemm_sgemm_ex(0, 1, M, N, K, inp, K, weight, K, bias, out, N, 0, NULL, NULL, NULL, &epilogue);
+        } else if (kind == GEMM_EPILOGUE_GELU) {
+            gemm_sgemm(0, 1, M, N, K, inp, K, weight, K, bias, out, N, 0);
+            gelu_forward(aux, out, M * N);
+        } else {
+            gemm_sgemm(0, 1, M, N, K, inp, K, weight, K, bias, aux, N, 0);
+            residual_forward(out, residual, aux, M * N);
+        }
+        benchmark::ClobberMemory();
+    }
+    state.counters["FLOP/s"] = benchmark::Counter(2.0 * M * N * K, benchmark::Counter::kIsIterationInvariantRate);
+    free(inp);
+    free(weight);
+    free(bias);
+    free(residual);
+    free(out);
+    free(aux);
+    free(out_ref);
+    free(aux_ref);
+}
+
+void benchmark_gemm() {
+    // filter with e.g. --benchmark_filter='gemm_sgemm'
+    benchmark::RegisterBenchmark("gemm_sgemm", BM_gemm_sgemm)
+        ->ArgsProduct({benchmark::CreateDenseRange(0, NUM_GEMM_SITES - 1, 1),
+                       benchmark::CreateDenseRange(0, NUM_BENCH_SHAPES - 1, 1)})
+        ->ArgNames({"site", "shape"})
+        ->Unit(benchmark::kMicrosecond);
+    benchmark::RegisterBenchmark("gemm_sgemm_rows", BM_gemm_sgemm_rows)
+        ->ArgNames({"BT"})
+        ->Args({1})->Args({7})->Args({8})->Args({63})->Args({64})->Args({255})->Args({256})->Args({257})
+        ->Unit(benchmark::kMicrosecond);
+    benchmark::RegisterBenchmark("gemm_sgemm_epilogue", BM_gemm_sgemm_epilogue)
+        ->ArgsProduct({{0, 1}, {0, 1}, benchmark::CreateDenseRange(0, NUM_BENCH_SHAPES - 1, 1)})
+        ->ArgNames({"kind", "fused", "shape"})
+        ->Unit(benchmark::kMicrosecond);
+}
+
+// llmc/vmath.h against libm, over the ranges the kernels call them on: exp of the
+// (x - max) of softmax and attention, log of the softmax sums, tanh and cosh of GeLU.
+// max_ulp is the error against the double precision result, the documented bound of
+// the vmath function applies to the vmath rows
+static const char* vmath_names[] = { "exp", "log", "tanh", "cosh" };
+static const float vmath_ranges[][2] = { {-80.0f, 0.0f}, {1e-3f, 1e5f}, {-10.0f, 10.0f}, {-10.0f, 10.0f} };
+
+static double ulp_err(float got, double ref) {
+    float r = (float)ref;
+    if (got == r) { return 0.0; }
+    double ulp = nextafterf(fabsf(r), INFINITY) - fabsf(r);
+    return fabs((double)got - ref) / ulp;
+}
+
+static void vmath_apply(float* out, const float* inp, int n, int fn, int vec) {
+    // one loop per function, so that the vmath loops vectorize
+    if (vec) {
+        switch (fn) {
+            case 0: for (int i = 0; i < n; i++) { out[i] = vmath_expf(inp[i]); } break;
+            case 1: for (int i = 0; i < n; i++) { out[i] = vmath_logf(inp[i]); } break;
+            case 2: for (int i = 0; i < n; i++) { out[i] = vmath_tanhf(inp[i]); } break;
+            default: for (int i = 0; i < n; i++) { out[i] = vmath_coshf(inp[i]); } break;
+        }
+    } else {
+        switch (fn) {
+            case 0: for (int i = 0; i < n; i++) { out[i] = expf(inp[i]); } break;
+            case 1: for (int i = 0; i < n; i++) { out[i] = logf(inp[i]); } break;
+            case 2: for (int i = 0; i < n; i++) { out[i] = tanhf(inp[i]); } break;
+            default: for (int i = 0; i < n; i++) { out[i] = coshf(inp[i]); } break;
+        }
+    }
+}
+
+static void BM_vmath(benchmark::State& state) {
+    int fn = (int)state.range(0);
+    int vec = (int)state.range(1);
+    int n = 1 << 16;
+    state.SetLabel(std::string(vmath_names[fn]) + (vec ? "/vmath" : "/libm"));
+    float* inp = bench_alloc(n);
+    float* out = bench_alloc(n);
+    float lo = vmath_ranges[fn][0];
+    float hi = vmath_ranges[fn][1];
+    for (int i = 0; i < n; i++) { inp[i] = lo + (hi - lo) * ((float)i / n); }
+
+    vmath_apply(out, inp, n, fn, vec);
+    double max_ulp = 0.0;
+    for (int i = 0; i < n; i++) {
+        double x = inp[i];
+        double ref = fn == 0 ? exp(x) : fn == 1 ? log(x) : fn == 2 ? tanh(x) : cosh(x);
+        double err = ulp_err(out[i], ref);
+        max_ulp = err > max_ulp ? err : max_ulp;
+    }
+    state.counters["max_ulp"] = max_ulp;
+
+    for (auto _ : state) {
+        vmath_apply(out, inp, n, fn, vec);
+        benchmark::ClobberMemory();
+    }
+    state.counters["elems/s"] = benchmark::Counter(n, benchmark::Counter::kIsIterationInvariantRate);
+    free(inp);
+    free(out);
+}
+
+void benchmark_vmath() {
+    // filter with e.g. --benchmark_filter='vmath'
+    benchmark::RegisterBenchmark("vmath", BM_vmath)
+        ->ArgsProduct({benchmark::CreateDenseRange(0, 3, 1), {0, 1}})
+        ->ArgNames({"fn", "vmath"})
+        ->Unit(benchmark::kMicrosecond);
+}
 
 // Register the benchmarks
 // BENCHMARK(BM_attention_backward_enzyme_scaled)
@@ -2500,6 +4405,20 @@ void benchmark_attention_forward(){
         ->Threads(1);
 }
 
+void benchmark_attention_forward_flash(){
+    BENCHMARK(BM_attention_forward_flash_scaled)
+        ->Args({4, 64, 768, 12})
+        ->Args({4, 1024, 768, 12})
+        ->Unit(benchmark::kMillisecond);
+    BENCHMARK(BM_attention_forward_scaled)
+        ->Args({4, 1024, 768, 12})
+        ->Unit(benchmark::kMillisecond);
+    BENCHMARK(BM_attention_backward_flash_scaled)
+        ->Args({4, 64, 768, 12})
+        ->Args({4, 256, 768, 12})
+        ->Unit(benchmark::kMillisecond);
+}
+
 void benchmark_attention_forward_omp(){
     BENCHMARK(BM_attention_forward_scaled)
         ->Iterations(500)
@@ -2526,6 +4445,24 @@ void benchmark_layernorm_forward(){
         ->Threads(1);
 }
 
+void benchmark_residual_layernorm(){
+    BENCHMARK(BM_residual_layernorm_forward_scaled)
+        ->Iterations(50)
+        ->Args({4, 64, 768}) // Default
+        ->Args({8, 1024, 768}) // activations out of cache
+        ->Threads(1);
+    BENCHMARK(BM_residual_layernorm_forward_unfused_scaled)
+        ->Iterations(50)
+        ->Args({4, 64, 768}) // Default
+        ->Args({8, 1024, 768}) // activations out of cache
+        ->Threads(1);
+    BENCHMARK(BM_residual_layernorm_backward_scaled)
+        ->Iterations(50)
+        ->Args({4, 64, 768}) // Default
+        ->Args({8, 1024, 768}) // activations out of cache
+        ->Threads(1);
+}
+
 
 
 
@@ -2554,7 +4491,16 @@ void benchmark_crossentropy_forward(){
 // }
 
 int main(int argc, char** argv) {
+#ifdef GRADCHECK
+    // -DGRADCHECK: verify every backward at the GPT-2 124M shape instead of benchmarking
+    return test_gradients_jvp(4, 64, 768, 12, 50257, 50304, 4) ? 1 : 0;
+#endif
     benchmark_attention_forward_omp();
+    benchmark_attention_forward_flash();
+    benchmark_layer_matrix();
+    benchmark_gemm();
+    benchmark_vmath();
+    benchmark_residual_layernorm();
     ::benchmark::Initialize(&argc, argv);
     ::benchmark::RunSpecifiedBenchmarks();
     return 0;
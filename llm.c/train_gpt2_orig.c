@@ -14,6 +14,7 @@ There will be other versions of this code that specialize it and make it fast.
 #include <stdint.h>
 #include <assert.h>
 #include <math.h>
+#include <float.h>
 #include <time.h>
 #include <string.h>
 #include <unistd.h>
@@ -27,6 +28,12 @@ There will be other versions of this code that specialize it and make it fast.
 #include "llmc/tokenizer.h"
 // defines: dataloader_init, dataloader_reset, dataloader_next_batch, dataloader_free
 #include "llmc/dataloader.h"
+// defines: vmath_expf, vmath_logf, vmath_tanhf, vmath_coshf
+#include "llmc/vmath.h"
+// defines: gemm_sgemm
+#include "llmc/gemm.h"
+// defines: adamw_update
+#include "llmc/adamw.h"
 
 // #ifdef TESTING
 #include <benchmark/benchmark.h>
@@ -168,8 +175,7 @@ void matmul_forward_naive(float* out,
                          const float* inp, const float* weight, const float* bias,
                          int B, int T, int C, int OC) {
     // the most naive implementation of matrix multiplication
-    // this serves as an algorithmic reference, and as a fallback for
-    // unfriendly input shapes inside matmul_forward(), below.
+    // this serves as an algorithmic reference for matmul_forward(), below.
 
     // #pragma omp parallel for collapse(2)
     for (int b = 0; b < B; b++) {
@@ -190,222 +196,426 @@ void matmul_forward(float* out,
                     const float* inp, const float* weight, const float* bias,
                     int B, int T, int C, int OC) {
     // most of the running time is spent here and in matmul_backward
-    // therefore, the implementation below is very mildly optimized
-    // this function is otherwise identical to that of matmul_forward_naive()
+    // this function computes the same as matmul_forward_naive(), on the blocked
+    // and packed GEMM of llmc/gemm.h, for any shape
     // OC is short for "output channels"
     // inp is (B,T,C), weight is (OC, C), bias is (OC)
     // out will be (B,T,OC)
-
-    // make sure the tiled loop will be correct or fallback to naive version
-    const int LOOP_UNROLL = 8;
-    if (B*T % LOOP_UNROLL != 0) {
-        matmul_forward_naive(out, inp, weight, bias, B, T, C, OC);
-        return;
-    }
-
-    // collapse the B and T loops into one and turn it into a strided loop.
-    // then we can tile the inner loop, and reuse the loaded weight LOOP_UNROLL many times
-    
-    // #pragma omp parallel for
-    for (int obt = 0; obt < B * T; obt += LOOP_UNROLL) {
-        for (int o = 0; o < OC; o++) {
-            // we'll keep LOOP_UNROLL many results in registers
-            float result[LOOP_UNROLL];
-            // initialize the bias, if it exists
-            for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
-                result[ibt] = (bias != NULL) ? bias[o] : 0.0f;
-            }
-            // inner loops. Because we do LOOP_UNROLL steps of inner bt, we can cache
-            // the value of weight[i + o * C] and reuse it.
-            // we compile with -Ofast, so the compiler will turn the inner loop into FMAs
-            for (int i = 0; i < C; i++) {
-                float w = weight[i + o * C];
-                for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
-                    int bt = obt + ibt;
-                    result[ibt] += inp[bt * C + i] * w;
-                }
-            }
-            // write back results to main memory
-            for (int ibt = 0; ibt < LOOP_UNROLL; ibt++) {
-                int bt = obt + ibt;
-                out[bt * OC + o] = result[ibt];
-            }
-        }
-    }
+    gemm_sgemm(0, 1, B * T, OC, C, inp, C, weight, C, bias, out, OC, 0);
 }
 
 void matmul_backward(float* dinp, float* dweight, float* dbias,
                      const float* dout, const float* inp, const float* weight,
                      int B, int T, int C, int OC) {
     // most of the running time is spent here and in matmul_forward
-    // this backward could be done in a single "round" of loops
-    // but that doesn't afford an efficient parallelization strategy
+    // both weight products are GEMMs on the blocked engine of llmc/gemm.h:
+    // dinp (B*T,C) += dout (B*T,OC) @ weight (OC,C)
+    gemm_sgemm(0, 0, B * T, C, OC, dout, OC, weight, C, NULL, dinp, C, 1);
+    // dweight (OC,C) += dout^T (OC,B*T) @ inp (B*T,C)
+    gemm_sgemm(1, 0, OC, C, B * T, dout, OC, inp, C, NULL, dweight, C, 1);
+    // dbias (OC) += column sums of dout
+    if (dbias != NULL) { gemm_colsum(dbias, dout, B * T, OC, OC, NULL); }
+}
 
-    // backward into inp first, parallelize over B,T
-    
-    // #pragma omp parallel for collapse(2)
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            const float* dout_bt = dout + b * T * OC + t * OC;
-            float* dinp_bt = dinp + b * T * C + t * C;
-            for (int o = 0; o < OC; o++) {
-                const float* wrow = weight + o*C;
-                float d = dout_bt[o];
-                for (int i = 0; i < C; i++) {
-                    dinp_bt[i] += wrow[i] * d;
+void matmul_forward_qkv(float* out,
+                        const float* inp, const float* weight, const float* bias,
+                        int B, int T, int C, int NH) {
+    // the qkv matmul: matmul_forward with OC = 3*C, except that out is stored head-major,
+    // (B, 3, NH, T, hs), so that attention streams every head as contiguous hs-wide rows.
+    // The GEMM stores its tiles of C straight into that layout, there is no transpose pass
+    int OC = 3 * C;
+    int hs = C / NH; // head size
+    GemmLayout layout = { T, hs, (size_t)OC * T, (size_t)T * hs };
+    gemm_sgemm_ex(0, 1, B * T, OC, C, inp, C, weight, C, bias, out, OC, 0, &layout, NULL, NULL, NULL);
+}
+
+void matmul_backward_qkv(float* dinp, float* dweight, float* dbias,
+                         const float* dout, const float* inp, const float* weight,
+                         int B, int T, int C, int NH) {
+    // backward of matmul_forward_qkv, where dout is head-major like the output.
+    // These are the products of matmul_backward, with dout read through the same
+    // GemmLayout the forward wrote it with, so it is never gathered into a row-major copy
+    int OC = 3 * C;
+    int hs = C / NH; // head size
+    GemmLayout layout = { T, hs, (size_t)OC * T, (size_t)T * hs };
+    // dinp (B*T,C) += dout (B*T,OC) @ weight (OC,C)
+    gemm_sgemm_ex(0, 0, B * T, C, OC, dout, 0, weight, C, NULL, dinp, C, 1, NULL, &layout, NULL, NULL);
+    // dweight (OC,C) += dout^T (OC,B*T) @ inp (B*T,C)
+    gemm_sgemm_ex(1, 0, OC, C, B * T, dout, 0, inp, C, NULL, dweight, C, 1, NULL, &layout, NULL, NULL);
+    // dbias (OC) += column sums of dout
+    if (dbias != NULL) { gemm_colsum(dbias, dout, B * T, OC, 0, &layout); }
+}
+
+// query rows and key columns per tile of the fused attention, and the largest head size
+#define ATTN_BLOCK 32
+#define ATTN_MAX_HS 128
+// (b,h) heads per thread below which attention_backward splits work inside a head
+#define ATTN_HEADS_PER_THREAD 4
+
+// offset of the (T, hs) rows of head h of the query (w = 0), key (w = 1) or value (w = 2)
+// of batch element b in the qkv activations. These are stored head-major, (B, 3, NH, T, hs),
+// as written by matmul_forward_qkv, so every head streams contiguous hs-wide rows
+static inline size_t attention_qkv_offset(int b, int w, int h, int T, int C, int NH) {
+    int hs = C / NH; // head size
+    return ((size_t)(b * 3 + w) * NH + h) * T * hs;
+}
+
+// Causal attention work is triangular: query tile qb reads qb + 1 key tiles, and key
+// tile kb is read by num_blocks - kb query tiles. Splitting (b, t, h) evenly would
+// leave the threads that own the last rows with twice the average work. Instead one
+// parallel work item is a pair of tiles, tile p and tile num_blocks - 1 - p, whose
+// combined cost is the same for every p, so a static schedule is balanced.
+static inline int attention_num_pairs(int num_blocks) {
+    return (num_blocks + 1) / 2;
+}
+
+static inline int attention_pair_tile(int pair, int side, int num_blocks) {
+    // tile of one side of a pair, or -1 for the missing partner of the middle tile
+    int tile = side == 0 ? pair : num_blocks - 1 - pair;
+    return (side == 1 && tile == pair) ? -1 : tile;
+}
+
+static inline void attention_forward_tile(float* __restrict out, float* __restrict lse,
+                                          const float* __restrict inp,
+                                          int b, int h, int t0, int nq,
+                                          int T, int C, int NH) {
+    // one tile of nq queries starting at t0, for batch b and head h
+    int hs = C / NH; // head size
+    const float* query = inp + attention_qkv_offset(b, 0, h, T, C, NH);
+    const float* key = inp + attention_qkv_offset(b, 1, h, T, C, NH);
+    const float* value = inp + attention_qkv_offset(b, 2, h, T, C, NH);
+    float scale = 1.0 / sqrtf(hs);
+    float acc[ATTN_BLOCK][ATTN_MAX_HS];
+    float score[ATTN_BLOCK][ATTN_BLOCK];
+    float m[ATTN_BLOCK], l[ATTN_BLOCK];
+    for (int iq = 0; iq < nq; iq++) {
+        m[iq] = -FLT_MAX;
+        l[iq] = 0.0f;
+        for (int i = 0; i < hs; i++) { acc[iq][i] = 0.0f; }
+    }
+
+    // key tiles up to and including the diagonal one
+    for (int k0 = 0; k0 < t0 + nq; k0 += ATTN_BLOCK) {
+        int nk = t0 + nq - k0 < ATTN_BLOCK ? t0 + nq - k0 : ATTN_BLOCK;
+        for (int iq = 0; iq < nq; iq++) {
+            int t = t0 + iq;
+            // keys k0 .. t are visible to query t
+            int nvalid = t - k0 + 1 < nk ? t - k0 + 1 : nk;
+            if (nvalid <= 0) { continue; }
+            const float* query_t = query + t * hs;
+
+            // (query_t) dot (key_t2), and the max of this tile
+            float maxval = m[iq];
+            for (int jk = 0; jk < nvalid; jk++) {
+                const float* key_t2 = key + (k0 + jk) * hs;
+                float val = 0.0f;
+                for (int i = 0; i < hs; i++) {
+                    val += query_t[i] * key_t2[i];
                 }
+                val *= scale;
+                score[iq][jk] = val;
+                if (val > maxval) { maxval = val; }
             }
-        }
-    }
-    // backward into weight/bias, parallelize over output channels OC
-    
-    // #pragma omp parallel for
-    for (int o = 0; o < OC; o++) {
-        for (int b = 0; b < B; b++) {
-            for (int t = 0; t < T; t++) {
-                const float* dout_bt = dout + b * T * OC + t * OC;
-                const float* inp_bt = inp + b * T * C + t * C;
-                float* dwrow = dweight + o*C;
-                float d = dout_bt[o];
-                if (dbias != NULL) { dbias[o] += d; }
-                for (int i = 0; i < C; i++) {
-                    dwrow[i] += inp_bt[i] * d;
+
+            // rescale what was accumulated under the old max, then add this tile
+            float correction = vmath_expf(m[iq] - maxval);
+            l[iq] *= correction;
+            for (int i = 0; i < hs; i++) { acc[iq][i] *= correction; }
+            // the exponentials of the tile in a pass of their own, which vectorizes
+            for (int jk = 0; jk < nvalid; jk++) { score[iq][jk] = vmath_expf(score[iq][jk] - maxval); }
+            for (int jk = 0; jk < nvalid; jk++) {
+                const float* value_t2 = value + (k0 + jk) * hs;
+                float expv = score[iq][jk];
+                l[iq] += expv;
+                for (int i = 0; i < hs; i++) {
+                    acc[iq][i] += expv * value_t2[i];
                 }
             }
+            m[iq] = maxval;
         }
     }
+
+    // normalize, and keep the logsumexp so backward can rebuild the softmax
+    for (int iq = 0; iq < nq; iq++) {
+        int t = t0 + iq;
+        float* out_bth = out + b * T * C + t * C + h * hs;
+        float l_inv = 1.0f / l[iq];
+        for (int i = 0; i < hs; i++) { out_bth[i] = acc[iq][i] * l_inv; }
+        lse[b*NH*T + h*T + t] = m[iq] + vmath_logf(l[iq]);
+    }
 }
 
-void attention_forward(float* out, float* preatt, float* att,
+void attention_forward(float* out, float* lse,
                        float* inp,
                        int B, int T, int C, int NH) {
-    // input is (B, T, 3C) holding the query, key, value (Q, K, V) vectors
-    // preatt, att are (B, NH, T, T). NH = number of heads, T = sequence length
-    // that holds the pre-attention and post-attention scores (used in backward)
+    // input is (B, 3, NH, T, hs) holding the query, key, value (Q, K, V) vectors, head-major
+    // lse is (B, NH, T), the logsumexp of every row of scaled scores (used in backward)
     // output is (B, T, C)
     // attention is the only layer that mixes information across time
     // every other operation is applied at every (b,t) position independently
     // (and of course, no layer mixes information across batch)
-    int C3 = C*3;
-    int hs = C / NH; // head size
-    float scale = 1.0 / sqrtf(hs);
-
-    // #pragma omp parallel for collapse(3)
+    // the (T, T) pre-attention scores and softmax are never materialized: a tile of
+    // ATTN_BLOCK queries streams the key/value tiles at or below the causal diagonal,
+    // keeping a running max m and running sum l of exp(score - m) per query, and
+    // rescales its output accumulator whenever the max grows (online softmax)
+    assert(C / NH <= ATTN_MAX_HS);
+    int num_blocks = (T + ATTN_BLOCK - 1) / ATTN_BLOCK;
+    int num_pairs = attention_num_pairs(num_blocks);
+
+    // #pragma omp parallel for collapse(3) schedule(static)
     for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            for (int h = 0; h < NH; h++) {
-                float* query_t = inp + b * T * C3 + t * C3 + h * hs;
-                float* preatt_bth = preatt + b*NH*T*T + h*T*T + t*T;
-                float* att_bth = att + b*NH*T*T + h*T*T + t*T;
-
-                // pass 1: calculate query dot key and maxval
-                float maxval = -10000.0f; // TODO something better
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
-
-                    // (query_t) dot (key_t2)
-                    float val = 0.0f;
-                    for (int i = 0; i < hs; i++) {
-                        val += query_t[i] * key_t2[i];
-                    }
-                    val *= scale;
-                    if (val > maxval) {
-                        maxval = val;
-                    }
-
-                    preatt_bth[t2] = val;
+        for (int h = 0; h < NH; h++) {
+            for (int pair = 0; pair < num_pairs; pair++) {
+                for (int side = 0; side < 2; side++) {
+                    int qb = attention_pair_tile(pair, side, num_blocks);
+                    if (qb < 0) { continue; }
+                    int t0 = qb * ATTN_BLOCK;
+                    int nq = T - t0 < ATTN_BLOCK ? T - t0 : ATTN_BLOCK;
+                    attention_forward_tile(out, lse, inp, b, h, t0, nq, T, C, NH);
                 }
+            }
+        }
+    }
+}
 
-                // pass 2: calculate the exp and keep track of sum
-                // maxval is being calculated and subtracted only for numerical stability
-                float expsum = 0.0f;
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float expv = expf(preatt_bth[t2] - maxval);
-                    expsum += expv;
-                    att_bth[t2] = expv;
-                }
-                float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
-
-                // pass 3: normalize to get the softmax
-                for (int t2 = 0; t2 < T; t2++) {
-                    if (t2 <= t) {
-                        att_bth[t2] *= expsum_inv;
-                    } else {
-                        // causal attention mask. not strictly necessary to set to zero here
-                        // only doing this explicitly for debugging and checking to PyTorch
-                        att_bth[t2] = 0.0f;
-                    }
+// the per-(t, t2) update of attention_backward_head, split out so that the compiler
+// sees the gradient rows as non-aliasing and vectorizes over the head size
+static inline void attention_backward_accumulate(float* __restrict dquery_t, float* __restrict dkey_t2,
+                                                 float* __restrict dvalue_t2, const float* __restrict query_t,
+                                                 const float* __restrict key_t2, const float* __restrict dout_bth,
+                                                 float att, float dpreatt, int hs) {
+    for (int i = 0; i < hs; i++) {
+        dvalue_t2[i] += att * dout_bth[i];
+        dquery_t[i] += key_t2[i] * dpreatt;
+        dkey_t2[i] += query_t[i] * dpreatt;
+    }
+}
+
+static inline void attention_backward_head(float* dinp, const float* dout,
+                                           const float* inp, const float* out, const float* lse,
+                                           int b, int h, int T, int C, int NH) {
+    // all of one (b,h): position t writes dkey/dvalue at every t2 <= t, but only
+    // within its own head, so one pass in t computes att once per (t, t2)
+    int hs = C / NH; // head size
+    const float* query = inp + attention_qkv_offset(b, 0, h, T, C, NH);
+    const float* key = inp + attention_qkv_offset(b, 1, h, T, C, NH);
+    const float* value = inp + attention_qkv_offset(b, 2, h, T, C, NH);
+    float* dquery = dinp + attention_qkv_offset(b, 0, h, T, C, NH);
+    float* dkey = dinp + attention_qkv_offset(b, 1, h, T, C, NH);
+    float* dvalue = dinp + attention_qkv_offset(b, 2, h, T, C, NH);
+    float scale = 1.f / sqrtf(hs);
+    for (int t = 0; t < T; t++) {
+        const float* query_t = query + t * hs;
+        float* dquery_t = dquery + t * hs;
+        const float* out_bth = out + b * T * C + t * C + h * hs;
+        const float* dout_bth = dout + b * T * C + t * C + h * hs;
+        float lse_bth = lse[b*NH*T + h*T + t];
+        float D = 0.0f;
+        for (int i = 0; i < hs; i++) {
+            D += dout_bth[i] * out_bth[i];
+        }
+
+        // keys in tiles of ATTN_BLOCK, so that the exponentials of a tile take one vectorized pass
+        for (int k0 = 0; k0 <= t; k0 += ATTN_BLOCK) {
+            int nk = t + 1 - k0 < ATTN_BLOCK ? t + 1 - k0 : ATTN_BLOCK;
+            float att[ATTN_BLOCK], datt[ATTN_BLOCK];
+            for (int jk = 0; jk < nk; jk++) {
+                const float* key_t2 = key + (k0 + jk) * hs;
+                const float* value_t2 = value + (k0 + jk) * hs;
+                // recompute att[t2], and get datt[t2] through the value accumulation
+                float preatt = 0.0f;
+                float datt_t2 = 0.0f;
+                for (int i = 0; i < hs; i++) {
+                    preatt += query_t[i] * key_t2[i];
+                    datt_t2 += dout_bth[i] * value_t2[i];
                 }
+                att[jk] = preatt * scale - lse_bth;
+                datt[jk] = datt_t2;
+            }
+            for (int jk = 0; jk < nk; jk++) { att[jk] = vmath_expf(att[jk]); }
+            for (int jk = 0; jk < nk; jk++) {
+                const float* key_t2 = key + (k0 + jk) * hs;
+                float* dkey_t2 = dkey + (k0 + jk) * hs;
+                float* dvalue_t2 = dvalue + (k0 + jk) * hs;
+                // through the softmax, then the query @ key matmul
+                float dpreatt = att[jk] * (datt[jk] - D) * scale;
+                attention_backward_accumulate(dquery_t, dkey_t2, dvalue_t2, query_t, key_t2, dout_bth,
+                                              att[jk], dpreatt, hs);
+            }
+        }
+    }
+}
 
-                // pass 4: accumulate weighted values into the output of attention
-                float* out_bth = out + b * T * C + t * C + h * hs;
-                for (int i = 0; i < hs; i++) { out_bth[i] = 0.0f; }
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
-                    float att_btht2 = att_bth[t2];
-                    for (int i = 0; i < hs; i++) {
-                        out_bth[i] += att_btht2 * value_t2[i];
-                    }
+static inline void attention_backward_query_tile(float* __restrict dinp, const float* __restrict dout,
+                                                 const float* __restrict inp, const float* __restrict out,
+                                                 const float* __restrict lse,
+                                                 int b, int h, int t0, int nq,
+                                                 int T, int C, int NH) {
+    // dquery of nq queries starting at t0: each one reads the keys t2 <= t
+    int hs = C / NH; // head size
+    const float* query = inp + attention_qkv_offset(b, 0, h, T, C, NH);
+    const float* key = inp + attention_qkv_offset(b, 1, h, T, C, NH);
+    const float* value = inp + attention_qkv_offset(b, 2, h, T, C, NH);
+    float* dquery = dinp + attention_qkv_offset(b, 0, h, T, C, NH);
+    float scale = 1.f / sqrtf(hs);
+    for (int t = t0; t < t0 + nq; t++) {
+        const float* query_t = query + t * hs;
+        const float* out_bth = out + b * T * C + t * C + h * hs;
+        const float* dout_bth = dout + b * T * C + t * C + h * hs;
+        float lse_bth = lse[b*NH*T + h*T + t];
+        float D = 0.0f;
+        for (int i = 0; i < hs; i++) {
+            D += dout_bth[i] * out_bth[i];
+        }
+        float dquery_acc[ATTN_MAX_HS];
+        for (int i = 0; i < hs; i++) { dquery_acc[i] = 0.0f; }
+        for (int k0 = 0; k0 <= t; k0 += ATTN_BLOCK) {
+            int nk = t + 1 - k0 < ATTN_BLOCK ? t + 1 - k0 : ATTN_BLOCK;
+            float att[ATTN_BLOCK], datt[ATTN_BLOCK];
+            for (int jk = 0; jk < nk; jk++) {
+                const float* key_t2 = key + (k0 + jk) * hs;
+                const float* value_t2 = value + (k0 + jk) * hs;
+                // recompute att[t2], and get datt[t2] through the value accumulation
+                float preatt = 0.0f;
+                float datt_t2 = 0.0f;
+                for (int i = 0; i < hs; i++) {
+                    preatt += query_t[i] * key_t2[i];
+                    datt_t2 += dout_bth[i] * value_t2[i];
+                }
+                att[jk] = preatt * scale - lse_bth;
+                datt[jk] = datt_t2;
+            }
+            for (int jk = 0; jk < nk; jk++) { att[jk] = vmath_expf(att[jk]); }
+            for (int jk = 0; jk < nk; jk++) {
+                const float* key_t2 = key + (k0 + jk) * hs;
+                // through the softmax, then the query @ key matmul
+                float dpreatt = att[jk] * (datt[jk] - D) * scale;
+                for (int i = 0; i < hs; i++) {
+                    dquery_acc[i] += key_t2[i] * dpreatt;
                 }
             }
         }
+        float* dquery_t = dquery + t * hs;
+        for (int i = 0; i < hs; i++) { dquery_t[i] += dquery_acc[i]; }
     }
 }
 
-void attention_backward(float* dinp, float* dpreatt, float* datt,
-                        float* dout, float* inp, float* att,
-                        int B, int T, int C, int NH) {
-    // inp/dinp are (B, T, 3C) Q,K,V
-    // att/datt/dpreatt are (B, NH, T, T)
-    // dout is (B, T, C)
-    int C3 = C*3;
+static inline void attention_backward_key_tile(float* __restrict dinp, const float* __restrict dout,
+                                               const float* __restrict inp, const float* __restrict out,
+                                               const float* __restrict lse,
+                                               int b, int h, int k0, int nk,
+                                               int T, int C, int NH) {
+    // dkey and dvalue of nk keys starting at k0: each one is read by the queries t >= t2
     int hs = C / NH; // head size
+    const float* query = inp + attention_qkv_offset(b, 0, h, T, C, NH);
+    const float* key = inp + attention_qkv_offset(b, 1, h, T, C, NH);
+    const float* value = inp + attention_qkv_offset(b, 2, h, T, C, NH);
+    float* dkey = dinp + attention_qkv_offset(b, 1, h, T, C, NH);
+    float* dvalue = dinp + attention_qkv_offset(b, 2, h, T, C, NH);
     float scale = 1.f / sqrtf(hs);
+    float dkey_acc[ATTN_BLOCK][ATTN_MAX_HS];
+    float dvalue_acc[ATTN_BLOCK][ATTN_MAX_HS];
+    for (int jk = 0; jk < nk; jk++) {
+        for (int i = 0; i < hs; i++) { dkey_acc[jk][i] = 0.0f; dvalue_acc[jk][i] = 0.0f; }
+    }
+    for (int t = k0; t < T; t++) {
+        const float* query_t = query + t * hs;
+        const float* out_bth = out + b * T * C + t * C + h * hs;
+        const float* dout_bth = dout + b * T * C + t * C + h * hs;
+        float lse_bth = lse[b*NH*T + h*T + t];
+        float D = 0.0f;
+        for (int i = 0; i < hs; i++) {
+            D += dout_bth[i] * out_bth[i];
+        }
+        // keys k0 .. t of this tile are visible to query t
+        int nvalid = t - k0 + 1 < nk ? t - k0 + 1 : nk;
+        float att[ATTN_BLOCK], datt[ATTN_BLOCK];
+        for (int jk = 0; jk < nvalid; jk++) {
+            const float* key_t2 = key + (k0 + jk) * hs;
+            const float* value_t2 = value + (k0 + jk) * hs;
+            float preatt = 0.0f;
+            float datt_t2 = 0.0f;
+            for (int i = 0; i < hs; i++) {
+                preatt += query_t[i] * key_t2[i];
+                datt_t2 += dout_bth[i] * value_t2[i];
+            }
+            att[jk] = preatt * scale - lse_bth;
+            datt[jk] = datt_t2;
+        }
+        for (int jk = 0; jk < nvalid; jk++) { att[jk] = vmath_expf(att[jk]); }
+        for (int jk = 0; jk < nvalid; jk++) {
+            float dpreatt = att[jk] * (datt[jk] - D) * scale;
+            for (int i = 0; i < hs; i++) {
+                dvalue_acc[jk][i] += att[jk] * dout_bth[i];
+                dkey_acc[jk][i] += query_t[i] * dpreatt;
+            }
+        }
+    }
+    for (int jk = 0; jk < nk; jk++) {
+        float* dkey_t2 = dkey + (k0 + jk) * hs;
+        float* dvalue_t2 = dvalue + (k0 + jk) * hs;
+        for (int i = 0; i < hs; i++) {
+            dkey_t2[i] += dkey_acc[jk][i];
+            dvalue_t2[i] += dvalue_acc[jk][i];
+        }
+    }
+}
 
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
+void attention_backward(float* dinp, float* dout, float* inp, float* out, float* lse,
+                        int B, int T, int C, int NH) {
+    // inp/dinp are (B, 3, NH, T, hs) Q,K,V, head-major
+    // out/dout are (B, T, C), lse is (B, NH, T): only what attention_forward kept
+    // the softmax is recomputed from the queries, keys and lse instead of being read
+    // back from (B, NH, T, T) buffers: with att = exp(query_t . key_t2 * scale - lse_t)
+    // and datt = dout_t . value_t2, the softmax backward is att * (datt - D_t), where
+    // D_t = sum_t2 att * datt = dout_t . out_t needs no pass over t2 of its own
+    assert(C / NH <= ATTN_MAX_HS);
+    // the loops below run serially (their omp pragmas are commented out in this file), so
+    // whole heads are always the unit of work, whatever the OpenMP thread count
+    int nthreads = 1;
+
+    // with enough (b,h) heads per thread, whole heads are the cheapest unit of work
+    if (nthreads == 1 || B * NH >= ATTN_HEADS_PER_THREAD * nthreads) {
+        // #pragma omp parallel for collapse(2) schedule(static)
+        for (int b = 0; b < B; b++) {
             for (int h = 0; h < NH; h++) {
-                float* att_bth = att + b*NH*T*T + h*T*T + t*T;
-                float* datt_bth = datt + b*NH*T*T + h*T*T + t*T;
-                float* dpreatt_bth = dpreatt + b*NH*T*T + h*T*T + t*T;
-                float* dquery_t = dinp + b * T * C3 + t * C3 + h * hs;
-                float* query_t = inp + b * T * C3 + t * C3 + h * hs;
-
-                // backward pass 4, through the value accumulation
-                float* dout_bth = dout + b * T * C + t * C + h * hs;
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
-                    float* dvalue_t2 = dinp + b * T * C3 + t2 * C3 + h * hs + C*2;
-                    for (int i = 0; i < hs; i++) {
-                        // in the forward pass this was:
-                        // out_bth[i] += att_bth[t2] * value_t2[i];
-                        // so now we have:
-                        datt_bth[t2] += value_t2[i] * dout_bth[i];
-                        dvalue_t2[i] += att_bth[t2] * dout_bth[i];
-                    }
-                }
+                attention_backward_head(dinp, dout, inp, out, lse, b, h, T, C, NH);
+            }
+        }
+        return;
+    }
 
-                // backward pass 2 & 3, the softmax
-                // note that softmax (like e.g. tanh) doesn't need the input (preatt) to backward
-                for (int t2 = 0; t2 <= t; t2++) {
-                    for (int t3 = 0; t3 <= t; t3++) {
-                        float indicator = t2 == t3 ? 1.0f : 0.0f;
-                        float local_derivative = att_bth[t2] * (indicator - att_bth[t3]);
-                        dpreatt_bth[t3] += local_derivative * datt_bth[t2];
-                    }
+    // otherwise split below the head: dquery is owned by the query rows and dkey/dvalue
+    // by the key rows, so one pass over query tiles and one over key tiles both write
+    // without races, for the price of recomputing att twice
+    int num_blocks = (T + ATTN_BLOCK - 1) / ATTN_BLOCK;
+    int num_pairs = attention_num_pairs(num_blocks);
+
+    // #pragma omp parallel for collapse(3) schedule(static)
+    for (int b = 0; b < B; b++) {
+        for (int h = 0; h < NH; h++) {
+            for (int pair = 0; pair < num_pairs; pair++) {
+                for (int side = 0; side < 2; side++) {
+                    int qb = attention_pair_tile(pair, side, num_blocks);
+                    if (qb < 0) { continue; }
+                    int t0 = qb * ATTN_BLOCK;
+                    int nq = T - t0 < ATTN_BLOCK ? T - t0 : ATTN_BLOCK;
+                    attention_backward_query_tile(dinp, dout, inp, out, lse, b, h, t0, nq, T, C, NH);
                 }
+            }
+        }
+    }
 
-                // backward pass 1, the query @ key matmul
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
-                    float* dkey_t2 = dinp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
-                    for (int i = 0; i < hs; i++) {
-                        // in the forward pass this was:
-                        // preatt_bth[t2] += (query_t[i] * key_t2[i]) * scale;
-                        // so now we have:
-                        dquery_t[i] += key_t2[i] * dpreatt_bth[t2] * scale;
-                        dkey_t2[i] += query_t[i] * dpreatt_bth[t2] * scale;
-                    }
+    // #pragma omp parallel for collapse(3) schedule(static)
+    for (int b = 0; b < B; b++) {
+        for (int h = 0; h < NH; h++) {
+            for (int pair = 0; pair < num_pairs; pair++) {
+                for (int side = 0; side < 2; side++) {
+                    int kb = attention_pair_tile(pair, side, num_blocks);
+                    if (kb < 0) { continue; }
+                    int k0 = kb * ATTN_BLOCK;
+                    int nk = T - k0 < ATTN_BLOCK ? T - k0 : ATTN_BLOCK;
+                    attention_backward_key_tile(dinp, dout, inp, out, lse, b, h, k0, nk, T, C, NH);
                 }
             }
         }
@@ -418,7 +628,7 @@ void gelu_forward(float* out, float* inp, int N) {
     for (int i = 0; i < N; i++) {
         float x = inp[i];
         float cube = 0.044715f * x * x * x;
-        out[i] = 0.5f * x * (1.0f + tanhf(GELU_SCALING_FACTOR * (x + cube)));
+        out[i] = 0.5f * x * (1.0f + vmath_tanhf(GELU_SCALING_FACTOR * (x + cube)));
     }
 }
 
@@ -432,13 +642,46 @@ void gelu_backward(float* dinp, float* inp, float* dout, int N) {
         float x = inp[i];
         float cube = 0.044715f * x * x * x;
         float tanh_arg = GELU_SCALING_FACTOR * (x + cube);
-        float tanh_out = tanhf(tanh_arg);
-        float coshf_out = coshf(tanh_arg);
+        float tanh_out = vmath_tanhf(tanh_arg);
+        float coshf_out = vmath_coshf(tanh_arg);
         float sech_out = 1.0f / (coshf_out * coshf_out);
         float local_grad = 0.5f * (1.0f + tanh_out) + x * 0.5f * sech_out * GELU_SCALING_FACTOR * (1.0f + 3.0f * 0.044715f * x * x);
         dinp[i] += local_grad * dout[i];
     }
 }
+
+// the input stage of matmul_gelu_backward: gelu_backward into dpre, and the column sums
+// of dpre into dbias (may be NULL), in one pass. Parallel over column blocks as in
+// gemm_colsum, so every dbias[j] is owned by one thread and summed over the rows in order
+#if defined(__GNUC__) && !defined(__clang__)
+__attribute__((optimize("no-finite-math-only")))
+#endif
+void gelu_backward_colsum(float* dpre, float* dbias, float* pre, float* dout, int BT, int OC) {
+    int num_blocks = (OC + GEMM_COLSUM_BLOCK - 1) / GEMM_COLSUM_BLOCK;
+    // #pragma omp parallel for
+    for (int jb = 0; jb < num_blocks; jb++) {
+        int j0 = jb * GEMM_COLSUM_BLOCK;
+        int n = OC - j0 < GEMM_COLSUM_BLOCK ? OC - j0 : GEMM_COLSUM_BLOCK;
+        float acc[GEMM_COLSUM_BLOCK] = {0.0f};
+        for (int i = 0; i < BT; i++) {
+            float* pre_i = pre + (size_t)i * OC + j0;
+            float* dout_i = dout + (size_t)i * OC + j0;
+            float* dpre_i = dpre + (size_t)i * OC + j0;
+            for (int j = 0; j < n; j++) {
+                float x = pre_i[j];
+                float cube = 0.044715f * x * x * x;
+                float tanh_arg = GELU_SCALING_FACTOR * (x + cube);
+                float tanh_out = vmath_tanhf(tanh_arg);
+                float coshf_out = vmath_coshf(tanh_arg);
+                float sech_out = 1.0f / (coshf_out * coshf_out);
+                float local_grad = 0.5f * (1.0f + tanh_out) + x * 0.5f * sech_out * GELU_SCALING_FACTOR * (1.0f + 3.0f * 0.044715f * x * x);
+                dpre_i[j] += local_grad * dout_i[j];
+                acc[j] += dpre_i[j];
+            }
+        }
+        for (int j = 0; dbias != NULL && j < n; j++) { dbias[j0 + j] += acc[j]; }
+    }
+}
 #pragma float_control(pop)
 
 void residual_forward(float* out, float* inp1, float* inp2, int N) {
@@ -454,9 +697,148 @@ void residual_backward(float* dinp1, float* dinp2, float* dout, int N) {
     }
 }
 
+// lanes of the vectorized Welford pass of residual_layernorm_forward
+#define LN_WELFORD_LANES 16
+
+void residual_layernorm_forward(float* residual, float* out,
+                                float* mean, float* rstd,
+                                float* inp1, float* inp2,
+                                float* weight, float* bias,
+                                int B, int T, int C) {
+    // residual_forward followed by layernorm_forward of its output, in one pass:
+    // residual = inp1 + inp2 and out = layernorm(residual) are both (B,T,C),
+    // mean and rstd are (B,T) as in layernorm_forward. residual may be inp2, to add in place.
+    // The mean and variance come from a single Welford pass over the sum as it is
+    // written, instead of separate passes for the add, the mean and the variance.
+    // Each of LN_WELFORD_LANES lanes runs the Welford recurrence over every
+    // LN_WELFORD_LANES-th channel, so the loop vectorizes, and the lanes are merged
+    // with the pairwise (Chan et al.) update at the end of the row
+    float eps = 1e-5f;
+    // #pragma omp parallel for collapse(2)
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            float* x1 = inp1 + b * T * C + t * C;
+            float* x2 = inp2 + b * T * C + t * C;
+            float* x = residual + b * T * C + t * C;
+            float lane_mean[LN_WELFORD_LANES] = {0.0f};
+            float lane_m2[LN_WELFORD_LANES] = {0.0f};
+            int steps = C / LN_WELFORD_LANES;
+            for (int k = 0; k < steps; k++) {
+                float inv_n = 1.0f / (k + 1);
+                for (int j = 0; j < LN_WELFORD_LANES; j++) {
+                    int i = k * LN_WELFORD_LANES + j;
+                    float xi = x1[i] + x2[i];
+                    x[i] = xi;
+                    float delta = xi - lane_mean[j];
+                    lane_mean[j] += delta * inv_n;
+                    lane_m2[j] += delta * (xi - lane_mean[j]);
+                }
+            }
+            // merge the lanes, each holding `steps` channels, then add the leftover channels
+            float n = 0.0f;
+            float m = 0.0f;
+            float m2 = 0.0f;
+            for (int j = 0; j < LN_WELFORD_LANES && steps > 0; j++) {
+                float n_new = n + steps;
+                float delta = lane_mean[j] - m;
+                m += delta * steps / n_new;
+                m2 += lane_m2[j] + delta * delta * n * steps / n_new;
+                n = n_new;
+            }
+            for (int i = steps * LN_WELFORD_LANES; i < C; i++) {
+                float xi = x1[i] + x2[i];
+                x[i] = xi;
+                n += 1.0f;
+                float delta = xi - m;
+                m += delta / n;
+                m2 += delta * (xi - m);
+            }
+            // the variance (without any bias correction), and the rstd
+            float s = 1.0f / sqrtf(m2 / C + eps);
+            // normalize, then scale and shift, while the row is still in L1
+            float* out_bt = out + b * T * C + t * C;
+            for (int i = 0; i < C; i++) {
+                float n_i = s * (x[i] - m);
+                out_bt[i] = n_i * weight[i] + bias[i];
+            }
+            mean[b * T + t] = m;
+            rstd[b * T + t] = s;
+        }
+    }
+}
+
+void residual_layernorm_backward(float* dinp1, float* dinp2, float* dweight, float* dbias,
+                                 float* dresidual, float* dout, float* residual, float* weight,
+                                 float* mean, float* rstd, int B, int T, int C) {
+    // backward of residual_layernorm_forward. The gradient of the residual sum is
+    // dresidual, from its other readers, plus the layernorm backward of dout, and it
+    // flows unchanged into both inputs, so residual_backward is folded into the row pass.
+    // dinp2 may be NULL, when the caller reads the gradient of inp2 from a zeroed dinp1
+    // #pragma omp parallel for collapse(2)
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            float* dout_bt = dout + b * T * C + t * C;
+            float* x = residual + b * T * C + t * C;
+            float* dresidual_bt = dresidual + b * T * C + t * C;
+            float* dinp1_bt = dinp1 + b * T * C + t * C;
+            float* dinp2_bt = dinp2 != NULL ? dinp2 + b * T * C + t * C : NULL;
+            float mean_bt = mean[b * T + t];
+            float rstd_bt = rstd[b * T + t];
+
+            // the two reductions of layernorm_backward
+            float dnorm_mean = 0.0f;
+            float dnorm_norm_mean = 0.0f;
+            for (int i = 0; i < C; i++) {
+                float norm_bti = (x[i] - mean_bt) * rstd_bt;
+                float dnorm_i = weight[i] * dout_bt[i];
+                dnorm_mean += dnorm_i;
+                dnorm_norm_mean += dnorm_i * norm_bti;
+            }
+            dnorm_mean = dnorm_mean / C;
+            dnorm_norm_mean = dnorm_norm_mean / C;
+
+            for (int i = 0; i < C; i++) {
+                float norm_bti = (x[i] - mean_bt) * rstd_bt;
+                float dnorm_i = weight[i] * dout_bt[i];
+                float dval = (dnorm_i - dnorm_mean - norm_bti * dnorm_norm_mean) * rstd_bt;
+                // gradient contribution to bias and weight
+                dbias[i] += dout_bt[i];
+                dweight[i] += norm_bti * dout_bt[i];
+                float dx = dresidual_bt[i] + dval;
+                dinp1_bt[i] += dx;
+                if (dinp2_bt != NULL) { dinp2_bt[i] += dx; }
+            }
+        }
+    }
+}
+
+void matmul_gelu_forward(float* pre, float* out,
+                         const float* inp, const float* weight, const float* bias,
+                         int B, int T, int C, int OC) {
+    // matmul_forward followed by gelu_forward: pre = inp @ weight^T + bias (B,T,OC) is
+    // kept for the backward, and out = gelu(pre). The GELU runs in the GEMM epilogue on
+    // every finished tile of pre while it is in L1, instead of as a second pass
+    GemmEpilogue epilogue = { GEMM_EPILOGUE_GELU, out, OC };
+    gemm_sgemm_ex(0, 1, B * T, OC, C, inp, C, weight, C, bias, pre, OC, 0, NULL, NULL, NULL, &epilogue);
+}
+
+void matmul_gelu_backward(float* dinp, float* dweight, float* dbias, float* dpre,
+                          float* dout, float* pre, const float* inp, const float* weight,
+                          int B, int T, int C, int OC) {
+    // backward of matmul_gelu_forward, where dout is the gradient of the GELU output.
+    // gelu_backward runs as the input stage of matmul_backward, together with the bias
+    // gradient, and leaves dpre, the gradient of pre, for the two weight GEMMs
+    gelu_backward_colsum(dpre, dbias, pre, dout, B * T, OC);
+    // dinp (B*T,C) += dpre (B*T,OC) @ weight (OC,C)
+    gemm_sgemm(0, 0, B * T, C, OC, dpre, OC, weight, C, NULL, dinp, C, 1);
+    // dweight (OC,C) += dpre^T (OC,B*T) @ inp (B*T,C)
+    gemm_sgemm(1, 0, OC, C, B * T, dpre, OC, inp, C, NULL, dweight, C, 1);
+}
+
 void softmax_forward(float* probs, float* logits, int B, int T, int V, int Vp) {
     // output: probs are (B,T,Vp) of the probabilities (sums to 1.0 in each b,t position)
     // input: logits is (B,T,Vp) of the unnormalized log probabilities
+    // probs may be logits, to softmax in place
     // Vp is the padded vocab size (for efficiency), V is the "real" vocab size
     // example: Vp is 50304 and V is 50257
     
@@ -476,7 +858,7 @@ void softmax_forward(float* probs, float* logits, int B, int T, int V, int Vp) {
             }
             float sum = 0.0f;
             for (int i = 0; i < V; i++) {
-                probs_bt[i] = expf(logits_bt[i] - maxval);
+                probs_bt[i] = vmath_expf(logits_bt[i] - maxval);
                 sum += probs_bt[i];
             }
             // note we only loop to V, leaving the padded dimensions
@@ -503,7 +885,7 @@ void crossentropy_forward(float* losses,
             // loss = -log(probs[target])
             float* probs_bt = probs + b * T * Vp + t * Vp;
             int ix = targets[b * T + t];
-            losses[b * T + t] = -logf(probs_bt[ix]);
+            losses[b * T + t] = -vmath_logf(probs_bt[ix]);
         }
     }
 }
@@ -529,6 +911,88 @@ void crossentropy_softmax_backward(float* dlogits,
     }
 }
 
+// rows of the batch and columns of the vocabulary in one block of logits of the fused loss head
+#define LM_HEAD_ROWS 512
+#define LM_HEAD_CHUNK 2048
+
+void lm_head_loss_forward(float* losses, float* lse,
+                          const float* inp, const float* wte, int* targets,
+                          int B, int T, int C, int V) {
+    // the LM head, softmax and cross-entropy in one: losses (B,T) = -log softmax(inp @ wte^T)[target]
+    // for inp (B,T,C) and wte (V,C). The logits are computed one LM_HEAD_ROWS x LM_HEAD_CHUNK
+    // block at a time and folded into a running (online) logsumexp per row, so neither the
+    // (B,T,Vp) logits nor the probs are ever stored, and the padded vocabulary is skipped.
+    // lse (B,T) keeps the logsumexp of every row for lm_head_loss_backward
+    int BT = B * T;
+    float* logits = (float*)mallocCheck((size_t)LM_HEAD_ROWS * LM_HEAD_CHUNK * sizeof(float));
+    float row_max[LM_HEAD_ROWS];
+    float row_sum[LM_HEAD_ROWS];
+    for (int r0 = 0; r0 < BT; r0 += LM_HEAD_ROWS) {
+        int rows = BT - r0 < LM_HEAD_ROWS ? BT - r0 : LM_HEAD_ROWS;
+        for (int v0 = 0; v0 < V; v0 += LM_HEAD_CHUNK) {
+            int n = V - v0 < LM_HEAD_CHUNK ? V - v0 : LM_HEAD_CHUNK;
+            gemm_sgemm(0, 1, rows, n, C, inp + (size_t)r0 * C, C, wte + (size_t)v0 * C, C, NULL, logits, n, 0);
+            // #pragma omp parallel for
+            for (int i = 0; i < rows; i++) {
+                const float* logits_i = logits + (size_t)i * n;
+                float m = logits_i[0];
+                for (int j = 1; j < n; j++) { m = logits_i[j] > m ? logits_i[j] : m; }
+                // fold the chunk into the running sum, rescaled to the new maximum
+                float s = 0.0f;
+                if (v0 > 0) {
+                    m = row_max[i] > m ? row_max[i] : m;
+                    s = row_sum[i] * vmath_expf(row_max[i] - m);
+                }
+                for (int j = 0; j < n; j++) { s += vmath_expf(logits_i[j] - m); }
+                row_max[i] = m;
+                row_sum[i] = s;
+                // loss = logsumexp - logit[target], the logsumexp is added once it is complete
+                int ix = targets[r0 + i] - v0;
+                if (0 <= ix && ix < n) { losses[r0 + i] = -logits_i[ix]; }
+            }
+        }
+        for (int i = 0; i < rows; i++) {
+            lse[r0 + i] = row_max[i] + vmath_logf(row_sum[i]);
+            losses[r0 + i] += lse[r0 + i];
+        }
+    }
+    free(logits);
+}
+
+void lm_head_loss_backward(float* dinp, float* dwte, float* dlosses,
+                           const float* inp, const float* wte, const float* lse, int* targets,
+                           int B, int T, int C, int V) {
+    // backward of lm_head_loss_forward: every block of logits is recomputed, turned into
+    // dlogits = (softmax - onehot(target)) * dloss in place using the saved lse, and
+    // multiplied straight into dinp (B,T,C) and dwte (V,C), which are accumulated into
+    int BT = B * T;
+    float* dlogits = (float*)mallocCheck((size_t)LM_HEAD_ROWS * LM_HEAD_CHUNK * sizeof(float));
+    for (int r0 = 0; r0 < BT; r0 += LM_HEAD_ROWS) {
+        int rows = BT - r0 < LM_HEAD_ROWS ? BT - r0 : LM_HEAD_ROWS;
+        for (int v0 = 0; v0 < V; v0 += LM_HEAD_CHUNK) {
+            int n = V - v0 < LM_HEAD_CHUNK ? V - v0 : LM_HEAD_CHUNK;
+            gemm_sgemm(0, 1, rows, n, C, inp + (size_t)r0 * C, C, wte + (size_t)v0 * C, C, NULL, dlogits, n, 0);
+            // #pragma omp parallel for
+            for (int i = 0; i < rows; i++) {
+                float* dlogits_i = dlogits + (size_t)i * n;
+                float lse_i = lse[r0 + i];
+                float dloss = dlosses[r0 + i];
+                int ix = targets[r0 + i] - v0;
+                for (int j = 0; j < n; j++) {
+                    float p = vmath_expf(dlogits_i[j] - lse_i);
+                    float indicator = j == ix ? 1.0f : 0.0f;
+                    dlogits_i[j] = (p - indicator) * dloss;
+                }
+            }
+            // dinp (rows,C) += dlogits (rows,n) @ wte (n,C)
+            gemm_sgemm(0, 0, rows, C, n, dlogits, n, wte + (size_t)v0 * C, C, NULL, dinp + (size_t)r0 * C, C, 1);
+            // dwte (n,C) += dlogits^T (n,rows) @ inp (rows,C)
+            gemm_sgemm(1, 0, n, C, rows, dlogits, n, inp + (size_t)r0 * C, C, NULL, dwte + (size_t)v0 * C, C, 1);
+        }
+    }
+    free(dlogits);
+}
+
 // ----------------------------------------------------------------------------
 // GPT-2 model definition
 
@@ -607,16 +1071,15 @@ float* malloc_and_point_parameters(ParameterTensors* params, size_t* param_sizes
     return params_memory;
 }
 
-#define NUM_ACTIVATION_TENSORS 23
+#define NUM_ACTIVATION_TENSORS 21
 typedef struct {
     float* encoded; // (B, T, C)
     float* ln1; // (L, B, T, C)
     float* ln1_mean; // (L, B, T)
     float* ln1_rstd; // (L, B, T)
-    float* qkv; // (L, B, T, 3*C)
+    float* qkv; // (L, B, 3, NH, T, C/NH), head-major, see matmul_forward_qkv
     float* atty; // (L, B, T, C)
-    float* preatt; // (L, B, NH, T, T)
-    float* att; // (L, B, NH, T, T)
+    float* att_lse; // (L, B, NH, T)
     float* attproj; // (L, B, T, C)
     float* residual2; // (L, B, T, C)
     float* ln2; // (L, B, T, C)
@@ -624,13 +1087,12 @@ typedef struct {
     float* ln2_rstd; // (L, B, T)
     float* fch; // (L, B, T, 4*C)
     float* fch_gelu; // (L, B, T, 4*C)
-    float* fcproj; // (L, B, T, C)
     float* residual3; // (L, B, T, C)
     float* lnf; // (B, T, C)
     float* lnf_mean; // (B, T)
     float* lnf_rstd; // (B, T)
-    float* logits; // (B, T, V)
-    float* probs; // (B, T, V)
+    float* logits_lse; // (B, T), logsumexp of the logits, see lm_head_loss_forward
+    float* probs; // (B, T, Vp), only for a forward without targets, see probs_memory
     float* losses; // (B, T)
 } ActivationTensors;
 
@@ -638,30 +1100,27 @@ void fill_in_activation_sizes(size_t* act_sizes, GPT2Config config, int B, int T
     size_t C = config.channels;
     size_t NH = config.num_heads;
     size_t L = config.num_layers;
-    size_t Vp = config.padded_vocab_size;
     act_sizes[0] = B * T * C; // encoded
     act_sizes[1] = L * B * T * C; // ln1
     act_sizes[2] = L * B * T; // ln1_mean
     act_sizes[3] = L * B * T; // ln1_rstd
     act_sizes[4] = L * B * T * 3 * C; // qkv
     act_sizes[5] = L * B * T * C; // atty
-    act_sizes[6] = L * B * NH * T * T; // preatt
-    act_sizes[7] = L * B * NH * T * T; // att
-    act_sizes[8] = L * B * T * C; // attproj
-    act_sizes[9] = L * B * T * C; // residual2
-    act_sizes[10] = L * B * T * C; // ln2
-    act_sizes[11] = L * B * T; // ln2_mean
-    act_sizes[12] = L * B * T; // ln2_rstd
-    act_sizes[13] = L * B * T * 4 * C; // fch
-    act_sizes[14] = L * B * T * 4 * C; // fch_gelu
-    act_sizes[15] = L * B * T * C; // fcproj
-    act_sizes[16] = L * B * T * C; // residual3
-    act_sizes[17] = B * T * C; // lnf
-    act_sizes[18] = B * T; // lnf_mean
-    act_sizes[19] = B * T; // lnf_rstd
-    act_sizes[20] = B * T * Vp; // logits
-    act_sizes[21] = B * T * Vp; // probs
-    act_sizes[22] = B * T; // losses
+    act_sizes[6] = L * B * NH * T; // att_lse
+    act_sizes[7] = L * B * T * C; // attproj
+    act_sizes[8] = L * B * T * C; // residual2
+    act_sizes[9] = L * B * T * C; // ln2
+    act_sizes[10] = L * B * T; // ln2_mean
+    act_sizes[11] = L * B * T; // ln2_rstd
+    act_sizes[12] = L * B * T * 4 * C; // fch
+    act_sizes[13] = L * B * T * 4 * C; // fch_gelu
+    act_sizes[14] = L * B * T * C; // residual3
+    act_sizes[15] = B * T * C; // lnf
+    act_sizes[16] = B * T; // lnf_mean
+    act_sizes[17] = B * T; // lnf_rstd
+    act_sizes[18] = B * T; // logits_lse
+    act_sizes[19] = 0; // probs, allocated on their own by the first forward without targets
+    act_sizes[20] = B * T; // losses
 }
 
 float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes) {
@@ -672,9 +1131,9 @@ float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes)
     float* acts_memory = (float*)mallocCheck(num_activations * sizeof(float));
     float** ptrs[] = {
         &acts->encoded, &acts->ln1, &acts->ln1_mean, &acts->ln1_rstd, &acts->qkv, &acts->atty,
-        &acts->preatt, &acts->att, &acts->attproj, &acts->residual2, &acts->ln2, &acts->ln2_mean,
-        &acts->ln2_rstd, &acts->fch, &acts->fch_gelu, &acts->fcproj, &acts->residual3, &acts->lnf,
-        &acts->lnf_mean, &acts->lnf_rstd, &acts->logits, &acts->probs, &acts->losses
+        &acts->att_lse, &acts->attproj, &acts->residual2, &acts->ln2, &acts->ln2_mean,
+        &acts->ln2_rstd, &acts->fch, &acts->fch_gelu, &acts->residual3, &acts->lnf,
+        &acts->lnf_mean, &acts->lnf_rstd, &acts->logits_lse, &acts->probs, &acts->losses
     };
     float* acts_memory_iterator = acts_memory;
     for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
@@ -705,6 +1164,9 @@ typedef struct {
     // gradients of the activations
     ActivationTensors grads_acts;
     float* grads_acts_memory;
+    // the (B, T, Vp) probs, only allocated once a forward runs without targets: training
+    // never needs them, and they have no gradient
+    float* probs_memory;
     // other run state configuration
     int batch_size; // the batch size (B) of current forward pass
     int seq_len; // the sequence length (T) of current forward pass
@@ -764,6 +1226,7 @@ void gpt2_build_from_checkpoint(GPT2 *model, const char* checkpoint_path) {
     model->m_memory = NULL;
     model->v_memory = NULL;
     model->grads_acts_memory = NULL;
+    model->probs_memory = NULL;
     model->inputs = NULL;
     model->targets = NULL;
     model->batch_size = 0;
@@ -856,8 +1319,7 @@ void gpt2_forward(GPT2 *model, int* inputs, int* targets, size_t B, size_t T) {
         float* l_ln1_rstd = acts.ln1_rstd + l * B * T;
         float* l_qkv = acts.qkv + l * B * T * 3*C;
         float* l_atty = acts.atty + l * B * T * C;
-        float* l_preatt = acts.preatt + l * B * NH * T * T;
-        float* l_att = acts.att + l * B * NH * T * T;
+        float* l_att_lse = acts.att_lse + l * B * NH * T;
         float* l_attproj = acts.attproj + l * B * T * C;
         float* l_residual2 = acts.residual2 + l * B * T * C;
         float* l_ln2 = acts.ln2 + l * B * T * C;
@@ -865,35 +1327,50 @@ void gpt2_forward(GPT2 *model, int* inputs, int* targets, size_t B, size_t T) {
         float* l_ln2_rstd = acts.ln2_rstd + l * B * T;
         float* l_fch = acts.fch + l * B * T * 4*C;
         float* l_fch_gelu = acts.fch_gelu + l * B * T * 4*C;
-        float* l_fcproj = acts.fcproj + l * B * T * C;
         float* l_residual3 = acts.residual3 + l * B * T * C;
 
+        // the LayerNorm that reads this layer's residual3: the next layer's ln1, or lnf
+        int has_next = l + 1 < (int)L;
+        float* next_ln = has_next ? acts.ln1 + (l+1) * B * T * C : acts.lnf;
+        float* next_ln_mean = has_next ? acts.ln1_mean + (l+1) * B * T : acts.lnf_mean;
+        float* next_ln_rstd = has_next ? acts.ln1_rstd + (l+1) * B * T : acts.lnf_rstd;
+        float* next_lnw = has_next ? params.ln1w + (l+1) * C : params.lnfw;
+        float* next_lnb = has_next ? params.ln1b + (l+1) * C : params.lnfb;
+
         // now do the forward pass
-        layernorm_forward(l_ln1, l_ln1_mean, l_ln1_rstd, residual, l_ln1w, l_ln1b, B, T, C);
-        matmul_forward(l_qkv, l_ln1, l_qkvw, l_qkvb, B, T, C, 3*C);
-        attention_forward(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH);
+        // (ln1 of the later layers was written with the previous layer's residual3)
+        if (l == 0) {
+            layernorm_forward(l_ln1, l_ln1_mean, l_ln1_rstd, residual, l_ln1w, l_ln1b, B, T, C);
+        }
+        matmul_forward_qkv(l_qkv, l_ln1, l_qkvw, l_qkvb, B, T, C, NH);
+        attention_forward(l_atty, l_att_lse, l_qkv, B, T, C, NH);
         matmul_forward(l_attproj, l_atty, l_attprojw, l_attprojb, B, T, C, C);
-        residual_forward(l_residual2, residual, l_attproj, B*T*C);
-        layernorm_forward(l_ln2, l_ln2_mean, l_ln2_rstd, l_residual2, l_ln2w, l_ln2b, B, T, C);
-        matmul_forward(l_fch, l_ln2, l_fcw, l_fcb, B, T, C, 4*C);
-        gelu_forward(l_fch_gelu, l_fch, B*T*4*C);
-        matmul_forward(l_fcproj, l_fch_gelu, l_fcprojw, l_fcprojb, B, T, 4*C, C);
-        residual_forward(l_residual3, l_residual2, l_fcproj, B*T*C);
+        residual_layernorm_forward(l_residual2, l_ln2, l_ln2_mean, l_ln2_rstd, residual, l_attproj,
+                                   l_ln2w, l_ln2b, B, T, C);
+        matmul_gelu_forward(l_fch, l_fch_gelu, l_ln2, l_fcw, l_fcb, B, T, C, 4*C);
+        // the fcproj output goes to residual3, which the residual add then updates in place
+        matmul_forward(l_residual3, l_fch_gelu, l_fcprojw, l_fcprojb, B, T, 4*C, C);
+        residual_layernorm_forward(l_residual3, next_ln, next_ln_mean, next_ln_rstd, l_residual2, l_residual3,
+                                   next_lnw, next_lnb, B, T, C);
     }
-    residual = acts.residual3 + (L-1) * B * T * C; // last residual is in residual3
-    layernorm_forward(acts.lnf, acts.lnf_mean, acts.lnf_rstd, residual, params.lnfw, params.lnfb, B, T, C);
-    matmul_forward(acts.logits, acts.lnf, params.wte, NULL, B, T, C, Vp);
-    softmax_forward(acts.probs, acts.logits, B, T, V, Vp);
 
-    // also forward the cross-entropy loss function if we have the targets
+    // with targets, the fused loss head never stores the logits or the probs,
+    // otherwise compute the probs, in place of their logits
     if (targets != NULL) {
-        crossentropy_forward(model->acts.losses, model->acts.probs, targets, B, T, Vp);
+        lm_head_loss_forward(acts.losses, acts.logits_lse, acts.lnf, params.wte, targets, B, T, C, V);
         // for convenience also evaluate the mean loss
         float mean_loss = 0.0f;
         for (int i=0; i<B*T; i++) { mean_loss += model->acts.losses[i]; }
         mean_loss /= B*T;
         model->mean_loss = mean_loss;
     } else {
+        if (model->probs_memory == NULL) {
+            model->probs_memory = (float*)mallocCheck(B * T * Vp * sizeof(float));
+            model->acts.probs = model->probs_memory;
+            acts.probs = model->probs_memory;
+        }
+        matmul_forward(acts.probs, acts.lnf, params.wte, NULL, B, T, C, Vp);
+        softmax_forward(acts.probs, acts.probs, B, T, V, Vp);
         // if we don't have targets, we don't have a loss
         model->mean_loss = -1.0f;
     }
@@ -923,7 +1400,6 @@ void gpt2_backward(GPT2 *model) {
     size_t B = model->batch_size;
     size_t T = model->seq_len;
     size_t V = model->config.vocab_size;
-    size_t Vp = model->config.padded_vocab_size;
     size_t L = model->config.num_layers;
     size_t NH = model->config.num_heads;
     size_t C = model->config.channels;
@@ -940,16 +1416,21 @@ void gpt2_backward(GPT2 *model) {
     float dloss_mean = 1.0f / (B*T);
     for (int i = 0; i < B*T; i++) { grads_acts.losses[i] = dloss_mean; }
 
-    crossentropy_softmax_backward(grads_acts.logits, grads_acts.losses, acts.probs, model->targets, B, T, V, Vp);
-    matmul_backward(grads_acts.lnf, grads.wte, NULL, grads_acts.logits, acts.lnf, params.wte, B, T, C, Vp);
-    float* residual = acts.residual3 + (L-1) * B * T * C; // last layer's residual
-    float* dresidual = grads_acts.residual3 + (L-1) * B * T * C; // write to last layer's residual
-    layernorm_backward(dresidual, grads.lnfw, grads.lnfb, grads_acts.lnf, residual, params.lnfw, acts.lnf_mean, acts.lnf_rstd, B, T, C);
-
+    lm_head_loss_backward(grads_acts.lnf, grads.wte, grads_acts.losses, acts.lnf, params.wte, acts.logits_lse,
+                          model->targets, B, T, C, V);
     for (int l = L-1; l >= 0; l--) {
 
-        residual = l == 0 ? acts.encoded : acts.residual3 + (l-1) * B * T * C;
-        dresidual = l == 0 ? grads_acts.encoded : grads_acts.residual3 + (l-1) * B * T * C;
+        float* residual = l == 0 ? acts.encoded : acts.residual3 + (l-1) * B * T * C;
+        float* dresidual = l == 0 ? grads_acts.encoded : grads_acts.residual3 + (l-1) * B * T * C;
+
+        // the LayerNorm fused with this layer's residual3, see gpt2_forward
+        int has_next = l + 1 < (int)L;
+        float* next_ln_mean = has_next ? acts.ln1_mean + (l+1) * B * T : acts.lnf_mean;
+        float* next_ln_rstd = has_next ? acts.ln1_rstd + (l+1) * B * T : acts.lnf_rstd;
+        float* next_lnw = has_next ? params.ln1w + (l+1) * C : params.lnfw;
+        float* dnext_lnw = has_next ? grads.ln1w + (l+1) * C : grads.lnfw;
+        float* dnext_lnb = has_next ? grads.ln1b + (l+1) * C : grads.lnfb;
+        float* dnext_ln = has_next ? grads_acts.ln1 + (l+1) * B * T * C : grads_acts.lnf;
 
         // get the pointers of the weights for this layer
         float* l_ln1w = params.ln1w + l * C;
@@ -977,68 +1458,54 @@ void gpt2_backward(GPT2 *model) {
         float* l_ln1_rstd = acts.ln1_rstd + l * B * T;
         float* l_qkv = acts.qkv + l * B * T * 3*C;
         float* l_atty = acts.atty + l * B * T * C;
-        float* l_att = acts.att + l * B * NH * T * T;
+        float* l_att_lse = acts.att_lse + l * B * NH * T;
         float* l_residual2 = acts.residual2 + l * B * T * C;
         float* l_ln2 = acts.ln2 + l * B * T * C;
         float* l_ln2_mean = acts.ln2_mean + l * B * T;
         float* l_ln2_rstd = acts.ln2_rstd + l * B * T;
         float* l_fch = acts.fch + l * B * T * 4*C;
         float* l_fch_gelu = acts.fch_gelu + l * B * T * 4*C;
+        float* l_residual3 = acts.residual3 + l * B * T * C;
         // get the pointers of the gradients of the activations for this layer
         float* dl_ln1 = grads_acts.ln1 + l * B * T * C;
         float* dl_qkv = grads_acts.qkv + l * B * T * 3*C;
         float* dl_atty = grads_acts.atty + l * B * T * C;
-        float* dl_preatt = grads_acts.preatt + l * B * NH * T * T;
-        float* dl_att = grads_acts.att + l * B * NH * T * T;
         float* dl_attproj = grads_acts.attproj + l * B * T * C;
         float* dl_residual2 = grads_acts.residual2 + l * B * T * C;
         float* dl_ln2 = grads_acts.ln2 + l * B * T * C;
         float* dl_fch = grads_acts.fch + l * B * T * 4*C;
         float* dl_fch_gelu = grads_acts.fch_gelu + l * B * T * 4*C;
-        float* dl_fcproj = grads_acts.fcproj + l * B * T * C;
         float* dl_residual3 = grads_acts.residual3 + l * B * T * C;
 
         // backprop this layer
-        residual_backward(dl_residual2, dl_fcproj, dl_residual3, B*T*C);
-        matmul_backward(dl_fch_gelu, dl_fcprojw, dl_fcprojb, dl_fcproj, l_fch_gelu, l_fcprojw, B, T, 4*C, C);
-        gelu_backward(dl_fch, l_fch, dl_fch_gelu, B*T*4*C);
-        matmul_backward(dl_ln2, dl_fcw, dl_fcb, dl_fch, l_ln2, l_fcw, B, T, C, 4*C);
-        layernorm_backward(dl_residual2, dl_ln2w, dl_ln2b, dl_ln2, l_residual2, l_ln2w, l_ln2_mean, l_ln2_rstd, B, T, C);
-        residual_backward(dresidual, dl_attproj, dl_residual2, B*T*C);
+        // the gradient of residual3 goes to dl_residual2, which nothing has written yet, so it
+        // is also the gradient of the fcproj output
+        residual_layernorm_backward(dl_residual2, NULL, dnext_lnw, dnext_lnb, dl_residual3, dnext_ln,
+                                    l_residual3, next_lnw, next_ln_mean, next_ln_rstd, B, T, C);
+        matmul_backward(dl_fch_gelu, dl_fcprojw, dl_fcprojb, dl_residual2, l_fch_gelu, l_fcprojw, B, T, 4*C, C);
+        matmul_gelu_backward(dl_ln2, dl_fcw, dl_fcb, dl_fch, dl_fch_gelu, l_fch, l_ln2, l_fcw, B, T, C, 4*C);
+        residual_layernorm_backward(dresidual, dl_attproj, dl_ln2w, dl_ln2b, dl_residual2, dl_ln2,
+                                    l_residual2, l_ln2w, l_ln2_mean, l_ln2_rstd, B, T, C);
         matmul_backward(dl_atty, dl_attprojw, dl_attprojb, dl_attproj, l_atty, l_attprojw, B, T, C, C);
-        attention_backward(dl_qkv, dl_preatt, dl_att, dl_atty, l_qkv, l_att, B, T, C, NH);
-        matmul_backward(dl_ln1, dl_qkvw, dl_qkvb, dl_qkv, l_ln1, l_qkvw, B, T, C, 3*C);
-        layernorm_backward(dresidual, dl_ln1w, dl_ln1b, dl_ln1, residual, l_ln1w, l_ln1_mean, l_ln1_rstd, B, T, C);
+        attention_backward(dl_qkv, dl_atty, l_qkv, l_atty, l_att_lse, B, T, C, NH);
+        matmul_backward_qkv(dl_ln1, dl_qkvw, dl_qkvb, dl_qkv, l_ln1, l_qkvw, B, T, C, NH);
+        if (l == 0) {
+            layernorm_backward(dresidual, dl_ln1w, dl_ln1b, dl_ln1, residual, l_ln1w, l_ln1_mean, l_ln1_rstd, B, T, C);
+        }
     }
     encoder_backward(grads.wte, grads.wpe, grads_acts.encoded, model->inputs, B, T, C);
 }
 
-void gpt2_update(GPT2 *model, float learning_rate, float beta1, float beta2, float eps, float weight_decay, int t) {
-    // reference: https://pytorch.org/docs/stable/generated/torch.optim.AdamW.html
+float gpt2_update(GPT2 *model, float learning_rate, float beta1, float beta2, float eps, float weight_decay, float grad_clip, int t) {
+    // AdamW, see adamw_update. gpt2_zero_grad clears the gradients before the backward
 
     // lazily allocate the memory for m_memory and v_memory
     if (model->m_memory == NULL) {
         model->m_memory = (float*)calloc(model->num_parameters, sizeof(float));
         model->v_memory = (float*)calloc(model->num_parameters, sizeof(float));
     }
-
-    for (size_t i = 0; i < model->num_parameters; i++) {
-        float param = model->params_memory[i];
-        float grad = model->grads_memory[i];
-
-        // update the first moment (momentum)
-        float m = beta1 * model->m_memory[i] + (1.0f - beta1) * grad;
-        // update the second moment (RMSprop)
-        float v = beta2 * model->v_memory[i] + (1.0f - beta2) * grad * grad;
-        // bias-correct both moments
-        float m_hat = m / (1.0f - powf(beta1, t));
-        float v_hat = v / (1.0f - powf(beta2, t));
-
-        // update
-        model->m_memory[i] = m;
-        model->v_memory[i] = v;
-        model->params_memory[i] -= learning_rate * (m_hat / (sqrtf(v_hat) + eps) + weight_decay * param);
-    }
+    return adamw_update(model->params_memory, model->grads_memory, model->m_memory, model->v_memory,
+                        model->num_parameters, learning_rate, beta1, beta2, eps, weight_decay, grad_clip, 0, t, NULL);
 }
 
 void gpt2_free(GPT2 *model) {
@@ -1048,6 +1515,7 @@ void gpt2_free(GPT2 *model) {
     free(model->v_memory);
     free(model->acts_memory);
     free(model->grads_acts_memory);
+    free(model->probs_memory);
     free(model->inputs);
     free(model->targets);
 }
@@ -1174,7 +1642,7 @@ int main() {
         gpt2_forward(&model, train_loader.inputs, train_loader.targets, B, T);
         gpt2_zero_grad(&model);
         gpt2_backward(&model);
-        gpt2_update(&model, 1e-4f, 0.9f, 0.999f, 1e-8f, 0.0f, step+1);
+        gpt2_update(&model, 1e-4f, 0.9f, 0.999f, 1e-8f, 0.0f, 0.0f, step+1);
         clock_gettime(CLOCK_MONOTONIC, &end);
         double time_elapsed_s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
         printf("step %d: train loss %f (took %f ms)\n", step, model.mean_loss, time_elapsed_s * 1000);